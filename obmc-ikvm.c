@@ -21,10 +21,7 @@
 #include <getopt.h>
 #include "rfbnpcm750.h"
 #include "rfbusbhid.h"
-
-#define MAX_CL 5
-
-struct nu_rfb *nurfb = NULL;
+#include "rfbtls.h"
 
 /* @brief Cursor bitmap width */
 static  int cursorWidth = 20;
@@ -77,34 +74,41 @@ static char cursorMask[] = " o                  "
 
 static void clientgone(rfbClientPtr cl)
 {
+    struct nu_rfb *nurfb = rfbNuScreenRfb(cl->screen);
+
+    rfbNuUnwatchClient(cl);
+    rfbNuSessionDestroy(rfbNuSession(cl));
     nurfb->cl_cnt--;
 
     if (nurfb->cl_cnt == 0)
-    {
-        rfbNuResetVCD(nurfb);
-        rfbNuResetECE(nurfb);
-    }
-
-    cl->clientData = NULL;
+        rfbNuHwSleep(nurfb);
 }
 
 static enum rfbNewClientAction newclient(rfbClientPtr cl)
 {
-    if ((nurfb->cl_cnt + 1) > MAX_CL)
-        return RFB_CLIENT_REFUSE;
+    struct nu_rfb *nurfb = rfbNuScreenRfb(cl->screen);
 
-    nurfb->cl_cnt++;
+    if ((nurfb->cl_cnt + 1) > nurfb->max_clients)
+        return RFB_CLIENT_REFUSE;
 
-    if (nurfb->cl_cnt == 1) {
-        nurfb->sock_start = cl->sock;
+    if (!rfbNuHwWake(nurfb, cl->screen))
+    {
+        rfbErr("video hardware did not come up\n");
+        return RFB_CLIENT_REFUSE;
     }
 
-	for (int i = 0 ; i < nurfb->cl_cnt; i++) {
-		nurfb->refreshCount[i] = REFRESHCNT;
+    /* only the new client needs a full frame, see rfbNuSendKeyframe() */
+    if (!rfbNuSessionCreate(nurfb, cl))
+    {
+        if (nurfb->cl_cnt == 0)
+            rfbNuHwSleep(nurfb);
+        return RFB_CLIENT_REFUSE;
     }
 
-    cl->clientData = nurfb;
+    nurfb->cl_cnt++;
+
     cl->clientGoneHook = clientgone;
+    rfbNuWatchClient(cl);
     cl->preferredEncoding = rfbEncodingHextile;
 
     rfbLog("client bitsPerPixel: bpp %d\n", cl->format.bitsPerPixel);
@@ -112,28 +116,178 @@ static enum rfbNewClientAction newclient(rfbClientPtr cl)
     return RFB_CLIENT_ACCEPT;
 }
 
+/*
+ * Append a view-only password to the list -passwd set up, clients that
+ * log in with it join as viewers.
+ */
+static rfbBool add_view_password(rfbScreenInfoPtr screen, char *passwd)
+{
+    char **old = screen->authPasswdData;
+    char **list;
+    int n = 0;
+
+    if (old && screen->passwordCheck != rfbCheckPasswordByList)
+    {
+        rfbErr("a view-only password needs -passwd, not -rfbauth\n");
+        return FALSE;
+    }
+
+    while (old && old[n])
+        n++;
+
+    if (!n)
+        rfbLog("no -passwd given, every client that logs in is a viewer\n");
+
+    list = calloc(n + 2, sizeof(char *));
+    if (!list)
+        return FALSE;
+
+    if (n)
+        memcpy(list, old, n * sizeof(char *));
+    list[n] = passwd;
+
+    screen->authPasswdData = list;
+    screen->authPasswdFirstViewOnly = n;
+    screen->passwordCheck = rfbCheckPasswordByList;
+
+    return TRUE;
+}
+
 void usage()
 {
     fprintf(stderr, "OpenBMC IKVM daemon\n");
     fprintf(stderr, "Usage: obmc-ikvm [options]\n");
     fprintf(stderr, "-f dump fps per seconds\n");
+    fprintf(stderr, "-c encoded tile cache size in KB, 0 to disable (default %d)\n",
+            TILE_CACHE_DEFAULT_KB);
+    fprintf(stderr, "-t verify diff rects against the last sent frame, drop tiles\n"
+                    "   whose channels all differ by at most this value (5-bit scale)\n");
+    fprintf(stderr, "-p progressive mode, send large changes colour reduced first and\n"
+                    "   refine them losslessly after this many static frames\n");
+    fprintf(stderr, "-8 advertise an 8bpp BGR233 framebuffer for low bandwidth links\n");
+    fprintf(stderr, "-S downscale new clients by this integer factor (needs NewFBSize)\n");
+    fprintf(stderr, "-z send large hardware encoded rects with MSG_ZEROCOPY\n");
+    fprintf(stderr, "-a send to each client from its own thread, merging updates\n"
+                    "   for clients that fall behind\n");
+    fprintf(stderr, "-l latency budget in ms, hold back updates while a client's socket\n"
+                    "   has more queued than it can deliver in that time\n");
+    fprintf(stderr, "-b bandwidth cap per client in KB/s, skips frames and then\n"
+                    "   reduces colours when exceeded\n");
+    fprintf(stderr, "-B bandwidth cap for all clients together in KB/s\n");
+    fprintf(stderr, "-F frame rate cap per client, 0 for unlimited\n");
+    fprintf(stderr, "-u accept RFB connections on this unix socket path\n");
+    fprintf(stderr, "-P accept client fds passed with SCM_RIGHTS on this unix socket path\n");
+    fprintf(stderr, "-n do not listen on TCP, needs -u or -P\n");
+    fprintf(stderr, "-w accept binary websocket viewers on this TCP port, one more port per\n"
+                    "   pipeline; hardware hextile is framed in place, no VeNCrypt there\n");
+    fprintf(stderr, "-T offer VeNCrypt TLS on kernel TLS, certificate from -sslcertfile\n"
+                    "   and -sslkeyfile\n");
+    fprintf(stderr, "-e refuse clients that did not use VeNCrypt, implies -T\n");
+    fprintf(stderr, "-i longest compare interval in ms once the screen is static, 0 keeps\n"
+                    "   comparing at full rate (default %d)\n", IDLE_BACKOFF_DEFAULT_MS);
+    fprintf(stderr, "-m maximum number of clients (default %d)\n", MAX_CL);
+    fprintf(stderr, "-v view-only password, clients using it can watch but not type\n");
+    fprintf(stderr, "-o single operator, clients joining while another one has the\n"
+                    "   console become viewers until it leaves\n");
+    fprintf(stderr, "-V frame rate cap for viewers, 0 for the -F cap (default %d)\n",
+            VIEWER_FPS_DEFAULT);
+    fprintf(stderr, "-N run this many pipelines on consecutive ports (max %d), all\n"
+                    "   but the first show the software test pattern\n", MAX_PIPELINES);
+    fprintf(stderr, "-x show the software test pattern instead of the video hardware\n");
+    fprintf(stderr, "-G host[:port] relay mode, connect out to a gateway listening there\n"
+                    "   (default port %d) and serve it as one client\n", RELAY_DEFAULT_PORT);
+    fprintf(stderr, "-R unmap capture and encode buffers while no client is connected\n");
+    fprintf(stderr, "-r rolling refresh, resend 1/N of the screen with each update instead\n"
+                    "   of repeated full frames after a mode change (32 is a good start)\n");
     rfbUsage();
 }
 
 int main(int argc, char **argv)
 {
-    int ret = 0, dump_fps = 0, option;
+    int dump_fps = 0, option;
+    int tile_cache_kb = TILE_CACHE_DEFAULT_KB;
+    int verify_tolerance = -1;
+    int progressive = 0;
+    int bpp8 = 0;
+    int scale = 1;
+    int zerocopy = 0;
+    int async_send = 0;
+    int latency_budget = 0;
+    int client_kbps = 0;
+    int total_kbps = 0;
+    int max_fps = 0;
+    const char *unix_path = NULL;
+    const char *fdpass_path = NULL;
+    int no_tcp = 0;
+    int ws_port = 0;
+    int tls = 0;
+    int idle_max_ms = IDLE_BACKOFF_DEFAULT_MS;
+    int hw_release = 0;
+    int rolling = 0;
+    int max_clients = MAX_CL;
+    char *view_passwd = NULL;
+    int single_operator = 0;
+    int viewer_fps = VIEWER_FPS_DEFAULT;
+    int pipelines = 1;
+    int pattern = 0;
+    struct nu_hid *hid = NULL;
+    rfbScreenInfoPtr screens[MAX_PIPELINES];
+    int ready = 0;
+    char *pipeline_argv[64] = {NULL};
+    int pipeline_argc;
+    rfbScreenInfoPtr probe;
+    int base_port = 0, base_port6 = 0;
+    const char *relay = NULL;
     unsigned char hsync_mode = 0;
-    const char *opts = "hsf:";
-#ifdef KEYBOARD_EVENT
-    pthread_t rfb;
-#endif
+    const char *opts = "hsf:c:t:p:8S:zal:b:B:F:u:P:nw:Tei:Rr:m:v:oV:N:xG:";
     struct option lopts[] = {
         {"help", 0, 0, 'h'},
         {"hsync mode", 0, 0, 's'},
         {"dump_fps", 1, 0, 'f'},
+        {"tile_cache", 1, 0, 'c'},
+        {"verify_tolerance", 1, 0, 't'},
+        {"progressive", 1, 0, 'p'},
+        {"bpp8", 0, 0, '8'},
+        {"scale", 1, 0, 'S'},
+        {"zerocopy", 0, 0, 'z'},
+        {"async_send", 0, 0, 'a'},
+        {"latency_budget", 1, 0, 'l'},
+        {"client_rate", 1, 0, 'b'},
+        {"total_rate", 1, 0, 'B'},
+        {"max_fps", 1, 0, 'F'},
+        {"unix_socket", 1, 0, 'u'},
+        {"fd_socket", 1, 0, 'P'},
+        {"no_tcp", 0, 0, 'n'},
+        {"ws_port", 1, 0, 'w'},
+        {"vencrypt", 0, 0, 'T'},
+        {"tls_required", 0, 0, 'e'},
+        {"idle_backoff", 1, 0, 'i'},
+        {"hw_release", 0, 0, 'R'},
+        {"rolling", 1, 0, 'r'},
+        {"max_clients", 1, 0, 'm'},
+        {"view_passwd", 1, 0, 'v'},
+        {"single_operator", 0, 0, 'o'},
+        {"viewer_fps", 1, 0, 'V'},
+        {"pipelines", 1, 0, 'N'},
+        {"pattern", 0, 0, 'x'},
+        {"relay", 1, 0, 'G'},
         {0, 0, 0, 0}};
 
+    /* rfbGetScreen() eats the libvncserver options, each pipeline needs them */
+    pipeline_argc = argc < (int)ARRAY_SIZE(pipeline_argv) ?
+                    argc : (int)ARRAY_SIZE(pipeline_argv);
+    for (int i = 0; i < pipeline_argc; i++)
+        pipeline_argv[i] = argv[i];
+
+    /*
+     * Take the libvncserver options out before getopt sees them, otherwise
+     * -sslcertfile or -rfbport would be read as a row of our short options
+     */
+    probe = rfbGetScreen(&argc, argv, 4, 4, BitsPerSample, SamplesPerPixel, BytesPerPixel);
+    if (!probe)
+        return 0;
+    rfbScreenCleanup(probe);
+
     while ((option = getopt_long(argc, argv, opts, lopts, NULL)) != -1)
     {
         switch (option)
@@ -143,6 +297,115 @@ int main(int argc, char **argv)
             if (dump_fps < 0 || dump_fps > 60)
                 dump_fps = 30;
             break;
+        case 'c':
+            tile_cache_kb = (int)strtol(optarg, NULL, 0);
+            if (tile_cache_kb < 0)
+                tile_cache_kb = 0;
+            break;
+        case 't':
+            verify_tolerance = (int)strtol(optarg, NULL, 0);
+            if (verify_tolerance > 31)
+                verify_tolerance = 31;
+            break;
+        case 'p':
+            progressive = (int)strtol(optarg, NULL, 0);
+            if (progressive < 0)
+                progressive = 0;
+            break;
+        case '8':
+            bpp8 = 1;
+            break;
+        case 'S':
+            scale = (int)strtol(optarg, NULL, 0);
+            if (scale < 1 || scale > 8)
+                scale = 1;
+            break;
+        case 'z':
+            zerocopy = 1;
+            break;
+        case 'a':
+            async_send = 1;
+            break;
+        case 'l':
+            latency_budget = (int)strtol(optarg, NULL, 0);
+            if (latency_budget < 0)
+                latency_budget = 0;
+            break;
+        case 'b':
+            client_kbps = (int)strtol(optarg, NULL, 0);
+            if (client_kbps < 0)
+                client_kbps = 0;
+            break;
+        case 'B':
+            total_kbps = (int)strtol(optarg, NULL, 0);
+            if (total_kbps < 0)
+                total_kbps = 0;
+            break;
+        case 'F':
+            max_fps = (int)strtol(optarg, NULL, 0);
+            if (max_fps < 0 || max_fps > 60)
+                max_fps = 0;
+            break;
+        case 'u':
+            unix_path = optarg;
+            break;
+        case 'P':
+            fdpass_path = optarg;
+            break;
+        case 'n':
+            no_tcp = 1;
+            break;
+        case 'w':
+            ws_port = (int)strtol(optarg, NULL, 0);
+            if (ws_port < 0 || ws_port > 65535 - MAX_PIPELINES)
+                ws_port = 0;
+            break;
+        case 'T':
+            tls |= 1;
+            break;
+        case 'e':
+            tls |= 2;
+            break;
+        case 'i':
+            idle_max_ms = (int)strtol(optarg, NULL, 0);
+            if (idle_max_ms < 0)
+                idle_max_ms = 0;
+            break;
+        case 'R':
+            hw_release = 1;
+            break;
+        case 'r':
+            rolling = (int)strtol(optarg, NULL, 0);
+            if (rolling < 0 || rolling > ROLL_DIV_MAX)
+                rolling = 0;
+            break;
+        case 'm':
+            max_clients = (int)strtol(optarg, NULL, 0);
+            if (max_clients < 1)
+                max_clients = MAX_CL;
+            break;
+        case 'v':
+            view_passwd = optarg;
+            break;
+        case 'o':
+            single_operator = 1;
+            break;
+        case 'V':
+            viewer_fps = (int)strtol(optarg, NULL, 0);
+            if (viewer_fps < 0 || viewer_fps > 60)
+                viewer_fps = VIEWER_FPS_DEFAULT;
+            break;
+        case 'N':
+            pipelines = (int)strtol(optarg, NULL, 0);
+            if (pipelines < 1 || pipelines > MAX_PIPELINES)
+                pipelines = 1;
+            break;
+        case 'x':
+            pattern = 1;
+            break;
+        case 'G':
+            relay = optarg;
+            break;
         case 's':
             hsync_mode = 1;
             break;
@@ -153,50 +416,142 @@ int main(int argc, char **argv)
         }
     }
 
-    nurfb = rfbInitNuRfb(hsync_mode);
-    if (!nurfb)
-        return 0;
+    if (pipelines > 1 && (unix_path || fdpass_path))
+        rfbLog("local listeners only serve the first pipeline\n");
 
-    nurfb->dumpfps = dump_fps;
+    /* a single USB gadget, the first pipeline drives it */
+    if (!pattern)
+    {
+        hid = hid_init();
+        if (!hid)
+            return 0;
+    }
 
-    ret = hid_init();
-    if (ret)
-        return 0;
+    rfbNuRegisterExtensions();
 
-    rfbScreenInfoPtr rfbScreen =
-        rfbGetScreen(&argc, argv, nurfb->vcd_info.hdisp, nurfb->vcd_info.vdisp,
-                     BitsPerSample, SamplesPerPixel, BytesPerPixel);
-    if (!rfbScreen)
-        return 0;
+    for (int p = 0; p < pipelines; p++)
+    {
+        int args_cnt = pipeline_argc;
+        char *args[ARRAY_SIZE(pipeline_argv)];
+        struct nu_rfb *nurfb;
+        rfbScreenInfoPtr rfbScreen;
+
+        /* there is one VCD/ECE, further heads run the software pattern */
+        nurfb = rfbInitNuRfb(hsync_mode, pattern || p > 0, p ? NULL : hid);
+        if (!nurfb)
+            goto cleanup;
+
+        nurfb->index = p;
+        nurfb->dumpfps = dump_fps;
+        nurfb->tile_cache = rfbNuTileCacheCreate((size_t)tile_cache_kb << 10);
+        nurfb->verify_tolerance = verify_tolerance;
+        nurfb->progressive = progressive;
+        nurfb->default_scale = scale;
+        nurfb->zerocopy = zerocopy;
+        nurfb->async_send = async_send;
+        nurfb->latency_budget = latency_budget;
+        nurfb->client_kbps = client_kbps;
+        nurfb->max_fps = max_fps;
+        nurfb->tls_required = !!(tls & 2);
+        nurfb->idle_max_ms = idle_max_ms;
+        nurfb->hw_release = hw_release;
+        nurfb->rolling = rolling;
+        nurfb->max_clients = max_clients;
+        nurfb->viewer_fps = viewer_fps;
+        nurfb->single_operator = single_operator;
+        rfbNuBucketInit(&nurfb->total_rate, total_kbps);
+        if (bpp8 && !rfbNuSetBpp8(nurfb, 1))
+            rfbLog("8bpp mode unavailable, using 16bpp\n");
+
+        memcpy(args, pipeline_argv, sizeof(args));
+        rfbScreen =
+            nurfb->bpp8 ?
+            rfbGetScreen(&args_cnt, args, nurfb->vcd_info.hdisp, nurfb->vcd_info.vdisp,
+                         BitsPerSample8, SamplesPerPixel8, BytesPerPixel8) :
+            rfbGetScreen(&args_cnt, args, nurfb->vcd_info.hdisp, nurfb->vcd_info.vdisp,
+                         BitsPerSample, SamplesPerPixel, BytesPerPixel);
+        if (!rfbScreen)
+        {
+            rfbClearNuRfb(nurfb);
+            goto cleanup;
+        }
+
+        /* from here on the cleanup below releases the pipeline */
+        screens[p] = rfbScreen;
+        ready = p + 1;
+        rfbScreen->screenData = nurfb;
+        rfbNuInitRfbFormat(rfbScreen);
+
+        rfbScreen->desktopName = "obmc iKVM";
+        rfbScreen->frameBuffer = malloc(nurfb->vcd_info.hdisp * nurfb->vcd_info.vdisp * 3); //nurfb->raw_fb_addr;
+        rfbScreen->alwaysShared = TRUE;
+        rfbScreen->ptrAddEvent = pointer_event;
+        rfbScreen->kbdAddEvent = keyboard;
+        rfbScreen->newClientHook = newclient;
+        rfbScreen->cursor = rfbMakeXCursor(cursorWidth, cursorHeight, (char*)cursor,
+                                        (char*)cursorMask);
+        rfbScreen->cursor->xhot = 1;
+        rfbScreen->cursor->yhot = 1;
+
+        /* one port per pipeline, counting up from -rfbport */
+        if (p == 0)
+        {
+            base_port = rfbScreen->port;
+            base_port6 = rfbScreen->ipv6port;
+        }
+        else
+        {
+            rfbScreen->autoPort = FALSE;
+            rfbScreen->port = base_port + p;
+            rfbScreen->ipv6port = base_port6 ? base_port6 + p : 0;
+            rfbScreen->httpPort = 0;
+            rfbScreen->httpDir = NULL;
+        }
+
+        if (no_tcp && (unix_path || fdpass_path) && p == 0)
+        {
+            rfbScreen->autoPort = FALSE;
+            rfbScreen->port = 0;
+            rfbScreen->ipv6port = 0;
+        }
+        else if (no_tcp && p == 0)
+            rfbLog("no unix socket given, keeping TCP\n");
+
+        if (tls && !rfbNuTlsInit(rfbScreen))
+            goto cleanup;
+
+        if (view_passwd && !add_view_password(rfbScreen, view_passwd))
+            goto cleanup;
+
+        /* initialize the server */
+        rfbInitServer(rfbScreen);
+
+        if (p == 0 && (unix_path || fdpass_path) &&
+            !rfbNuListenLocal(rfbScreen, nurfb, unix_path, fdpass_path))
+            goto cleanup;
+        if (ws_port && !rfbNuListenWs(rfbScreen, nurfb, ws_port + p))
+            goto cleanup;
+        /* nobody is watching yet */
+        rfbNuHwSleep(nurfb);
+
+        if (p == 0 && relay && !rfbNuRelayStart(rfbScreen, nurfb, relay))
+            goto cleanup;
+    }
+
+    if (pipelines > 1)
+        rfbNuRunPipelines(screens, pipelines, -1);
+    else
+        rfbNuRunEventLoop(screens[0], -1, FALSE);
+
+cleanup:
+    for (int p = 0; p < ready; p++)
+    {
+        free(screens[p]->frameBuffer);
+        rfbClearNuRfb(rfbNuScreenRfb(screens[p]));
+        rfbScreenCleanup(screens[p]);
+    }
 
-    rfbNuInitRfbFormat(rfbScreen);
-
-    rfbScreen->desktopName = "obmc iKVM";
-    rfbScreen->frameBuffer = malloc(nurfb->vcd_info.hdisp * nurfb->vcd_info.vdisp * 3); //nurfb->raw_fb_addr;
-    rfbScreen->alwaysShared = TRUE;
-    rfbScreen->ptrAddEvent = pointer_event;
-    rfbScreen->kbdAddEvent = keyboard;
-    rfbScreen->newClientHook = newclient;
-    rfbScreen->cursor = rfbMakeXCursor(cursorWidth, cursorHeight, (char*)cursor,
-                                    (char*)cursorMask);
-    rfbScreen->cursor->xhot = 1;
-    rfbScreen->cursor->yhot = 1;
-
-    /* initialize the server */
-    rfbInitServer(rfbScreen);
-#ifdef KEYBOARD_EVENT
-    pthread_create(&rfb, NULL, rfbNuKeyEventThread, nurfb);
-#endif
-    rfbNuRunEventLoop(rfbScreen, -1, FALSE);
-
-#ifdef KEYBOARD_EVENT
-    pthread_join(rfb, NULL);
-#endif
-    free(rfbScreen->frameBuffer);
-
-    hid_close();
-    rfbClearNuRfb(nurfb);
-    rfbScreenCleanup(rfbScreen);
+    hid_close(hid);
 done:
     return (0);
 }
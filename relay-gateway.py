@@ -0,0 +1,340 @@
+#!/usr/bin/env python3
+#
+# relay-gateway.py
+#
+# Copyright (C) 2018 NUVOTON
+#
+#  This is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This software is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this software; If not, see <http://www.gnu.org/licenses/>
+#
+# Test gateway for obmc-ikvm -G. It waits for the BMC on the relay port
+# like "vncviewer -listen", takes its single update stream and fans it out
+# to every viewer on the viewer port. Update requests and input from the
+# viewers go back to the BMC, so the BMC only ever serves one client.
+#
+# This is a stub for trying the relay out, not a gateway:
+#  - no authentication either way, run obmc-ikvm without -passwd and -T
+#  - viewers get the BMC's pixel format, their SetPixelFormat and
+#    SetEncodings are not forwarded, use a viewer that keeps the format
+#    the server announces
+#  - only raw and hextile are asked for from the BMC
+#
+#   ./relay-gateway.py [-l addr] [-r 5500] [-p 5900]
+#   obmc-ikvm -G gateway-host:5500
+#   vncviewer gateway-host:5900
+
+import argparse
+import select
+import socket
+import struct
+import sys
+
+ENC_RAW = 0
+ENC_HEXTILE = 5
+ENC_LAST_RECT = -224
+
+# a viewer that falls this far behind is dropped
+VIEWER_BACKLOG_MAX = 32 << 20
+
+
+class NeedMore(Exception):
+    pass
+
+
+def log(msg):
+    print("relay-gateway: " + msg, file=sys.stderr, flush=True)
+
+
+def need(buf, end):
+    if end > len(buf):
+        raise NeedMore()
+
+
+def recv_exact(sock, n):
+    buf = b""
+    while len(buf) < n:
+        chunk = sock.recv(n - len(buf))
+        if not chunk:
+            raise ConnectionError("peer closed")
+        buf += chunk
+    return buf
+
+
+def hextile_end(buf, off, w, h, bpp):
+    for ty in range(0, h, 16):
+        th = min(16, h - ty)
+        for tx in range(0, w, 16):
+            tw = min(16, w - tx)
+            need(buf, off + 1)
+            sub = buf[off]
+            off += 1
+            if sub & 1:
+                off += tw * th * bpp
+                continue
+            if sub & 2:
+                off += bpp
+            if sub & 4:
+                off += bpp
+            if sub & 8:
+                need(buf, off + 1)
+                n = buf[off]
+                off += 1 + n * ((bpp if sub & 16 else 0) + 2)
+    need(buf, off)
+    return off
+
+
+def server_msg_len(buf, bpp):
+    """Length of the first whole server message in buf, NeedMore if short."""
+    need(buf, 1)
+    msg = buf[0]
+
+    if msg == 0:
+        need(buf, 4)
+        (nrects,) = struct.unpack_from(">H", buf, 2)
+        off = 4
+        for _ in range(nrects):
+            need(buf, off + 12)
+            _, _, w, h, enc = struct.unpack_from(">HHHHi", buf, off)
+            off += 12
+            if enc == ENC_LAST_RECT:
+                break
+            if enc == ENC_RAW:
+                off += w * h * bpp
+                need(buf, off)
+            elif enc == ENC_HEXTILE:
+                off = hextile_end(buf, off, w, h, bpp)
+            else:
+                raise ValueError("unexpected encoding %d" % enc)
+        return off
+
+    if msg == 1:
+        need(buf, 6)
+        (n,) = struct.unpack_from(">H", buf, 4)
+        need(buf, 6 + 6 * n)
+        return 6 + 6 * n
+
+    if msg == 2:
+        return 1
+
+    if msg == 3:
+        need(buf, 8)
+        (n,) = struct.unpack_from(">I", buf, 4)
+        need(buf, 8 + n)
+        return 8 + n
+
+    raise ValueError("unexpected server message %d" % msg)
+
+
+def client_msg_len(buf):
+    """Length of the first whole viewer message and whether to forward it."""
+    need(buf, 1)
+    msg = buf[0]
+
+    if msg == 0:
+        need(buf, 20)
+        return 20, False
+    if msg == 2:
+        need(buf, 4)
+        (n,) = struct.unpack_from(">H", buf, 2)
+        need(buf, 4 + 4 * n)
+        return 4 + 4 * n, False
+    if msg == 3:
+        need(buf, 10)
+        return 10, True
+    if msg == 4:
+        need(buf, 8)
+        return 8, True
+    if msg == 5:
+        need(buf, 6)
+        return 6, True
+    if msg == 6:
+        need(buf, 8)
+        (n,) = struct.unpack_from(">I", buf, 4)
+        need(buf, 8 + n)
+        return 8 + n, True
+
+    raise ValueError("unexpected viewer message %d" % msg)
+
+
+def bmc_handshake(sock):
+    """Act as the viewer towards the BMC, returns its ServerInit."""
+    recv_exact(sock, 12)
+    sock.sendall(b"RFB 003.008\n")
+
+    (count,) = recv_exact(sock, 1)
+    if not count:
+        (n,) = struct.unpack(">I", recv_exact(sock, 4))
+        raise ConnectionError(recv_exact(sock, n).decode(errors="replace"))
+    if 1 not in recv_exact(sock, count):
+        raise ConnectionError("BMC wants authentication, start it without -passwd")
+    sock.sendall(b"\x01")
+    (result,) = struct.unpack(">I", recv_exact(sock, 4))
+    if result:
+        raise ConnectionError("BMC refused the security handshake")
+
+    sock.sendall(b"\x01")
+    init = recv_exact(sock, 24)
+    (name_len,) = struct.unpack_from(">I", init, 20)
+    init += recv_exact(sock, name_len)
+
+    sock.sendall(struct.pack(">BBHii", 2, 0, 2, ENC_HEXTILE, ENC_RAW))
+
+    return init
+
+
+def viewer_handshake(sock, server_init):
+    sock.sendall(b"RFB 003.008\n")
+    version = recv_exact(sock, 12)
+    minor = int(version[8:11]) if version[:4] == b"RFB " else 3
+
+    if minor < 7:
+        sock.sendall(struct.pack(">I", 1))
+    else:
+        sock.sendall(b"\x01\x01")
+        recv_exact(sock, 1)
+        if minor >= 8:
+            sock.sendall(struct.pack(">I", 0))
+
+    recv_exact(sock, 1)
+    sock.sendall(server_init)
+
+
+class Viewer:
+    def __init__(self, sock, addr):
+        self.sock = sock
+        self.addr = addr
+        self.inbuf = bytearray()
+        self.out = bytearray()
+
+
+def serve(bmc, server_init, listener):
+    width, height, bpp = struct.unpack_from(">HHB", server_init)
+    bpp //= 8
+    viewers = []
+
+    log("BMC up, %dx%d at %d bpp" % (width, height, bpp * 8))
+    try:
+        relay(bmc, server_init, listener, bpp, viewers)
+    finally:
+        for v in viewers:
+            v.sock.close()
+
+
+def relay(bmc, server_init, listener, bpp, viewers):
+    inbuf = bytearray()
+    bmc_out = bytearray()
+
+    def drop(v, why):
+        log("viewer %s:%d gone (%s)" % (v.addr[0], v.addr[1], why))
+        viewers.remove(v)
+        v.sock.close()
+
+    while True:
+        rlist = [bmc, listener] + [v.sock for v in viewers]
+        wlist = [v.sock for v in viewers if v.out]
+        if bmc_out:
+            wlist.append(bmc)
+        readable, writable, _ = select.select(rlist, wlist, [])
+
+        if bmc in writable:
+            del bmc_out[:bmc.send(bmc_out)]
+
+        if bmc in readable:
+            data = bmc.recv(1 << 16)
+            if not data:
+                raise ConnectionError("BMC closed the relay")
+            inbuf += data
+            while inbuf:
+                try:
+                    n = server_msg_len(inbuf, bpp)
+                except NeedMore:
+                    break
+                for v in viewers:
+                    v.out += inbuf[:n]
+                del inbuf[:n]
+
+        if listener in readable:
+            sock, addr = listener.accept()
+            try:
+                sock.settimeout(5)
+                viewer_handshake(sock, server_init)
+                sock.setblocking(False)
+            except (OSError, ConnectionError, ValueError) as e:
+                log("viewer %s:%d handshake failed (%s)" % (addr[0], addr[1], e))
+                sock.close()
+            else:
+                viewers.append(Viewer(sock, addr))
+                log("viewer %s:%d joined, %d watching" % (addr[0], addr[1], len(viewers)))
+
+        for v in list(viewers):
+            if v.sock in writable:
+                try:
+                    del v.out[:v.sock.send(v.out)]
+                except OSError as e:
+                    drop(v, e)
+                    continue
+            if len(v.out) > VIEWER_BACKLOG_MAX:
+                drop(v, "too slow")
+                continue
+
+            if v.sock not in readable:
+                continue
+            try:
+                data = v.sock.recv(1 << 12)
+            except OSError as e:
+                drop(v, e)
+                continue
+            if not data:
+                drop(v, "closed")
+                continue
+            v.inbuf += data
+            try:
+                while v.inbuf:
+                    n, forward = client_msg_len(v.inbuf)
+                    if forward:
+                        bmc_out += v.inbuf[:n]
+                    del v.inbuf[:n]
+            except NeedMore:
+                pass
+            except ValueError as e:
+                drop(v, e)
+
+
+def main():
+    parser = argparse.ArgumentParser(description="test gateway for obmc-ikvm -G")
+    parser.add_argument("-l", "--listen", default="", help="address to listen on")
+    parser.add_argument("-r", "--relay-port", type=int, default=5500,
+                        help="port the BMC connects to (default 5500)")
+    parser.add_argument("-p", "--port", type=int, default=5900,
+                        help="port viewers connect to (default 5900)")
+    args = parser.parse_args()
+
+    gateway = socket.create_server((args.listen, args.relay_port))
+    listener = socket.create_server((args.listen, args.port))
+
+    while True:
+        log("waiting for the BMC on port %d" % args.relay_port)
+        bmc, addr = gateway.accept()
+        log("BMC connected from %s:%d" % (addr[0], addr[1]))
+        try:
+            bmc.settimeout(10)
+            server_init = bmc_handshake(bmc)
+            bmc.settimeout(None)
+            serve(bmc, server_init, listener)
+        except (OSError, ConnectionError, ValueError) as e:
+            log("relay down (%s)" % e)
+        bmc.close()
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,50 @@
+/*
+ * rfbbucket.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Token buckets behind the -b and -B bandwidth caps. Charging and the
+ * skip decision stay with the update path in rfbnpcm750.c.
+ */
+
+#include "rfbbucket.h"
+
+void rfbNuBucketInit(struct nu_bucket *b, unsigned int kbps)
+{
+	b->rate = (unsigned long long)kbps << 10;
+	/* a quarter second of burst, but at least one large rect */
+	b->burst = b->rate / 4 > 0x10000 ? b->rate / 4 : 0x10000;
+	b->tokens = b->burst;
+	clock_gettime(CLOCK_MONOTONIC, &b->last);
+}
+
+void rfbNuBucketRefill(struct nu_bucket *b, const struct timespec *now)
+{
+	unsigned long long us;
+
+	if (!b->rate)
+		return;
+
+	us = (now->tv_sec - b->last.tv_sec) * 1000000ULL +
+		 (now->tv_nsec - b->last.tv_nsec) / 1000;
+	b->last = *now;
+
+	b->tokens += b->rate * us / 1000000;
+	if (b->tokens > b->burst)
+		b->tokens = b->burst;
+}
@@ -0,0 +1,35 @@
+#ifndef RFBBUCKET_H
+#define RFBBUCKET_H
+
+/*
+ * rfbbucket.h
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <time.h>
+
+/* byte token bucket, rate 0 means unlimited */
+struct nu_bucket
+{
+	unsigned long long rate;
+	long long burst;
+	long long tokens;
+	struct timespec last;
+};
+
+void rfbNuBucketInit(struct nu_bucket *b, unsigned int kbps);
+void rfbNuBucketRefill(struct nu_bucket *b, const struct timespec *now);
+#endif
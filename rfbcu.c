@@ -0,0 +1,105 @@
+/*
+ * rfbcu.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * ContinuousUpdates and Fence state of a client. Continuous updates
+ * clients are paced by fences instead of requests: every frame is
+ * followed by a fence request, the answer gives the round trip and frees
+ * one of the CU_MAX_INFLIGHT slots. Reading and writing the messages is
+ * left to rfbnpcm750.c.
+ */
+
+#include <string.h>
+
+#include "rfbcu.h"
+
+static inline uint16_t get16(const unsigned char *p)
+{
+	return p[0] << 8 | p[1];
+}
+
+/*
+ * EnableContinuousUpdates: enable flag, then x, y, w and h. Returns 1 when
+ * the client turned continuous updates off and is owed an
+ * EndOfContinuousUpdates.
+ */
+int rfbNuCuEnable(struct nu_cu *cu, const unsigned char *msg)
+{
+	cu->x = get16(msg + 1);
+	cu->y = get16(msg + 3);
+	cu->w = get16(msg + 5);
+	cu->h = get16(msg + 7);
+
+	if (msg[0])
+	{
+		cu->enabled = 1;
+		cu->inflight = 0;
+		return 0;
+	}
+
+	if (!cu->enabled)
+		return 0;
+
+	cu->enabled = 0;
+
+	return 1;
+}
+
+/* the next frame waits for a fence answer */
+int rfbNuCuFenceWait(const struct nu_cu *cu)
+{
+	return cu->enabled && cu->fence && cu->inflight >= CU_MAX_INFLIGHT;
+}
+
+/* 1 when a fence request is to follow the frame, with seq as payload */
+int rfbNuCuFenceDue(struct nu_cu *cu, const struct timespec *now, uint32_t *seq)
+{
+	if (!cu->enabled || !cu->fence)
+		return 0;
+
+	*seq = cu->fence_seq++;
+	cu->fence_ts[*seq % CU_MAX_INFLIGHT] = *now;
+
+	return 1;
+}
+
+/* Fence: three bytes of padding, flags, payload length */
+void rfbNuCuParseFence(const unsigned char *msg, uint32_t *flags, uint8_t *len)
+{
+	*flags = (uint32_t)get16(msg + 3) << 16 | get16(msg + 5);
+	*len = msg[7];
+}
+
+/* a fence answer carrying one of our sequence numbers */
+void rfbNuCuFenceAnswered(struct nu_cu *cu, const char *payload, uint8_t len,
+						  const struct timespec *now)
+{
+	const struct timespec *ts;
+	unsigned int rtt;
+	uint32_t seq;
+
+	if (len != sizeof(uint32_t) || !cu->inflight)
+		return;
+
+	memcpy(&seq, payload, sizeof(seq));
+	ts = &cu->fence_ts[seq % CU_MAX_INFLIGHT];
+	rtt = (now->tv_sec - ts->tv_sec) * 1000000 + (now->tv_nsec - ts->tv_nsec) / 1000;
+	cu->rtt_us = cu->rtt_us ? (cu->rtt_us * 7 + rtt) / 8 : rtt;
+	cu->inflight--;
+}
@@ -0,0 +1,63 @@
+#ifndef RFBCU_H
+#define RFBCU_H
+
+/*
+ * rfbcu.h
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdint.h>
+#include <time.h>
+
+/* ContinuousUpdates and Fence, libvncserver does not handle them */
+#define rfbNuEncodingFence -312
+#define rfbNuEncodingContinuousUpdates -313
+#define rfbNuContinuousUpdates 150
+#define rfbNuFence 248
+#define rfbNuFenceBlockBefore 0x00000001
+#define rfbNuFenceBlockAfter 0x00000002
+#define rfbNuFenceRequest 0x80000000
+#define rfbNuFenceMaxLen 64
+
+/* message bytes after the type */
+#define sz_rfbNuEnableCU 9
+#define sz_rfbNuFence 8
+
+/* fences a continuous updates client may leave unanswered */
+#define CU_MAX_INFLIGHT 4
+
+struct nu_cu
+{
+	int supported;
+	int enabled;
+	int fence;
+	uint16_t x;
+	uint16_t y;
+	uint16_t w;
+	uint16_t h;
+	unsigned int inflight;
+	uint32_t fence_seq;
+	struct timespec fence_ts[CU_MAX_INFLIGHT];
+	unsigned int rtt_us;
+};
+
+int rfbNuCuEnable(struct nu_cu *cu, const unsigned char *msg);
+int rfbNuCuFenceWait(const struct nu_cu *cu);
+int rfbNuCuFenceDue(struct nu_cu *cu, const struct timespec *now, uint32_t *seq);
+void rfbNuCuParseFence(const unsigned char *msg, uint32_t *flags, uint8_t *len);
+void rfbNuCuFenceAnswered(struct nu_cu *cu, const char *payload, uint8_t len,
+						  const struct timespec *now);
+#endif
@@ -0,0 +1,82 @@
+/*
+ * rfbfdpass.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * Messages from fd passing proxies: one byte of payload and one or more
+ * SCM_RIGHTS control messages with accepted client sockets. Receiving
+ * and handing the fds to libvncserver stays in rfbnpcm750.c.
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#include "rfbfdpass.h"
+
+void rfbNuFdPassInit(struct nu_fdpass_msg *m)
+{
+	memset(m, 0, sizeof(*m));
+	m->iov.iov_base = &m->dummy;
+	m->iov.iov_len = 1;
+	m->msg.msg_iov = &m->iov;
+	m->msg.msg_iovlen = 1;
+	m->msg.msg_control = m->ctl.buf;
+	m->msg.msg_controllen = sizeof(m->ctl.buf);
+}
+
+/*
+ * Collect the client fds of a received message into fds. Fds beyond max
+ * are closed rather than leaked; truncated is set when some were lost,
+ * here or by the kernel for lack of control buffer.
+ */
+int rfbNuFdPassParse(struct nu_fdpass_msg *m, int *fds, int max, int *truncated)
+{
+	struct cmsghdr *cmsg;
+	int cnt = 0;
+
+	*truncated = !!(m->msg.msg_flags & MSG_CTRUNC);
+
+	for (cmsg = CMSG_FIRSTHDR(&m->msg); cmsg; cmsg = CMSG_NXTHDR(&m->msg, cmsg))
+	{
+		const unsigned char *data;
+		int n;
+
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		data = CMSG_DATA(cmsg);
+		for (int j = 0; j < n; j++)
+		{
+			int fd;
+
+			memcpy(&fd, data + j * sizeof(int), sizeof(fd));
+			if (cnt < max)
+			{
+				fds[cnt++] = fd;
+			}
+			else
+			{
+				close(fd);
+				*truncated = 1;
+			}
+		}
+	}
+
+	return cnt;
+}
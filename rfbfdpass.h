@@ -0,0 +1,43 @@
+#ifndef RFBFDPASS_H
+#define RFBFDPASS_H
+
+/*
+ * rfbfdpass.h
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/* client fds one message from a proxy may carry */
+#define FDPASS_MAX_FDS 4
+
+/* receive buffers for one proxy message, set up by rfbNuFdPassInit */
+struct nu_fdpass_msg
+{
+	struct msghdr msg;
+	struct iovec iov;
+	char dummy;
+	union
+	{
+		char buf[CMSG_SPACE(sizeof(int) * FDPASS_MAX_FDS)];
+		struct cmsghdr align;
+	} ctl;
+};
+
+void rfbNuFdPassInit(struct nu_fdpass_msg *m);
+int rfbNuFdPassParse(struct nu_fdpass_msg *m, int *fds, int max, int *truncated);
+#endif
@@ -22,8 +22,6 @@
 #include "rfbnpcm750.h"
 #include "rfbusbhid.h"
 
-struct nu_rfb *nurfb_g;
-static struct timespec start;
 
 static int timediff(struct timespec *start, struct timespec *end)
 {
@@ -32,6 +30,25 @@ static int timediff(struct timespec *start, struct timespec *end)
     return diff;
 }
 
+static inline unsigned long long rfbNuNowNs(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void rfbNuArmTimer(int fd, unsigned long long ns)
+{
+	struct itimerspec its;
+
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = ns / 1000000000ULL;
+	its.it_value.tv_nsec = ns % 1000000000ULL;
+	timerfd_settime(fd, 0, &its, NULL);
+}
+
 rfbBool rfbNuResetVCD(struct nu_rfb *nurfb)
 {
 	int err;
@@ -90,7 +107,8 @@ rfbNuSendUpdateBuf(rfbClientPtr cl, char *buf, int len)
 
 void rfbNuInitRfbFormat(rfbScreenInfoPtr screen)
 {
-	struct vcd_info *info = &nurfb_g->vcd_info;
+	struct nu_rfb *nurfb = rfbNuScreenRfb(screen);
+	struct vcd_info *info = &nurfb->vcd_info;
 	rfbPixelFormat *format = &screen->serverFormat;
 
 	screen->colourMap.count = 0;
@@ -100,6 +118,19 @@ void rfbNuInitRfbFormat(rfbScreenInfoPtr screen)
 	format->depth = screen->depth;
 	format->bigEndian = FALSE;
 	format->trueColour = TRUE;
+
+	if (nurfb->bpp8)
+	{
+		/* BGR233 */
+		format->redMax = 7;
+		format->greenMax = 7;
+		format->blueMax = 3;
+		format->redShift = 0;
+		format->greenShift = 3;
+		format->blueShift = 6;
+		return;
+	}
+
 	format->redMax = info->r_max;
 	format->greenMax = info->g_max;
 	format->blueMax = info->b_max;
@@ -108,6 +139,90 @@ void rfbNuInitRfbFormat(rfbScreenInfoPtr screen)
 	format->blueShift = info->b_shift;
 }
 
+static inline uint8_t rfbNuScaleChannel(uint32_t v, uint32_t from, uint32_t to)
+{
+	return (v * to + from / 2) / from;
+}
+
+/*
+ * Build the RGB565 -> BGR233 table used when the server advertises
+ * 8bpp, every captured pixel is then converted with a single load.
+ */
+static int rfbNuInitLut8(struct nu_rfb *nurfb)
+{
+	struct vcd_info *info = &nurfb->vcd_info;
+
+	if (!nurfb->lut8)
+	{
+		nurfb->lut8 = malloc(65536);
+		if (!nurfb->lut8)
+			return -1;
+	}
+
+	for (uint32_t p = 0; p < 65536; p++)
+	{
+		uint32_t r = (p >> info->r_shift) & info->r_max;
+		uint32_t g = (p >> info->g_shift) & info->g_max;
+		uint32_t b = (p >> info->b_shift) & info->b_max;
+
+		nurfb->lut8[p] = rfbNuScaleChannel(r, info->r_max ? info->r_max : 1, 7) |
+						 (rfbNuScaleChannel(g, info->g_max ? info->g_max : 1, 7) << 3) |
+						 (rfbNuScaleChannel(b, info->b_max ? info->b_max : 1, 3) << 6);
+	}
+
+	return 0;
+}
+
+/* copy a rect of the captured frame into the server framebuffer */
+static void rfbNuCopyRect(struct nu_rfb *nurfb, rfbScreenInfoPtr screen,
+						  int x, int y, int w, int h)
+{
+	for (int j = y; j < y + h; j++)
+	{
+		const char *src = nurfb->raw_fb_addr + j * nurfb->vcd_info.line_pitch + x * 2;
+
+		if (nurfb->bpp8)
+		{
+			const uint16_t *s16 = (const uint16_t *)src;
+			uint8_t *dst = (uint8_t *)screen->frameBuffer + j * screen->paddedWidthInBytes + x;
+
+			for (int i = 0; i < w; i++)
+				dst[i] = nurfb->lut8[s16[i]];
+		}
+		else
+			memcpy(screen->frameBuffer + j * screen->paddedWidthInBytes + x * 2, src, w * 2);
+	}
+}
+
+/*
+ * Move the client to a scaled framebuffer of the given size, sharing one
+ * with other clients at the same size. The new screen is filled by the
+ * first update, it starts out with the client's whole area damaged.
+ */
+static void rfbNuScaleClient(rfbClientPtr cl, int width, int height)
+{
+	rfbScreenInfoPtr ptr;
+
+	for (ptr = cl->screen->scaledScreenNext; ptr; ptr = ptr->scaledScreenNext)
+		if (ptr->width == width && ptr->height == height)
+			break;
+
+	if (!ptr)
+		ptr = rfbScaledScreenAllocate(cl, width, height);
+	if (!ptr)
+	{
+		rfbErr("scaling to %dx%d failed\n", width, height);
+		return;
+	}
+
+	LOCK(cl->updateMutex);
+	cl->scaledScreen->scaledScreenRefCount--;
+	ptr->scaledScreenRefCount++;
+	cl->scaledScreen = ptr;
+	cl->newFBSizePending = TRUE;
+	UNLOCK(cl->updateMutex);
+}
+
 void rfbNuNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
 						 int width, int height,
 						 int bitsPerSample, int samplesPerPixel,
@@ -115,6 +230,7 @@ void rfbNuNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
 {
 	rfbClientIteratorPtr iterator;
 	rfbClientPtr cl;
+	int old_width = screen->width;
 
 	/* Update information in the screenInfo structure */
 
@@ -154,6 +270,15 @@ void rfbNuNewFramebuffer(rfbScreenInfoPtr screen, char *framebuffer,
 
 		TSIGNAL(cl->updateCond);
 		UNLOCK(cl->updateMutex);
+
+		/* keep scaled clients at the same factor */
+		if (cl->scaledScreen != screen && cl->scaledScreen->width)
+		{
+			int f = old_width / cl->scaledScreen->width;
+
+			if (f > 1)
+				rfbNuScaleClient(cl, width / f, height / f);
+		}
 	}
 	rfbReleaseClientIterator(iterator);
 }
@@ -208,9 +333,267 @@ static int rfbNuSetVCDMode(struct nu_rfb *nurfb, int de_mode)
 	return 0;
 }
 
-static int rfbNuGetDiffCnt(rfbClientRec *cl)
+static int rfbNuGrowRectTable(struct nu_rfb *nurfb, unsigned int cnt)
+{
+	struct rect *table;
+	unsigned int size = nurfb->rect_table_size ? nurfb->rect_table_size : 64;
+
+	if (cnt <= nurfb->rect_table_size)
+		return 0;
+
+	while (size < cnt)
+		size <<= 1;
+
+	table = realloc(nurfb->rect_table, sizeof(struct rect) * size);
+	if (!table)
+	{
+		rfbErr("alloc rect table failed\n");
+		return -1;
+	}
+
+	nurfb->rect_table = table;
+	nurfb->rect_table_size = size;
+
+	return 0;
+}
+
+static inline rfbBool rfbNuPixelNear(struct vcd_info *info, uint16_t a, uint16_t b, int tol)
+{
+	int d;
+
+	d = (int)((a >> info->r_shift) & info->r_max) - (int)((b >> info->r_shift) & info->r_max);
+	if (d > tol || d < -tol)
+		return FALSE;
+
+	/* green carries one bit more than red and blue in RGB565 */
+	d = (int)((a >> info->g_shift) & info->g_max) - (int)((b >> info->g_shift) & info->g_max);
+	if (d > tol * 2 || d < -tol * 2)
+		return FALSE;
+
+	d = (int)((a >> info->b_shift) & info->b_max) - (int)((b >> info->b_shift) & info->b_max);
+	if (d > tol || d < -tol)
+		return FALSE;
+
+	return TRUE;
+}
+
+static rfbBool rfbNuTileChanged(struct nu_rfb *nurfb, int x, int y, int w, int h)
+{
+	unsigned int lp = nurfb->vcd_info.line_pitch;
+	unsigned int sw = nurfb->shadow_w;
+	int tol = nurfb->verify_tolerance;
+
+	for (int j = y; j < y + h; j++)
+	{
+		const uint16_t *cur = (const uint16_t *)(nurfb->raw_fb_addr + j * lp) + x;
+		const uint16_t *old = nurfb->shadow_fb + j * sw + x;
+
+		if (!memcmp(cur, old, w * 2))
+			continue;
+
+		if (!tol)
+			return TRUE;
+
+		for (int i = 0; i < w; i++)
+			if (cur[i] != old[i] && !rfbNuPixelNear(&nurfb->vcd_info, cur[i], old[i], tol))
+				return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void rfbNuUpdateShadow(struct nu_rfb *nurfb, int x, int y, int w, int h)
+{
+	for (int j = y; j < y + h; j++)
+		memcpy(nurfb->shadow_fb + j * nurfb->shadow_w + x,
+			   nurfb->raw_fb_addr + j * nurfb->vcd_info.line_pitch + x * 2, w * 2);
+}
+
+/* the shadow follows what was sent, not what was captured */
+static void rfbNuShadowPending(struct nu_rfb *nurfb, struct rect *r)
+{
+	sraRegionPtr rgn;
+
+	if (!nurfb->shadow_rgn)
+		nurfb->shadow_rgn = sraRgnCreate();
+
+	rgn = sraRgnCreateRect(r->x, r->y, r->x + r->w, r->y + r->h);
+	sraRgnOr(nurfb->shadow_rgn, rgn);
+	sraRgnDestroy(rgn);
+}
+
+static void rfbNuShadowSent(struct nu_rfb *nurfb, int x, int y, int w, int h)
+{
+	sraRectangleIterator *iter;
+	sraRegionPtr sent;
+	sraRect r;
+
+	if (!nurfb->shadow_rgn || sraRgnEmpty(nurfb->shadow_rgn))
+		return;
+
+	sent = sraRgnCreateRect(x, y, x + w, y + h);
+	sraRgnAnd(sent, nurfb->shadow_rgn);
+	sraRgnSubtract(nurfb->shadow_rgn, sent);
+
+	iter = sraRgnGetIterator(sent);
+	while (sraRgnIteratorNext(iter, &r))
+	{
+		if (r.x2 > (int)nurfb->shadow_w)
+			r.x2 = nurfb->shadow_w;
+		if (r.y2 > (int)nurfb->shadow_h)
+			r.y2 = nurfb->shadow_h;
+		if (r.x2 > r.x1 && r.y2 > r.y1)
+			rfbNuUpdateShadow(nurfb, r.x1, r.y1, r.x2 - r.x1, r.y2 - r.y1);
+	}
+	sraRgnReleaseIterator(iter);
+	sraRgnDestroy(sent);
+}
+
+static int rfbNuAddVerifiedRect(struct rect **out, unsigned int *cnt,
+								unsigned int *size, unsigned int first, struct rect *r)
+{
+	/* merge with a run of the same columns directly above */
+	for (unsigned int k = first; k < *cnt; k++)
+	{
+		struct rect *p = &(*out)[k];
+
+		if (p->x == r->x && p->w == r->w && p->y + p->h == r->y)
+		{
+			p->h += r->h;
+			return 0;
+		}
+	}
+
+	if (*cnt == *size)
+	{
+		struct rect *table = realloc(*out, sizeof(struct rect) * (*size * 2));
+
+		if (!table)
+			return -1;
+		*out = table;
+		*size *= 2;
+	}
+
+	(*out)[(*cnt)++] = *r;
+
+	return 0;
+}
+
+/*
+ * Check every diff rect reported by the VCD against the pixels that were
+ * last sent. Marginal video signals make COMPARE report noise as change,
+ * tiles within the tolerance are dropped before they reach the encoder.
+ */
+static void rfbNuVerifyDiffTable(struct nu_rfb *nurfb, rfbBool full)
+{
+	struct vcd_info *info = &nurfb->vcd_info;
+	unsigned int size = nurfb->rect_cnt + 16;
+	unsigned int cnt = 0;
+	struct rect *out;
+
+	if (nurfb->fake_fb)
+		return;
+
+	if (nurfb->shadow_w != info->hdisp || nurfb->shadow_h != info->vdisp)
+	{
+		free(nurfb->shadow_fb);
+		nurfb->shadow_fb = malloc(info->hdisp * info->vdisp * 2);
+		if (!nurfb->shadow_fb)
+		{
+			nurfb->shadow_w = nurfb->shadow_h = 0;
+			return;
+		}
+		nurfb->shadow_w = info->hdisp;
+		nurfb->shadow_h = info->vdisp;
+		full = TRUE;
+	}
+
+	if (full)
+	{
+		rfbNuUpdateShadow(nurfb, 0, 0, info->hdisp, info->vdisp);
+		if (nurfb->shadow_rgn)
+			sraRgnMakeEmpty(nurfb->shadow_rgn);
+		return;
+	}
+
+	out = malloc(sizeof(struct rect) * size);
+	if (!out)
+		return;
+
+	for (unsigned int n = 0; n < nurfb->rect_cnt; n++)
+	{
+		struct rect r = nurfb->rect_table[n];
+		unsigned int first = cnt;
+		unsigned int changed = 0, tiles = 0;
+
+		if (r.x + r.w > info->hdisp)
+			r.w = info->hdisp - r.x;
+		if (r.y + r.h > info->vdisp)
+			r.h = info->vdisp - r.y;
+
+		for (uint32_t ty = r.y; ty < r.y + r.h; ty += 16)
+		{
+			uint32_t th = (r.y + r.h - ty) < 16 ? (r.y + r.h - ty) : 16;
+			struct rect run = {0, ty, 0, th};
+
+			for (uint32_t tx = r.x; tx < r.x + r.w; tx += 16)
+			{
+				uint32_t tw = (r.x + r.w - tx) < 16 ? (r.x + r.w - tx) : 16;
+
+				tiles++;
+				if (rfbNuTileChanged(nurfb, tx, ty, tw, th))
+				{
+					changed++;
+					if (!run.w)
+						run.x = tx;
+					run.w = tx + tw - run.x;
+					continue;
+				}
+
+				nurfb->suppressed_bytes += tw * th * 2;
+				if (run.w)
+				{
+					if (rfbNuAddVerifiedRect(&out, &cnt, &size, first, &run) < 0)
+						goto nomem;
+					run.w = 0;
+				}
+			}
+
+			if (run.w && rfbNuAddVerifiedRect(&out, &cnt, &size, first, &run) < 0)
+				goto nomem;
+		}
+
+		if (!changed)
+		{
+			nurfb->suppressed_rects++;
+		}
+		else if (changed == tiles)
+		{
+			/* nothing dropped, keep the rect as reported */
+			cnt = first;
+			if (rfbNuAddVerifiedRect(&out, &cnt, &size, first, &r) < 0)
+				goto nomem;
+		}
+	}
+
+	for (unsigned int n = 0; n < cnt; n++)
+		rfbNuShadowPending(nurfb, &out[n]);
+
+	free(nurfb->rect_table);
+	nurfb->rect_table = out;
+	nurfb->rect_table_size = size;
+	nurfb->rect_cnt = cnt;
+	return;
+
+nomem:
+	free(out);
+	for (unsigned int n = 0; n < nurfb->rect_cnt; n++)
+		rfbNuShadowPending(nurfb, &nurfb->rect_table[n]);
+}
+
+static int rfbNuGetDiffCnt(rfbClientRec *cl, rfbBool full)
 {
-	struct nu_rfb *nurfb = (struct nu_rfb*)cl->clientData;
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
 
 	if (nurfb->do_cmd)
 	{
@@ -220,23 +603,121 @@ static int rfbNuGetDiffCnt(rfbClientRec *cl)
 			return -1;
 		}
 
-		if (nurfb->rect_table)
+		if (rfbNuGrowRectTable(nurfb, nurfb->rect_cnt + 1) < 0)
+			return -1;
+
+		for (unsigned int i = 0; i < nurfb->rect_cnt; i++)
 		{
-			free(nurfb->rect_table);
-			nurfb->rect_table = NULL;
+			if (ioctl(nurfb->raw_fb_fd, VCD_IOCGETDIFF, &nurfb->rect_table[i]) < 0)
+			{
+				rfbErr("get rect table failed\n");
+				nurfb->rect_cnt = i;
+				break;
+			}
 		}
 
-		nurfb->rect_table = (struct rect *)malloc(sizeof(struct rect) * (nurfb->rect_cnt + 1));
+		if (nurfb->verify_tolerance >= 0)
+			rfbNuVerifyDiffTable(nurfb, full);
 	}
 
 	return nurfb->rect_cnt;
 }
 
+#ifdef MSG_ZEROCOPY
+/* reap MSG_ZEROCOPY completions, the kernel may still read from the ECE buffer until then */
+static void rfbNuZeroCopyReap(struct nu_session *ss, int timeout)
+{
+	char control[128];
+	struct msghdr msg;
+	struct cmsghdr *cm;
+	struct sock_extended_err *serr;
+	struct pollfd pfd;
+
+	while (ss->zc_pending)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+
+		if (recvmsg(ss->zc_sock, &msg, MSG_ERRQUEUE) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN || !timeout)
+				break;
+
+			pfd.fd = ss->zc_sock;
+			pfd.events = 0;
+			if (poll(&pfd, 1, timeout) <= 0)
+				break;
+			continue;
+		}
+
+		for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm))
+		{
+			serr = (struct sock_extended_err *)CMSG_DATA(cm);
+			if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+				continue;
+
+			if (serr->ee_data - serr->ee_info + 1 >= ss->zc_pending)
+				ss->zc_pending = 0;
+			else
+				ss->zc_pending -= serr->ee_data - serr->ee_info + 1;
+		}
+	}
+
+	if (!ss->zc_pending)
+		ss->zc_stalled = 0;
+}
+
+/*
+ * TRUE once no client has zerocopy sends outstanding. A client that
+ * misses ZEROCOPY_REAP_MS is only polled from then on and sends to it
+ * copy, the ECE buffer stays pinned until its completions are in.
+ */
+static rfbBool rfbNuZeroCopyIdle(struct nu_rfb *nurfb)
+{
+	rfbBool idle = TRUE;
+
+	for (struct nu_session *ss = nurfb->sessions; ss; ss = ss->next)
+	{
+		if (!ss->zc_pending)
+			continue;
+
+		rfbNuZeroCopyReap(ss, ss->zc_stalled ? 0 : ZEROCOPY_REAP_MS);
+		if (!ss->zc_pending)
+			continue;
+
+		if (!ss->zc_stalled)
+		{
+			rfbLog("zerocopy: client %u has %u sends outstanding, copying\n",
+				   ss->id, ss->zc_pending);
+			ss->zc_stalled = 1;
+			nurfb->zc_stalls++;
+		}
+		idle = FALSE;
+	}
+
+	return idle;
+}
+#endif
+
+/*
+ * Rewind the ECE output to the start of its buffer. Not while zerocopy
+ * sends may still read from it, ece_pinned is set instead and rects are
+ * encoded in software until the next call succeeds.
+ */
 rfbBool
 rfbNuClearHextieDataOffset(struct nu_rfb *nurfb)
 {
 	int err;
 
+#ifdef MSG_ZEROCOPY
+	nurfb->ece_pinned = !rfbNuZeroCopyIdle(nurfb);
+	if (nurfb->ece_pinned)
+		return FALSE;
+#endif
+
 	if ((err = ioctl(nurfb->hextile_fd, ECE_IOCCLEAR_OFFSET)) < 0)
 	{
 		rfbLog("vnc: clear offset failed:%d\n", err);
@@ -263,12 +744,8 @@ rfbNuGetHextieDataOffset(struct nu_rfb *nurfb)
 }
 
 
-static int rfbNuInitVCD(struct nu_rfb *nurfb, int first)
+static void rfbNuUnmapVCD(struct nu_rfb *nurfb)
 {
-	struct vcd_info *vcd_info = &nurfb->vcd_info;
-	struct ece_ioctl_cmd cmd;
-	int total_wr, total_hr;
-
 	if (nurfb->last_mode == RAWFB_MMAP)
 	{
 		if (!nurfb->fake_fb)
@@ -280,10 +757,55 @@ static int rfbNuInitVCD(struct nu_rfb *nurfb, int first)
 			nurfb->fake_fb = 0;
 		}
 
-		munmap(nurfb->raw_hextile_addr, nurfb->raw_hextile_mmap);
+		if (nurfb->raw_hextile_addr)
+			munmap(nurfb->raw_hextile_addr, nurfb->raw_hextile_mmap);
 
+		nurfb->raw_fb_addr = NULL;
+		nurfb->raw_hextile_addr = NULL;
 		nurfb->last_mode = 0;
 	}
+}
+
+/*
+ * Software backend, a fake_fb that draws a moving test pattern instead of
+ * the blank frame. Lets several pipelines run without more video heads.
+ */
+static void rfbNuInitPattern(struct nu_rfb *nurfb)
+{
+	struct vcd_info *vcd_info = &nurfb->vcd_info;
+
+	memset(vcd_info, 0, sizeof(struct vcd_info));
+	vcd_info->hdisp = PATTERN_WIDTH;
+	vcd_info->vdisp = PATTERN_HEIGHT;
+	vcd_info->line_pitch = PATTERN_WIDTH * 2;
+	vcd_info->bpp = 2;
+	vcd_info->r_max = 31;
+	vcd_info->g_max = 63;
+	vcd_info->b_max = 31;
+	vcd_info->r_shift = 11;
+	vcd_info->g_shift = 5;
+	vcd_info->b_shift = 0;
+
+	nurfb->raw_fb_fd = -1;
+	nurfb->hextile_fd = -1;
+	nurfb->frame_size = vcd_info->line_pitch * vcd_info->vdisp;
+	nurfb->fake_fb = 1;
+	nurfb->last_mode = RAWFB_MMAP;
+}
+
+static int rfbNuInitVCD(struct nu_rfb *nurfb, int first)
+{
+	struct vcd_info *vcd_info = &nurfb->vcd_info;
+	struct ece_ioctl_cmd cmd;
+	int total_wr, total_hr;
+
+	rfbNuUnmapVCD(nurfb);
+
+	if (nurfb->pattern)
+	{
+		rfbNuInitPattern(nurfb);
+		return 0;
+	}
 
 	if (nurfb->last_mode == 0 && first)
 	{
@@ -383,125 +905,581 @@ static int rfbNuInitVCD(struct nu_rfb *nurfb, int first)
 	return 0;
 
 error:
-	rfbClearNuRfb(nurfb);
+	/* later calls run with clients attached, nurfb has to stay */
+	if (first)
+		rfbClearNuRfb(nurfb);
 	return -1;
 }
 
-static int rfbNuGetUpdate(rfbClientRec *cl)
+/*
+ * The last full screen hardware hextile encode is kept as a keyframe for
+ * clients that join later, key_damage collects what changed since. A
+ * joining client gets the keyframe at once and the damage with its next
+ * update, instead of a full refresh.
+ */
+static void rfbNuKeyframeStore(struct nu_rfb *nurfb, const char *data, uint32_t len,
+							   unsigned int w, unsigned int h)
 {
-	struct nu_rfb *nurfb = (struct nu_rfb *)cl->clientData;
-	int index = cl->sock - nurfb->sock_start;
-	int ret;
-
-	ret = rfbNuChkVCDRes(nurfb, cl);
-	if (ret != 0)
+	if (len > nurfb->key_size)
 	{
-		int i;
+		char *buf = realloc(nurfb->key_buf, len);
 
-		if (nurfb->do_cmd)
+		if (!buf)
 		{
-			rfbNuInitVCD(nurfb, 0);
-			rfbNuNewFramebuffer(cl->screen,
-								nurfb->raw_fb_addr, nurfb->vcd_info.hdisp,
-								nurfb->vcd_info.vdisp, BitsPerSample, SamplesPerPixel, BytesPerPixel);
-			if (nurfb->dumpfps)
-				nurfb->fps_cnt = 0;
+			nurfb->key_len = 0;
+			return;
 		}
+		nurfb->key_buf = buf;
+		nurfb->key_size = len;
+	}
 
+	memcpy(nurfb->key_buf, data, len);
+	nurfb->key_len = len;
+	nurfb->key_w = w;
+	nurfb->key_h = h;
 
-		if ((nurfb->width == nurfb->vcd_info.hdisp) &&
-			(nurfb->height == nurfb->vcd_info.vdisp))
-			return 0;
-
-		LOCK(cl->updateMutex);
-		cl->newFBSizePending = TRUE;
-		UNLOCK(cl->updateMutex);
-		for (i = 0 ; i < nurfb->cl_cnt; i++)
-			nurfb->refreshCount[i] = REFRESHCNT;
-		nurfb->width = nurfb->vcd_info.hdisp;
-		nurfb->height = nurfb->vcd_info.vdisp;
+	if (!nurfb->key_damage)
+		nurfb->key_damage = sraRgnCreate();
+	sraRgnMakeEmpty(nurfb->key_damage);
+}
 
-		return 1;
-	}
+static void rfbNuKeyframeDamage(struct nu_rfb *nurfb)
+{
+	sraRegionPtr r;
 
-	if (nurfb->refreshCount[index] && (ret >= 0) && (!nurfb->fake_fb))
-		nurfb->refreshCount[index]--;
+	if (!nurfb->key_len)
+		return;
 
-	if (nurfb->refreshCount[index] > 0)
+	for (unsigned int i = 0; i < nurfb->rect_cnt; i++)
+	{
+		struct rect *t = &nurfb->rect_table[i];
+
+		r = sraRgnCreateRect(t->x, t->y, t->x + t->w, t->y + t->h);
+		sraRgnOr(nurfb->key_damage, r);
+		sraRgnDestroy(r);
+	}
+
+	/* cheaper to refresh the joining client than to replay this much */
+	if (sraRgnCountRects(nurfb->key_damage) > KEYFRAME_MAX_DAMAGE)
+		nurfb->key_len = 0;
+}
+
+/*
+ * With no client connected the VCD and ECE are reset and left idle, with
+ * hw_release their buffers are unmapped as well. The first client brings
+ * them back before its ServerInit goes out, so a mode change in between
+ * still reaches it as the initial framebuffer size.
+ */
+void rfbNuHwSleep(struct nu_rfb *nurfb)
+{
+	if (!nurfb->hw_active)
+		return;
+
+	if (!nurfb->pattern)
+	{
+		rfbNuResetVCD(nurfb);
+		rfbNuResetECE(nurfb);
+	}
+
+	if (nurfb->hw_release)
+		rfbNuUnmapVCD(nurfb);
+
+	/* the screen is not watched while idle, the keyframe goes stale */
+	nurfb->key_len = 0;
+	nurfb->fb_valid = 0;
+	nurfb->hw_active = 0;
+	rfbLog("video hardware idle\n");
+}
+
+rfbBool rfbNuHwWake(struct nu_rfb *nurfb, rfbScreenInfoPtr screen)
+{
+	unsigned long long t0;
+
+	if (nurfb->hw_active)
+		return TRUE;
+
+	t0 = rfbNuNowNs();
+
+	if (nurfb->last_mode != RAWFB_MMAP)
+	{
+		if (rfbNuInitVCD(nurfb, 0) < 0)
+			return FALSE;
+
+		if (screen->width != (int)nurfb->vcd_info.hdisp ||
+			screen->height != (int)nurfb->vcd_info.vdisp)
+		{
+			if (nurfb->bpp8)
+				rfbNuInitLut8(nurfb);
+			rfbNuNewFramebuffer(screen, nurfb->raw_fb_addr, nurfb->vcd_info.hdisp,
+								nurfb->vcd_info.vdisp, BitsPerSample, SamplesPerPixel,
+								nurfb->bpp8 ? BytesPerPixel8 : BytesPerPixel);
+			nurfb->width = nurfb->vcd_info.hdisp;
+			nurfb->height = nurfb->vcd_info.vdisp;
+		}
+	}
+
+	nurfb->hw_active = 1;
+	nurfb->hw_warmups++;
+	nurfb->hw_warmup_us = (rfbNuNowNs() - t0) / 1000;
+	if (nurfb->hw_warmup_us > nurfb->hw_warmup_max_us)
+		nurfb->hw_warmup_max_us = nurfb->hw_warmup_us;
+	rfbLog("video hardware ready in %u us\n", nurfb->hw_warmup_us);
+
+	return TRUE;
+}
+
+/* full compare rate again, on a changed screen or input from a client */
+void rfbNuIdleReset(struct nu_rfb *nurfb)
+{
+	nurfb->idle_empty = 0;
+	nurfb->idle_interval_ms = 0;
+	nurfb->next_compare_ns = 0;
+}
+
+static rfbBool rfbNuCompareDue(struct nu_rfb *nurfb)
+{
+	return !nurfb->next_compare_ns || rfbNuNowNs() >= nurfb->next_compare_ns;
+}
+
+static void rfbNuIdleTrack(rfbClientRec *cl, int rects)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	unsigned int interval;
+
+	nurfb->compares++;
+
+	if (!nurfb->idle_max_ms || rects != 0)
+	{
+		rfbNuIdleReset(nurfb);
+		return;
+	}
+
+	if (++nurfb->idle_empty < IDLE_BACKOFF_AFTER)
+		return;
+
+	interval = nurfb->idle_interval_ms;
+	if (!interval)
+		interval = cl->screen->deferUpdateTime > 0 ? cl->screen->deferUpdateTime : 1;
+	interval *= 2;
+	if (interval > nurfb->idle_max_ms)
+		interval = nurfb->idle_max_ms;
+
+	nurfb->idle_interval_ms = interval;
+	nurfb->next_compare_ns = rfbNuNowNs() + interval * 1000000ULL;
+}
+
+/* the rolling refresh repairs whatever one full capture misses */
+static inline unsigned int rfbNuRefreshCnt(struct nu_rfb *nurfb)
+{
+	return nurfb->rolling ? ROLLING_REFRESHCNT : REFRESHCNT;
+}
+
+static int rfbNuGetUpdate(rfbClientRec *cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	int ret;
+
+	if (nurfb->do_cmd)
+		nurfb->captured = TRUE;
+
+	/* the pattern moves on with every captured frame */
+	if (nurfb->pattern)
+	{
+		if (nurfb->do_cmd)
+		{
+			nurfb->pattern_phase++;
+			nurfb->frame_seq++;
+		}
+		ss->seen_seq = nurfb->frame_seq;
+		return 1;
+	}
+
+	ret = rfbNuChkVCDRes(nurfb, cl);
+	if (ret != 0)
+	{
+		if (nurfb->do_cmd)
+		{
+			rfbNuInitVCD(nurfb, 0);
+			nurfb->fb_valid = 0;
+			rfbNuIdleReset(nurfb);
+			nurfb->rect_cnt = 0;
+			if (nurfb->bpp8)
+				rfbNuInitLut8(nurfb);
+			rfbNuNewFramebuffer(cl->screen,
+								nurfb->raw_fb_addr, nurfb->vcd_info.hdisp,
+								nurfb->vcd_info.vdisp, BitsPerSample, SamplesPerPixel,
+								nurfb->bpp8 ? BytesPerPixel8 : BytesPerPixel);
+			if (nurfb->dumpfps)
+				nurfb->fps_cnt = 0;
+		}
+
+
+		if ((nurfb->width == nurfb->vcd_info.hdisp) &&
+			(nurfb->height == nurfb->vcd_info.vdisp))
+			return 0;
+
+		LOCK(cl->updateMutex);
+		cl->newFBSizePending = TRUE;
+		UNLOCK(cl->updateMutex);
+		for (struct nu_session *p = nurfb->sessions; p; p = p->next) {
+			p->refreshCount = rfbNuRefreshCnt(nurfb);
+			if (p->refine_rgn)
+				sraRgnMakeEmpty(p->refine_rgn);
+		}
+		nurfb->width = nurfb->vcd_info.hdisp;
+		nurfb->height = nurfb->vcd_info.vdisp;
+
+		return 1;
+	}
+
+	if (ss->refreshCount && (ret >= 0) && (!nurfb->fake_fb))
+		ss->refreshCount--;
+
+	if (nurfb->do_cmd)
+		nurfb->frame_seq++;
+	ss->seen_seq = nurfb->frame_seq;
+
+	if (ss->refreshCount > 0)
 	{
 		if (nurfb->do_cmd) {
 			if (rfbNuSetVCDCmd(nurfb, CAPTURE_FRAME) < 0)
 				return -1;
 		}
 
+		if (rfbNuGetDiffCnt(cl, TRUE) < 0)
+			return -1;
+
+		if (nurfb->do_cmd && !nurfb->rect_cnt)
+		{
+			nurfb->rect_table[0].x = 0;
+			nurfb->rect_table[0].y = 0;
+			nurfb->rect_table[0].w = nurfb->vcd_info.hdisp;
+			nurfb->rect_table[0].h = nurfb->vcd_info.vdisp;
+			nurfb->rect_cnt = 1;
+		}
+		if (nurfb->do_cmd)
+		{
+			nurfb->fb_valid = 1;
+			rfbNuKeyframeDamage(nurfb);
+		}
+
 		return 1;
 	}
 	else
 	{
 		if (nurfb->do_cmd) {
+			if (!rfbNuCompareDue(nurfb))
+			{
+				nurfb->rect_cnt = 0;
+				nurfb->compares_skipped++;
+				return 0;
+			}
 			if (rfbNuSetVCDCmd(nurfb, COMPARE) < 0)
 				return -1;
 		}
-		return rfbNuGetDiffCnt(cl);
+		ret = rfbNuGetDiffCnt(cl, FALSE);
+		if (nurfb->do_cmd && ret >= 0)
+		{
+			nurfb->fb_valid = 1;
+			rfbNuIdleTrack(cl, ret);
+			rfbNuKeyframeDamage(nurfb);
+		}
+		return ret;
+	}
+}
+
+/* skip n written bytes */
+static void rfbNuIovAdvance(struct iovec **iov, int *iovcnt, size_t n)
+{
+	while (*iovcnt > 0 && n >= (*iov)->iov_len)
+	{
+		n -= (*iov)->iov_len;
+		(*iov)++;
+		(*iovcnt)--;
+	}
+
+	if (*iovcnt > 0)
+	{
+		(*iov)->iov_base = (char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
 	}
 }
 
+/*
+ * One binary websocket frame around the iovecs, the header goes out in
+ * the same sendmsg as the payload. The caller holds ws->lock.
+ */
 static rfbBool
-rfbNuHextiles16HW(rfbClientPtr cl, int rx, int ry, int rw, int rh)
+rfbNuWsWriteFrame(struct nu_ws *ws, int opcode, const struct iovec *iov, int iovcnt,
+				  struct nu_tx_stats *tx)
 {
-	struct nu_rfb *nurfb = (struct nu_rfb *)cl->clientData;
-	int err = 0;
-	struct ece_ioctl_cmd cmd;
-	char *copy_addr = NULL;
-	uint32_t padding_len = 0;
-	uint32_t copy_len = 0;
-	uint32_t offset = 0;
-	rfbFramebufferUpdateRectHeader rect;
+	struct iovec wiov[WS_MAX_IOV + 1], *v = wiov;
+	unsigned char hdr[NU_WS_HDR_MAX];
+	struct msghdr msg;
+	struct pollfd pfd;
+	uint64_t len = 0;
+	int cnt = iovcnt + 1;
+	ssize_t n;
+
+	if (iovcnt > WS_MAX_IOV)
+		return FALSE;
 
-retry:
-	offset = rfbNuGetHextieDataOffset(nurfb);
-	if ((offset + (rw * rh * 2)) >= 0x400000) {
-		rfbNuClearHextieDataOffset(nurfb);
-		offset = rfbNuGetHextieDataOffset(nurfb);
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	wiov[0].iov_base = hdr;
+	wiov[0].iov_len = rfbNuWsHeader(hdr, opcode, len);
+	memcpy(&wiov[1], iov, sizeof(struct iovec) * iovcnt);
+
+	while (cnt > 0)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = v;
+		msg.msg_iovlen = cnt;
+
+		n = sendmsg(ws->fd, &msg, MSG_NOSIGNAL);
+		tx->calls++;
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				pfd.fd = ws->fd;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, ws->max_wait) <= 0)
+				{
+					rfbErr("websocket: write timeout\n");
+					return FALSE;
+				}
+				continue;
+			}
+
+			return FALSE;
+		}
+
+		tx->bytes += n;
+		rfbNuIovAdvance(&v, &cnt, n);
 	}
 
-	cmd.x = rx;
-	cmd.y = ry;
-	cmd.w = rw;
-	cmd.h = rh;
-	if ((err = ioctl(nurfb->hextile_fd, ECE_IOCGETED, &cmd)) < 0)
+	return TRUE;
+}
+
+/*
+ * Frame whatever libvncserver has written into its end of the socketpair
+ * so far. The caller holds ws->lock. FALSE once libvncserver closed its
+ * end or the viewer is gone.
+ */
+static rfbBool rfbNuWsFlush(struct nu_ws *ws, struct nu_tx_stats *tx)
+{
+	struct iovec iov;
+	ssize_t n;
+
+	for (;;)
 	{
-		rfbErr("vnc: get encoding data failed:%d\n", err);
-		rfbNuClearHextieDataOffset(nurfb);
-		rfbNuResetECE(nurfb);
-		goto retry;
+		n = recv(ws->pair, ws->out, WS_CHUNK, MSG_DONTWAIT);
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		if (n == 0)
+			return FALSE;
+
+		iov.iov_base = ws->out;
+		iov.iov_len = n;
+		if (!rfbNuWsWriteFrame(ws, NU_WS_OP_BINARY, &iov, 1, tx))
+			return FALSE;
 	}
+}
 
-#if DBG
-	rfbLog("x %d y %d %dx%d \n", rx, ry, rw, rh);
-	rfbLog("offset %d cmd.len %d cmd.gap_len %d \n", offset,  cmd.len, cmd.gap_len);
-	rfbLog("frame size %d map size %d \n",  nurfb->frame_size,  nurfb->raw_hextile_mmap);
+/*
+ * Write all iovecs with as few syscalls as possible, waiting for the
+ * socket to drain when the kernel buffer is full. The caller holds the
+ * client output mutex and owns tx. Sender threads never pass
+ * MSG_ZEROCOPY, the zerocopy state is only touched on the main thread.
+ *
+ * Websocket sessions write to the viewer's connection instead. Holding
+ * the output mutex keeps libvncserver out of the socketpair, so flushing
+ * it first puts everything the library wrote before this data.
+ */
+static rfbBool
+rfbNuWriteIov(rfbClientPtr cl, struct iovec *iov, int iovcnt, int flags,
+			  struct nu_tx_stats *tx)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_ws *ws = rfbNuSession(cl)->ws;
+	struct msghdr msg;
+	struct pollfd pfd;
+	ssize_t n;
+
+	if (ws)
+	{
+		rfbBool ok;
+
+		pthread_mutex_lock(&ws->lock);
+		ok = rfbNuWsFlush(ws, tx) && rfbNuWsWriteFrame(ws, NU_WS_OP_BINARY, iov, iovcnt, tx);
+		pthread_mutex_unlock(&ws->lock);
+
+		return ok;
+	}
+
+	while (iovcnt > 0)
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+
+		n = sendmsg(cl->sock, &msg, flags | MSG_NOSIGNAL);
+		tx->calls++;
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+			{
+				pfd.fd = cl->sock;
+				pfd.events = POLLOUT;
+				if (poll(&pfd, 1, cl->screen->maxClientWait) <= 0)
+				{
+					rfbErr("rfbNuWriteIov: write timeout\n");
+					return FALSE;
+				}
+				continue;
+			}
+
+#ifdef MSG_ZEROCOPY
+			/* device memory can not always be pinned, fall back to copying */
+			if ((flags & MSG_ZEROCOPY) && (errno == EFAULT || errno == ENOBUFS))
+			{
+				rfbLog("zerocopy send failed (%d), disabled\n", errno);
+				nurfb->zerocopy = 0;
+				flags &= ~MSG_ZEROCOPY;
+				continue;
+			}
 #endif
+			return FALSE;
+		}
 
-	if (((cmd.gap_len + offset + cmd.len) >= nurfb->raw_hextile_mmap) || (cmd.len <= 1))
+		tx->bytes += n;
+		if (rfbNuSession(cl)->tls)
+			tx->tls_bytes += n;
+#ifdef MSG_ZEROCOPY
+		if (flags & MSG_ZEROCOPY)
+		{
+			rfbNuSession(cl)->zc_pending++;
+			tx->zc_bytes += n;
+		}
+#endif
+
+		rfbNuIovAdvance(&iov, &iovcnt, n);
+	}
+
+	return TRUE;
+}
+
+static rfbBool
+rfbNuSendIov(rfbClientPtr cl, struct iovec *iov, int iovcnt, rfbBool zerocopy)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	rfbBool ok;
+	int flags = 0;
+
+	if (cl->sock < 0)
+		return FALSE;
+
+#ifdef MSG_ZEROCOPY
+	if (zerocopy && nurfb->zerocopy && !rfbNuSession(cl)->zc_stalled &&
+		!rfbNuSession(cl)->ws)
 	{
-		rfbNuClearHextieDataOffset(nurfb);
-		goto retry;
+		struct nu_session *ss = rfbNuSession(cl);
+
+		if (ss->zc_sock != cl->sock)
+		{
+			/* a close drops queued data, which still points into the ECE buffer */
+			struct linger lg = {1, 0};
+			int one = 1;
+
+			ss->zc_pending = 0;
+			ss->zc_sock = -1;
+			if (setsockopt(cl->sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0 &&
+				setsockopt(cl->sock, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)) == 0)
+				ss->zc_sock = cl->sock;
+		}
+
+		if (ss->zc_sock == cl->sock)
+		{
+			flags = MSG_ZEROCOPY;
+			rfbNuZeroCopyReap(ss, 0);
+		}
 	}
+#endif
 
-	copy_addr = nurfb->raw_hextile_addr + cmd.gap_len + offset;
+	LOCK(cl->outputMutex);
+	ok = rfbNuWriteIov(cl, iov, iovcnt, flags, &nurfb->tx);
+	UNLOCK(cl->outputMutex);
+
+	if (!ok)
+	{
+		rfbErr("rfbNuSendIov: write \n");
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+ * writev bypasses the library transport, only plain sockets and clients
+ * of our own websocket listener can use it. Websocket clients libvncserver
+ * upgraded itself stay on the library path: whether such a session framed
+ * binary or base64 is private to its websocket layer, so frames built
+ * here could not be trusted to match.
+ */
+static inline rfbBool rfbNuCanSendIov(rfbClientPtr cl)
+{
+#ifdef LIBVNCSERVER_WITH_WEBSOCKETS
+	if (cl->sslctx || cl->wsctx)
+		return FALSE;
+#endif
+	return TRUE;
+}
+
+static rfbBool
+rfbNuSendHextileRect(rfbClientPtr cl, int rx, int ry, int rw, int rh,
+					 char *copy_addr, uint32_t len, rfbBool zerocopy)
+{
+	uint32_t padding_len = 0;
+	uint32_t copy_len = 0;
+	rfbFramebufferUpdateRectHeader rect;
+	struct iovec iov[2];
 
 	rect.r.x = Swap16IfLE(rx);
 	rect.r.y = Swap16IfLE(ry);
 	rect.r.w = Swap16IfLE(rw);
 	rect.r.h = Swap16IfLE(rh);
 	rect.encoding = Swap32IfLE(rfbEncodingHextile);
+
+	rfbStatRecordEncodingSent(cl, rfbEncodingHextile,
+							  sz_rfbFramebufferUpdateRectHeader + len,
+							  sz_rfbFramebufferUpdateRectHeader + rw * rh * 2);
+
+	if (rfbNuCanSendIov(cl))
+	{
+		iov[0].iov_base = &rect;
+		iov[0].iov_len = sz_rfbFramebufferUpdateRectHeader;
+		iov[1].iov_base = copy_addr;
+		iov[1].iov_len = len;
+
+		return rfbNuSendIov(cl, iov, 2, zerocopy && len >= ZEROCOPY_MIN_LEN);
+	}
+
 	if (!rfbNuSendUpdateBuf(cl, (char *)&rect, sz_rfbFramebufferUpdateRectHeader))
 		return FALSE;
 
-	if (cmd.len > UPDATE_BUF_SIZE)
+	if (len > UPDATE_BUF_SIZE)
 	{
-		padding_len = cmd.len - (UPDATE_BUF_SIZE);
+		padding_len = len - (UPDATE_BUF_SIZE);
 
 		if (!rfbNuSendUpdateBuf(cl, copy_addr, (UPDATE_BUF_SIZE)))
 			return FALSE;
@@ -525,49 +1503,402 @@ retry:
 		} while (padding_len != 0);
 	}
 	else
-		rfbNuSendUpdateBuf(cl, copy_addr, cmd.len);
+		rfbNuSendUpdateBuf(cl, copy_addr, len);
 
 	return TRUE;
 }
 
-static int rfbNuGetDiffTable(rfbClientRec *cl, struct rect *rect, int i)
+static void rfbNuMemoReset(struct nu_frame_memo *memo, unsigned int seq)
 {
-	struct nu_rfb *nurfb = (struct nu_rfb *)cl->clientData;
-	struct rect *rect_table = nurfb->rect_table;
-	int index = cl->sock - nurfb->sock_start;
+	for (unsigned int i = 0; i < memo->cnt; i++)
+		free(memo->entries[i].data);
+	memo->cnt = 0;
+	memo->bytes = 0;
+	memo->seq = seq;
+}
 
-	if (nurfb->do_cmd)
+/*
+ * Clients fed from the same capture ask for the same rects, keep their
+ * encoded form for the rest of the frame so only the first one pays for
+ * the ECE.
+ */
+static struct nu_memo_entry *
+rfbNuMemoLookup(struct nu_rfb *nurfb, rfbClientPtr cl, int rx, int ry, int rw, int rh)
+{
+	struct nu_frame_memo *memo = &nurfb->memo;
+
+	if (memo->seq != nurfb->frame_seq)
+		rfbNuMemoReset(memo, nurfb->frame_seq);
+
+	for (unsigned int i = 0; i < memo->cnt; i++)
 	{
-		if (ioctl(nurfb->raw_fb_fd, VCD_IOCGETDIFF, rect) < 0)
+		struct nu_memo_entry *e = &memo->entries[i];
+
+		if (e->r.x == rx && e->r.y == ry && e->r.w == rw && e->r.h == rh &&
+			rfbNuSameFormat(&e->format, &cl->format))
 		{
-			rfbErr("get rect table failed\n");
-			return -1;
+			memo->hits++;
+			return e;
 		}
-		rect_table[i].x = rect->x;
-		rect_table[i].y = rect->y;
-		rect_table[i].w = rect->w;
-		rect_table[i].h = rect->h;
 	}
-	else
-	{
-		if (nurfb->refreshCount[index] > 0)
+
+	return NULL;
+}
+
+static void
+rfbNuMemoInsert(struct nu_rfb *nurfb, rfbClientPtr cl, int rx, int ry, int rw, int rh,
+				const char *data, uint32_t len)
+{
+	struct nu_frame_memo *memo = &nurfb->memo;
+	struct nu_memo_entry *e;
+
+	if (memo->bytes + len > FRAME_MEMO_MAX_BYTES)
+		return;
+
+	if (memo->cnt == memo->size)
+	{
+		unsigned int size = memo->size ? memo->size * 2 : 64;
+
+		e = realloc(memo->entries, size * sizeof(struct nu_memo_entry));
+		if (!e)
+			return;
+		memo->entries = e;
+		memo->size = size;
+	}
+
+	e = &memo->entries[memo->cnt];
+	e->data = malloc(len);
+	if (!e->data)
+		return;
+
+	memcpy(e->data, data, len);
+	e->r.x = rx;
+	e->r.y = ry;
+	e->r.w = rw;
+	e->r.h = rh;
+	e->format = cl->format;
+	e->len = len;
+	memo->bytes += len;
+	memo->cnt++;
+}
+
+/*
+ * Encode a rect with the ECE, or take it from the tile cache. *mapped is
+ * set when the data lives in the raw_hextile_addr mapping.
+ */
+static rfbBool
+rfbNuEncodeHextile16HW(rfbClientPtr cl, int rx, int ry, int rw, int rh,
+					   char **data, uint32_t *len, rfbBool *mapped)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	int err = 0;
+	struct ece_ioctl_cmd cmd;
+	char *copy_addr = NULL;
+	uint32_t offset = 0;
+	uint64_t key = 0;
+	rfbBool cacheable = FALSE;
+	rfbBool shared = nurfb->cl_cnt > 1 && !nurfb->fake_fb;
+
+	if (shared)
+	{
+		struct nu_memo_entry *e = rfbNuMemoLookup(nurfb, cl, rx, ry, rw, rh);
+
+		if (e)
 		{
-			rect->x = 0;
-			rect->y = 0;
-			rect->w = cl->screen->width;
-			rect->h = cl->screen->height;
+			*data = e->data;
+			*len = e->len;
+			*mapped = FALSE;
+			return TRUE;
 		}
-		else
+	}
+
+	if (nurfb->tile_cache && !nurfb->fake_fb && (rw * rh <= TILE_CACHE_MAX_AREA))
+	{
+		struct nu_tile_entry *e;
+
+		key = rfbNuTileCacheHash(nurfb->raw_fb_addr, nurfb->vcd_info.line_pitch,
+								 rx, ry, rw, rh, &cl->format);
+		e = rfbNuTileCacheLookup(nurfb->tile_cache, key, nurfb->raw_fb_addr,
+								 nurfb->vcd_info.line_pitch, rx, ry, rw, rh,
+								 &cl->format);
+		if (e)
 		{
-			rect->x = rect_table[i].x;
-			rect->y = rect_table[i].y;
-			rect->w = rect_table[i].w;
-			rect->h = rect_table[i].h;
+			*data = e->data;
+			*len = e->len;
+			*mapped = FALSE;
+			return TRUE;
 		}
+
+		cacheable = TRUE;
+	}
+
+retry:
+	offset = rfbNuGetHextieDataOffset(nurfb);
+	if ((offset + (rw * rh * 2)) >= 0x400000) {
+		rfbNuClearHextieDataOffset(nurfb);
+		if (nurfb->ece_pinned)
+			return FALSE;
+		offset = rfbNuGetHextieDataOffset(nurfb);
+	}
+
+	cmd.x = rx;
+	cmd.y = ry;
+	cmd.w = rw;
+	cmd.h = rh;
+	if ((err = ioctl(nurfb->hextile_fd, ECE_IOCGETED, &cmd)) < 0)
+	{
+		rfbErr("vnc: get encoding data failed:%d\n", err);
+		rfbNuClearHextieDataOffset(nurfb);
+		if (nurfb->ece_pinned)
+			return FALSE;
+		rfbNuResetECE(nurfb);
+		goto retry;
+	}
+
+#if DBG
+	rfbLog("x %d y %d %dx%d \n", rx, ry, rw, rh);
+	rfbLog("offset %d cmd.len %d cmd.gap_len %d \n", offset,  cmd.len, cmd.gap_len);
+	rfbLog("frame size %d map size %d \n",  nurfb->frame_size,  nurfb->raw_hextile_mmap);
+#endif
+
+	if (((cmd.gap_len + offset + cmd.len) >= nurfb->raw_hextile_mmap) || (cmd.len <= 1))
+	{
+		rfbNuClearHextieDataOffset(nurfb);
+		if (nurfb->ece_pinned)
+			return FALSE;
+		goto retry;
+	}
+
+	copy_addr = nurfb->raw_hextile_addr + cmd.gap_len + offset;
+
+	if (!rx && !ry && rw == cl->screen->width && rh == cl->screen->height &&
+		!nurfb->fake_fb)
+		rfbNuKeyframeStore(nurfb, copy_addr, cmd.len, rw, rh);
+
+	if (cacheable)
+		rfbNuTileCacheInsert(nurfb->tile_cache, key, nurfb->raw_fb_addr,
+							 nurfb->vcd_info.line_pitch, rx, ry, rw, rh,
+							 &cl->format, copy_addr, cmd.len);
+
+	if (shared)
+		rfbNuMemoInsert(nurfb, cl, rx, ry, rw, rh, copy_addr, cmd.len);
+
+	*data = copy_addr;
+	*len = cmd.len;
+	*mapped = TRUE;
+
+	return TRUE;
+}
+
+static rfbBool
+rfbNuHextiles16HW(rfbClientPtr cl, int rx, int ry, int rw, int rh)
+{
+	char *data;
+	uint32_t len;
+	rfbBool mapped;
+
+	if (!rfbNuEncodeHextile16HW(cl, rx, ry, rw, rh, &data, &len, &mapped))
+	{
+		/* the ECE buffer is pinned by zerocopy sends */
+		rfbNuCopyRect(rfbNuRfb(cl), cl->screen, rx, ry, rw, rh);
+		return rfbSendRectEncodingHextile(cl, rx, ry, rw, rh);
+	}
+
+	return rfbNuSendHextileRect(cl, rx, ry, rw, rh, data, len, mapped);
+}
+
+static int rfbNuGetDiffTable(rfbClientRec *cl, struct rect *rect, int i)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+
+	if (!nurfb->do_cmd && ss->refreshCount > 0)
+	{
+		rect->x = 0;
+		rect->y = 0;
+		rect->w = cl->screen->width;
+		rect->h = cl->screen->height;
+	}
+	else
+	{
+		if ((unsigned int)i >= nurfb->rect_cnt)
+			return -1;
+
+		*rect = nurfb->rect_table[i];
 	}
 	return 0;
 }
 
+static struct nu_scaled *rfbNuGetScaled(struct nu_rfb *nurfb, rfbScreenInfoPtr scaled)
+{
+	struct nu_scaled *slot = &nurfb->scaled[0];
+
+	for (int i = 0; i < MAX_SCALED; i++)
+	{
+		if (nurfb->scaled[i].screen == scaled)
+			return &nurfb->scaled[i];
+		if (nurfb->scaled[i].seq < slot->seq)
+			slot = &nurfb->scaled[i];
+	}
+
+	if (!slot->done)
+		slot->done = sraRgnCreate();
+	sraRgnMakeEmpty(slot->done);
+	slot->screen = scaled;
+	slot->seq = nurfb->frame_seq - 1;
+
+	return slot;
+}
+
+/*
+ * Box filter the captured frame into a scaled framebuffer. Works on whole
+ * f x f blocks, averaging each channel of the RGB565 source.
+ */
+static void rfbNuDownscale(struct nu_rfb *nurfb, rfbScreenInfoPtr scaled, int f,
+						   int dx, int dy, int dw, int dh)
+{
+	struct vcd_info *info = &nurfb->vcd_info;
+	unsigned int area = f * f;
+	uint32_t acc_r[dw], acc_g[dw], acc_b[dw];
+
+	for (int y = dy; y < dy + dh; y++)
+	{
+		memset(acc_r, 0, sizeof(acc_r));
+		memset(acc_g, 0, sizeof(acc_g));
+		memset(acc_b, 0, sizeof(acc_b));
+
+		for (int k = 0; k < f; k++)
+		{
+			const uint16_t *src = (const uint16_t *)(nurfb->raw_fb_addr +
+							(y * f + k) * info->line_pitch) + dx * f;
+
+			for (int x = 0; x < dw; x++)
+			{
+				for (int m = 0; m < f; m++)
+				{
+					uint16_t p = src[x * f + m];
+
+					acc_r[x] += (p >> info->r_shift) & info->r_max;
+					acc_g[x] += (p >> info->g_shift) & info->g_max;
+					acc_b[x] += (p >> info->b_shift) & info->b_max;
+				}
+			}
+		}
+
+		for (int x = 0; x < dw; x++)
+		{
+			uint16_t p = ((acc_r[x] / area) << info->r_shift) |
+						 ((acc_g[x] / area) << info->g_shift) |
+						 ((acc_b[x] / area) << info->b_shift);
+
+			if (nurfb->bpp8)
+				((uint8_t *)scaled->frameBuffer)[y * scaled->paddedWidthInBytes + dx + x] = nurfb->lut8[p];
+			else
+				((uint16_t *)(scaled->frameBuffer + y * scaled->paddedWidthInBytes))[dx + x] = p;
+		}
+	}
+}
+
+/*
+ * Send a rect to a client that asked for a scaled framebuffer. The scaled
+ * framebuffer is shared by every client using the same scale, so each
+ * area is filtered only once per captured frame.
+ */
+static rfbBool
+rfbNuSendRectScaled(rfbClientPtr cl, struct rect *rect)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	rfbScreenInfoPtr scaled = cl->scaledScreen;
+	struct nu_scaled *ns;
+	sraRegionPtr todo;
+	sraRectangleIterator *iter;
+	sraRect r;
+	int f, x0, y0, x1, y1;
+
+	f = cl->screen->width / scaled->width;
+	if (f < 1)
+		f = 1;
+
+	x0 = rect->x / f;
+	y0 = rect->y / f;
+	x1 = (rect->x + rect->w + f - 1) / f;
+	y1 = (rect->y + rect->h + f - 1) / f;
+	if (x1 > scaled->width)
+		x1 = scaled->width;
+	if (y1 > scaled->height)
+		y1 = scaled->height;
+	if (x1 <= x0 || y1 <= y0)
+		return TRUE;
+
+	ns = rfbNuGetScaled(nurfb, scaled);
+	if (ns->seq != nurfb->frame_seq)
+	{
+		sraRgnMakeEmpty(ns->done);
+		ns->seq = nurfb->frame_seq;
+	}
+
+	todo = sraRgnCreateRect(x0, y0, x1, y1);
+	sraRgnSubtract(todo, ns->done);
+	iter = sraRgnGetIterator(todo);
+	while (sraRgnIteratorNext(iter, &r))
+		rfbNuDownscale(nurfb, scaled, f, r.x1, r.y1, r.x2 - r.x1, r.y2 - r.y1);
+	sraRgnReleaseIterator(iter);
+	sraRgnDestroy(todo);
+
+	todo = sraRgnCreateRect(x0, y0, x1, y1);
+	sraRgnOr(ns->done, todo);
+	sraRgnDestroy(todo);
+
+	return rfbSendRectEncodingHextile(cl, x0, y0, x1 - x0, y1 - y0);
+}
+
+/* the ECE produces 16bpp hextile in the captured format only */
+static inline rfbBool rfbNuUseHW(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+
+	return cl->format.bitsPerPixel == 16 && !nurfb->bpp8 &&
+		   cl->scaledScreen == cl->screen;
+}
+
+/*
+ * First update of a joining client. FALSE when there is no usable
+ * keyframe, the client then refreshes on its own.
+ */
+static rfbBool rfbNuSendKeyframe(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+
+	if (!nurfb->key_len || nurfb->fake_fb || !rfbNuUseHW(cl) ||
+		nurfb->key_w != (unsigned int)cl->screen->width ||
+		nurfb->key_h != (unsigned int)cl->screen->height)
+		return FALSE;
+
+	fu->type = rfbFramebufferUpdate;
+	fu->nRects = Swap16IfLE(1);
+	cl->ublen = sz_rfbFramebufferUpdateMsg;
+	if (!rfbSendUpdateBuf(cl))
+		return FALSE;
+
+	if (!rfbNuSendHextileRect(cl, 0, 0, nurfb->key_w, nurfb->key_h,
+							  nurfb->key_buf, nurfb->key_len, FALSE))
+		return FALSE;
+
+	/* the keyframe answers the initial full request, the damage follows */
+	if (!ss->pending_rgn)
+		ss->pending_rgn = sraRgnCreate();
+	sraRgnOr(ss->pending_rgn, nurfb->key_damage);
+	LOCK(cl->updateMutex);
+	sraRgnMakeEmpty(cl->modifiedRegion);
+	UNLOCK(cl->updateMutex);
+	ss->seen_seq = nurfb->frame_seq;
+	nurfb->key_sent++;
+
+	return TRUE;
+}
+
 static rfbBool
 rfbNuSendRectEncodingHextile(rfbClientPtr cl,
 							 int x,
@@ -585,232 +1916,2702 @@ rfbNuSendRectEncodingHextile(rfbClientPtr cl,
 	return FALSE;
 }
 
-static void
-rfbDumpFPS(rfbClientPtr cl)
+static uint16_t rfbNuLossyMask(struct vcd_info *info)
 {
-	struct nu_rfb *nurfb = (struct nu_rfb *)cl->clientData;
-	struct timespec end;
+	uint32_t max[3] = {info->r_max, info->g_max, info->b_max};
+	uint32_t shift[3] = {info->r_shift, info->g_shift, info->b_shift};
+	uint16_t mask = 0;
 
-	if (nurfb->dumpfps)
+	for (int c = 0; c < 3; c++)
 	{
-		if (nurfb->fps_cnt == 0) {
-			clock_gettime(CLOCK_MONOTONIC, &start);
-			nurfb->fps_cnt++;
-		} else {
-			clock_gettime(CLOCK_MONOTONIC, &end);
-			if (timediff(&start, &end) >= nurfb->dumpfps) {
-				rfbLog("Avg. FPS = %d \n", nurfb->fps_cnt/nurfb->dumpfps);
-				nurfb->fps_cnt = 0;
-			} else
-				nurfb->fps_cnt++;
+		int bits = 0;
+
+		while ((max[c] >> bits) & 1)
+			bits++;
+		if (bits > PROGRESSIVE_BITS)
+			mask |= ((max[c] >> (bits - PROGRESSIVE_BITS)) << (bits - PROGRESSIVE_BITS)) << shift[c];
+		else
+			mask |= max[c] << shift[c];
+	}
+
+	return mask;
+}
+
+/*
+ * Send a colour reduced copy of the rect through the software hextile
+ * encoder. Few colours per tile lets hextile fall back to solid and
+ * two-colour subrects, so a large change reaches slow links quickly.
+ * The reduced pixels go to a scratch frame that stands in for the
+ * framebuffer only for this call, software path clients keep reading
+ * the untouched one.
+ */
+static rfbBool
+rfbNuSendRectLossy(rfbClientPtr cl, int x, int y, int w, int h)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	rfbScreenInfoPtr screen = cl->scaledScreen;
+	uint16_t mask = rfbNuLossyMask(&nurfb->vcd_info);
+	size_t size = (size_t)screen->paddedWidthInBytes * screen->height;
+	char *fb;
+	rfbBool ret;
+
+	if (nurfb->lossy_fb_size < size)
+	{
+		char *buf = realloc(nurfb->lossy_fb, size);
+
+		if (!buf)
+		{
+			rfbErr("%s: failed to allocate lossy frame\n", __func__);
+			return FALSE;
+		}
+		nurfb->lossy_fb = buf;
+		nurfb->lossy_fb_size = size;
+	}
+
+	for (int j = y; j < y + h; j++)
+	{
+		const uint16_t *src = (const uint16_t *)(nurfb->raw_fb_addr + j * nurfb->vcd_info.line_pitch) + x;
+		uint16_t *dst = (uint16_t *)(nurfb->lossy_fb + j * screen->paddedWidthInBytes) + x;
+
+		for (int i = 0; i < w; i++)
+			dst[i] = src[i] & mask;
+	}
+
+	fb = screen->frameBuffer;
+	screen->frameBuffer = nurfb->lossy_fb;
+	ret = rfbSendRectEncodingHextile(cl, x, y, w, h);
+	screen->frameBuffer = fb;
+
+	return ret;
+}
+
+static rfbBool rfbNuIsLossyRect(struct nu_rfb *nurfb, struct rect *rect)
+{
+	return rect->w * rect->h >= (nurfb->vcd_info.hdisp * nurfb->vcd_info.vdisp) / PROGRESSIVE_AREA_DIV;
+}
+
+/*
+ * Collect the rects of the lossy area still waiting for the lossless
+ * pass. Refinement only starts after the area has been static for
+ * nurfb->progressive frames and is spread over several updates.
+ */
+static int rfbNuGetRefineRects(rfbClientPtr cl, struct rect *rects, int max)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	sraRegionPtr rgn = ss->refine_rgn;
+	sraRectangleIterator *iter;
+	sraRect r;
+	unsigned int budget = (nurfb->vcd_info.hdisp * nurfb->vcd_info.vdisp) / PROGRESSIVE_REFINE_DIV;
+	int cnt = 0;
+
+	if (!rgn || sraRgnEmpty(rgn))
+		return 0;
+
+	if (ss->refine_age < (unsigned int)nurfb->progressive)
+		return 0;
+
+	iter = sraRgnGetIterator(rgn);
+	while (cnt < max && sraRgnIteratorNext(iter, &r))
+	{
+		unsigned int area;
+
+		rects[cnt].x = r.x1;
+		rects[cnt].y = r.y1;
+		rects[cnt].w = r.x2 - r.x1;
+		rects[cnt].h = r.y2 - r.y1;
+
+		/* cut tall bands so one update stays within the budget */
+		if (rects[cnt].w * rects[cnt].h > budget && budget >= rects[cnt].w * 16)
+			rects[cnt].h = (budget / rects[cnt].w) & ~15;
+
+		area = rects[cnt].w * rects[cnt].h;
+		cnt++;
+
+		if (area >= budget)
+			break;
+		budget -= area;
+	}
+	sraRgnReleaseIterator(iter);
+
+	return cnt;
+}
+
+static rfbBool rfbNuRgnHitsRect(sraRegionPtr rgn, struct rect *rect)
+{
+	sraRegionPtr r = sraRgnCreateRect(rect->x, rect->y, rect->x + rect->w, rect->y + rect->h);
+	rfbBool hit;
+
+	sraRgnAnd(r, rgn);
+	hit = !sraRgnEmpty(r);
+	sraRgnDestroy(r);
+
+	return hit;
+}
+
+/*
+ * Age the lossy area by captured frames rather than by updates sent.
+ * Damage about to go out to the client inside the area restarts the
+ * count, it is still changing and refining it now would be wasted.
+ */
+static void rfbNuRefineAge(rfbClientPtr cl, struct rect *rects)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	unsigned int frames = nurfb->frame_seq - ss->refine_seq;
+
+	ss->refine_seq = nurfb->frame_seq;
+	if (!frames || !ss->refine_rgn || sraRgnEmpty(ss->refine_rgn))
+		return;
+
+	for (int i = 0; i < nurfb->nRects; i++)
+	{
+		struct rect rect;
+
+		if (rects)
+			rect = rects[i];
+		else if (rfbNuGetDiffTable(cl, &rect, i) < 0)
+			break;
+
+		if (rfbNuRgnHitsRect(ss->refine_rgn, &rect))
+		{
+			ss->refine_age = 0;
+			return;
 		}
 	}
+
+	ss->refine_age += frames;
+}
+
+static void rfbNuRefineTrack(rfbClientPtr cl, struct rect *rect, rfbBool lossy)
+{
+	struct nu_session *ss = rfbNuSession(cl);
+	sraRegionPtr r;
+
+	if (!ss->refine_rgn)
+		ss->refine_rgn = sraRgnCreate();
+
+	r = sraRgnCreateRect(rect->x, rect->y, rect->x + rect->w, rect->y + rect->h);
+	if (lossy)
+	{
+		sraRgnOr(ss->refine_rgn, r);
+		ss->refine_age = 0;
+		ss->refine_seq = rfbNuRfb(cl)->frame_seq;
+	}
+	else
+		sraRgnSubtract(ss->refine_rgn, r);
+	sraRgnDestroy(r);
+}
+
+static void rfbNuTxStatsAdd(struct nu_tx_stats *dst, const struct nu_tx_stats *src)
+{
+	dst->calls += src->calls;
+	dst->bytes += src->bytes;
+	dst->zc_bytes += src->zc_bytes;
+	dst->tls_bytes += src->tls_bytes;
+}
+
+static void
+rfbNuDumpTxStats(struct nu_rfb *nurfb)
+{
+	struct nu_tx_stats tx = nurfb->tx;
+	struct timespec now;
+	unsigned long long cpu_us, bytes;
+
+	/* sender threads keep their own counts, sum them up here */
+	for (struct nu_session *ss = nurfb->sessions; ss; ss = ss->next)
+	{
+		if (!ss->sender.running)
+			continue;
+
+		pthread_mutex_lock(&ss->sender.lock);
+		rfbNuTxStatsAdd(&tx, &ss->sender.tx);
+		pthread_mutex_unlock(&ss->sender.lock);
+	}
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+	cpu_us = (now.tv_sec - nurfb->tx_last_cpu.tv_sec) * 1000000ULL +
+			 (now.tv_nsec - nurfb->tx_last_cpu.tv_nsec) / 1000;
+	bytes = tx.bytes - nurfb->tx_last_bytes;
+
+	rfbLog("tx: %llu sendmsg calls, %llu KB (%llu KB zerocopy, %llu KB kTLS), %llu us cpu/MB\n",
+		   tx.calls, tx.bytes >> 10, tx.zc_bytes >> 10,
+		   tx.tls_bytes >> 10, bytes ? cpu_us * (1 << 20) / bytes : 0);
+	if (nurfb->zerocopy)
+		rfbLog("zerocopy: %llu stalled clients, ECE buffer %s\n", nurfb->zc_stalls,
+			   nurfb->ece_pinned ? "pinned" : "free");
+
+	nurfb->tx_last_cpu = now;
+	nurfb->tx_last_bytes = tx.bytes;
+}
+
+/* 0 removes the cap */
+void rfbNuSetClientFps(struct nu_session *ss, unsigned int fps)
+{
+	ss->fps_target = fps;
+	ss->next_frame_ns = 0;
+	ss->frames_sent = 0;
+}
+
+static rfbBool rfbNuFrameDue(rfbClientPtr cl)
+{
+	struct nu_session *ss = rfbNuSession(cl);
+
+	return !ss->fps_target || rfbNuNowNs() >= ss->next_frame_ns;
+}
+
+static void rfbNuFrameScheduled(rfbClientPtr cl)
+{
+	struct nu_session *ss = rfbNuSession(cl);
+	unsigned long long now, interval;
+
+	if (!ss->fps_target)
+		return;
+
+	/* keep the cadence, but do not burst to catch up after a stall */
+	now = rfbNuNowNs();
+	interval = 1000000000ULL / ss->fps_target;
+	if (ss->next_frame_ns + interval < now)
+		ss->next_frame_ns = now;
+	else
+		ss->next_frame_ns += interval;
+}
+
+static void
+rfbNuDumpClientFPS(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+
+	for (struct nu_session *ss = nurfb->sessions; ss; ss = ss->next)
+	{
+		rfbLog("client %u: %s, %u fps, cap %u, %d damage rects pending\n", ss->id,
+			   ss->tier == NU_TIER_VIEWER ? "viewer" : "operator",
+			   ss->frames_sent / nurfb->dumpfps, ss->fps_target,
+			   ss->pending_rgn ? (int)sraRgnCountRects(ss->pending_rgn) : 0);
+		ss->frames_sent = 0;
+	}
+}
+
+static void
+rfbDumpFPS(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct timespec end;
+
+	if (nurfb->dumpfps)
+	{
+		if (nurfb->fps_cnt == 0) {
+			clock_gettime(CLOCK_MONOTONIC, &nurfb->fps_start);
+			nurfb->fps_cnt++;
+		} else {
+			clock_gettime(CLOCK_MONOTONIC, &end);
+			if (timediff(&nurfb->fps_start, &end) >= nurfb->dumpfps) {
+				rfbLog("Avg. FPS = %d \n", nurfb->fps_cnt/nurfb->dumpfps);
+				rfbNuDumpClientFPS(cl);
+				rfbNuTileCacheDumpStats(nurfb->tile_cache);
+				if (nurfb->input_rejected)
+					rfbLog("viewers: %llu input events dropped\n",
+						   nurfb->input_rejected);
+				if (nurfb->memo.hits)
+					rfbLog("frame memo: %llu rects shared between clients\n",
+						   nurfb->memo.hits);
+				rfbNuDumpTxStats(nurfb);
+				if (nurfb->async_send)
+					rfbLog("async send: %llu frames merged into pending updates\n",
+						   nurfb->frames_merged);
+				if (nurfb->total_rate.rate || nurfb->client_kbps)
+					rfbLog("rate limit: %llu frames skipped, %llu rects colour reduced\n",
+						   nurfb->rate_skipped, nurfb->rate_lossy_rects);
+				for (struct nu_session *ss = nurfb->sessions; ss; ss = ss->next)
+					if (ss->cu.enabled)
+						rfbLog("continuous updates: client %u rtt %u us, %u frames in flight\n",
+							   ss->id, ss->cu.rtt_us, ss->cu.inflight);
+				if (nurfb->cu_held)
+					rfbLog("continuous updates: %llu frames held for fences\n", nurfb->cu_held);
+				if (nurfb->latency_budget)
+					rfbLog("backpressure: %llu updates held back\n",
+						   nurfb->updates_deferred);
+				if (nurfb->rolling)
+					rfbLog("rolling refresh: %llu bands sent\n", nurfb->roll_slices);
+				rfbLog("keyframe: %llu joins served, %llu refreshed, %u KB\n",
+					   nurfb->key_sent, nurfb->key_missed, nurfb->key_len >> 10);
+				rfbLog("hw warm-up: %llu times, last %u us, max %u us\n",
+					   nurfb->hw_warmups, nurfb->hw_warmup_us, nurfb->hw_warmup_max_us);
+				if (nurfb->idle_max_ms)
+					rfbLog("idle backoff: %llu compares, %llu skipped, interval %u ms\n",
+						   nurfb->compares, nurfb->compares_skipped, nurfb->idle_interval_ms);
+				rfbLog("wakeups: %llu listen, %llu client, %llu local, %llu hid, %llu capture, %llu pace, %llu pointer, %llu poll, %llu relay, %llu sender, %llu websocket\n",
+					   nurfb->wakeups[NU_WAKE_LISTEN], nurfb->wakeups[NU_WAKE_CLIENT],
+					   nurfb->wakeups[NU_WAKE_LOCAL], nurfb->wakeups[NU_WAKE_HID],
+					   nurfb->wakeups[NU_WAKE_CAPTURE], nurfb->wakeups[NU_WAKE_PACE],
+					   nurfb->wakeups[NU_WAKE_PTR], nurfb->wakeups[NU_WAKE_POLL],
+					   nurfb->wakeups[NU_WAKE_RELAY], nurfb->wakeups[NU_WAKE_SENDER],
+					   nurfb->wakeups[NU_WAKE_WS]);
+				if (nurfb->ws_sock >= 0)
+					rfbLog("websocket: %llu viewers upgraded, %llu requests refused\n",
+						   nurfb->ws_upgrades, nurfb->ws_refused);
+				if (nurfb->relay_host)
+					rfbLog("relay: %s:%d %s, %llu connects\n", nurfb->relay_host,
+						   nurfb->relay_port, nurfb->relay_cl ? "up" :
+						   nurfb->relay_sock >= 0 ? "connecting" : "down",
+						   nurfb->relay_connects);
+				if (nurfb->verify_tolerance >= 0)
+					rfbLog("diff verify: dropped %llu rects, %llu KB raw suppressed\n",
+						   nurfb->suppressed_rects, nurfb->suppressed_bytes >> 10);
+				nurfb->fps_cnt = 0;
+			} else
+				nurfb->fps_cnt++;
+		}
+	}
+}
+
+static void rfbNuDrawPattern(struct nu_rfb *nurfb, rfbScreenInfoPtr screen)
+{
+	static const uint8_t bars[8][3] = {
+		{255, 255, 255}, {255, 255, 0}, {0, 255, 255}, {0, 255, 0},
+		{255, 0, 255}, {255, 0, 0}, {0, 0, 255}, {0, 0, 0},
+	};
+	rfbPixelFormat *f = &screen->serverFormat;
+	int bpp = f->bitsPerPixel / 8;
+	int bar_w = screen->width / 8 ? screen->width / 8 : 1;
+	int sweep = (nurfb->pattern_phase * 4) % screen->width;
+
+	for (int y = 0; y < screen->height; y++)
+	{
+		char *row = screen->frameBuffer + y * screen->paddedWidthInBytes;
+
+		for (int x = 0; x < screen->width; x++)
+		{
+			/* each pipeline starts the bars somewhere else */
+			const uint8_t *c = bars[(x / bar_w + nurfb->index) % 8];
+			uint32_t pixel;
+
+			if (x >= sweep && x < sweep + PATTERN_BAR_W)
+				c = bars[7 - (x / bar_w + nurfb->index) % 8];
+
+			pixel = (c[0] * f->redMax / 255) << f->redShift |
+					(c[1] * f->greenMax / 255) << f->greenShift |
+					(c[2] * f->blueMax / 255) << f->blueShift;
+			memcpy(row + x * bpp, &pixel, bpp);
+		}
+	}
+}
+
+static rfbBool
+rfbNuSendFakeFramebufferUpdate(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+	rfbBool result = TRUE;
+
+	fu->nRects = Swap16IfLE(1);
+	fu->type = rfbFramebufferUpdate;
+	cl->ublen = sz_rfbFramebufferUpdateMsg;
+
+	if (nurfb->pattern)
+	{
+		rfbNuDrawPattern(nurfb, cl->scaledScreen);
+		if (!rfbSendRectEncodingHextile(cl, 0, 0, cl->scaledScreen->width,
+										cl->scaledScreen->height))
+			goto updateFailed;
+		goto send;
+	}
+
+	memset(cl->scaledScreen->frameBuffer, 0, FAKE_FB_WIDTH * FAKE_FB_HEIGHT * FAKE_FB_BPP);
+
+	if (!rfbSendRectEncodingHextile(cl, 0, 0, FAKE_FB_WIDTH, FAKE_FB_HEIGHT))
+		goto updateFailed;
+
+send:
+
+	if (!rfbSendUpdateBuf(cl))
+	{
+	updateFailed:
+		result = FALSE;
+	}
+
+	return result;
+}
+
+/*
+ * The thread takes everything queued in one go and writes it while the
+ * main thread keeps appending to the other buffer. The client is held
+ * until the queue drains, libvncserver does not read from it and so
+ * writes no replies of its own in between; fences and EndOfCU go into
+ * the queue as well. Nobody else waits on the output mutex while the
+ * thread blocks in a write.
+ */
+static void *rfbNuSenderThread(void *arg)
+{
+	struct nu_sender *sender = (struct nu_sender *)arg;
+	rfbClientPtr cl = sender->cl;
+	struct nu_tx_stats tx;
+	struct iovec iov;
+	uint64_t one = 1;
+	char *buf;
+	size_t size;
+	rfbBool ok;
+
+	pthread_mutex_lock(&sender->lock);
+	while (!sender->quit)
+	{
+		if (!sender->len)
+		{
+			pthread_cond_wait(&sender->cond, &sender->lock);
+			continue;
+		}
+
+		buf = sender->out;
+		size = sender->out_size;
+		sender->out = sender->buf;
+		sender->out_size = sender->size;
+		sender->buf = buf;
+		sender->size = size;
+		iov.iov_base = sender->out;
+		iov.iov_len = sender->len;
+		sender->len = 0;
+		sender->writing = 1;
+		pthread_mutex_unlock(&sender->lock);
+
+		memset(&tx, 0, sizeof(tx));
+		LOCK(cl->outputMutex);
+		ok = cl->sock >= 0 && rfbNuWriteIov(cl, &iov, 1, 0, &tx);
+		UNLOCK(cl->outputMutex);
+
+		pthread_mutex_lock(&sender->lock);
+		rfbNuTxStatsAdd(&sender->tx, &tx);
+		sender->writing = 0;
+		if (!ok)
+			sender->failed = 1;
+		if ((!sender->len || !ok) &&
+			write(sender->wake_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			rfbErr("sender wakeup failed (%d)\n", errno);
+	}
+	pthread_mutex_unlock(&sender->lock);
+
+	return NULL;
+}
+
+static rfbBool rfbNuSenderStart(struct nu_sender *sender, rfbClientPtr cl)
+{
+	pthread_mutex_init(&sender->lock, NULL);
+	pthread_cond_init(&sender->cond, NULL);
+	sender->cl = cl;
+	sender->wake_fd = rfbNuRfb(cl)->sender_fd;
+	sender->len = 0;
+	sender->writing = 0;
+	sender->quit = 0;
+	sender->failed = 0;
+
+	if (pthread_create(&sender->thread, NULL, rfbNuSenderThread, sender))
+	{
+		rfbErr("create sender thread failed\n");
+		pthread_mutex_destroy(&sender->lock);
+		pthread_cond_destroy(&sender->cond);
+		return FALSE;
+	}
+
+	sender->running = 1;
+
+	return TRUE;
+}
+
+static void rfbNuSenderStop(struct nu_session *ss)
+{
+	struct nu_sender *sender = &ss->sender;
+
+	if (sender->running)
+	{
+		pthread_mutex_lock(&sender->lock);
+		sender->quit = 1;
+		pthread_cond_signal(&sender->cond);
+		pthread_mutex_unlock(&sender->lock);
+
+		pthread_join(sender->thread, NULL);
+		pthread_mutex_destroy(&sender->lock);
+		pthread_cond_destroy(&sender->cond);
+		rfbNuTxStatsAdd(&ss->nurfb->tx, &sender->tx);
+	}
+
+	free(sender->buf);
+	free(sender->frame);
+	free(sender->out);
+	memset(sender, 0, sizeof(struct nu_sender));
+}
+
+/* the thread ends once both of its sockets are shut down */
+static void rfbNuWsStop(struct nu_session *ss)
+{
+	struct nu_ws *ws = ss->ws;
+
+	if (!ws)
+		return;
+
+	shutdown(ws->pair, SHUT_RDWR);
+	shutdown(ws->fd, SHUT_RDWR);
+	if (ws->running)
+	{
+		pthread_join(ws->thread, NULL);
+		rfbNuTxStatsAdd(&ss->nurfb->tx, &ws->tx);
+	}
+
+	close(ws->pair);
+	close(ws->fd);
+	pthread_mutex_destroy(&ws->lock);
+	free(ws);
+	ss->ws = NULL;
+}
+
+void rfbNuSetTier(struct nu_session *ss, unsigned char tier)
+{
+	struct nu_rfb *nurfb = ss->nurfb;
+	unsigned int fps = nurfb->max_fps;
+	int prio = OPERATOR_SO_PRIORITY;
+
+	if (tier == NU_TIER_VIEWER)
+	{
+		if (!fps || (nurfb->viewer_fps && nurfb->viewer_fps < fps))
+			fps = nurfb->viewer_fps;
+		prio = VIEWER_SO_PRIORITY;
+	}
+
+	ss->tier = tier;
+	rfbNuSetClientFps(ss, fps);
+
+	/* only matters for TCP, local sockets ignore it */
+	if (ss->ws)
+		setsockopt(ss->ws->fd, SOL_SOCKET, SO_PRIORITY, &prio, sizeof(prio));
+	else if (ss->cl->sock >= 0)
+		setsockopt(ss->cl->sock, SOL_SOCKET, SO_PRIORITY, &prio, sizeof(prio));
+
+	rfbLog("client %u: %s\n", ss->id, tier == NU_TIER_VIEWER ? "viewer" : "operator");
+}
+
+static rfbBool rfbNuHasOperator(struct nu_rfb *nurfb)
+{
+	for (struct nu_session *ss = nurfb->sessions; ss; ss = ss->next)
+		if (ss->tier == NU_TIER_OPERATOR)
+			return TRUE;
+
+	return FALSE;
+}
+
+struct nu_session *rfbNuSessionCreate(struct nu_rfb *nurfb, rfbClientPtr cl)
+{
+	struct nu_session *ss;
+	unsigned char tier = NU_TIER_OPERATOR;
+
+	ss = calloc(1, sizeof(struct nu_session));
+	if (!ss)
+	{
+		rfbErr("no memory for client session\n");
+		return NULL;
+	}
+
+	ss->nurfb = nurfb;
+	ss->cl = cl;
+	ss->id = nurfb->next_session_id++;
+	ss->zc_sock = -1;
+	ss->last_scaled = cl->scaledScreen;
+	ss->key_pending = 1;
+	ss->roll_div = nurfb->rolling;
+	ss->ws = nurfb->ws_new;
+	nurfb->ws_new = NULL;
+	rfbNuBucketInit(&ss->client_rate, nurfb->client_kbps);
+
+	/* with -o whoever comes after the operator watches */
+	if (nurfb->single_operator && rfbNuHasOperator(nurfb))
+		tier = NU_TIER_VIEWER;
+	rfbNuSetTier(ss, tier);
+
+	ss->next = nurfb->sessions;
+	nurfb->sessions = ss;
+	cl->clientData = ss;
+
+	return ss;
+}
+
+void rfbNuSessionDestroy(struct nu_session *ss)
+{
+	struct nu_session **pp, *p, *next = NULL;
+
+	if (!ss)
+		return;
+
+	rfbNuSenderStop(ss);
+	rfbNuWsStop(ss);
+
+	if (ss->refine_rgn)
+		sraRgnDestroy(ss->refine_rgn);
+	if (ss->pending_rgn)
+		sraRgnDestroy(ss->pending_rgn);
+
+	for (pp = &ss->nurfb->sessions; *pp; pp = &(*pp)->next)
+	{
+		if (*pp == ss)
+		{
+			*pp = ss->next;
+			break;
+		}
+	}
+
+	/* hand the console to the longest waiting viewer, sessions are kept
+	 * newest first; view-only passwords stay viewers */
+	if (ss->nurfb->single_operator && ss->tier == NU_TIER_OPERATOR &&
+		!rfbNuHasOperator(ss->nurfb))
+	{
+		for (p = ss->nurfb->sessions; p; p = p->next)
+			if (!p->cl->viewOnly)
+				next = p;
+		if (next)
+			rfbNuSetTier(next, NU_TIER_OPERATOR);
+	}
+
+	/* the gateway went away, dial it again a little later */
+	if (ss->cl == ss->nurfb->relay_cl)
+	{
+		rfbLog("relay to %s:%d lost\n", ss->nurfb->relay_host, ss->nurfb->relay_port);
+		ss->nurfb->relay_cl = NULL;
+		rfbNuArmTimer(ss->nurfb->relay_fd, RELAY_RETRY_MS * 1000000ULL);
+	}
+
+	ss->cl->clientData = NULL;
+	free(ss);
+}
+
+static rfbBool rfbNuSenderBusy(struct nu_sender *sender)
+{
+	int busy;
+
+	if (!sender->running)
+		return FALSE;
+
+	pthread_mutex_lock(&sender->lock);
+	busy = sender->len || sender->writing;
+	pthread_mutex_unlock(&sender->lock);
+
+	return busy;
+}
+
+static rfbBool rfbNuBufAppend(char **buf, size_t *len, size_t *size,
+							  const void *data, size_t n)
+{
+	if (*len + n > *size)
+	{
+		size_t grow = *size ? *size : 0x10000;
+		char *p;
+
+		while (grow < *len + n)
+			grow <<= 1;
+
+		p = realloc(*buf, grow);
+		if (!p)
+			return FALSE;
+
+		*buf = p;
+		*size = grow;
+	}
+
+	memcpy(*buf + *len, data, n);
+	*len += n;
+
+	return TRUE;
+}
+
+/* add to the frame being encoded */
+static rfbBool rfbNuSenderAppend(struct nu_sender *sender, const void *data, size_t len)
+{
+	return rfbNuBufAppend(&sender->frame, &sender->frame_len, &sender->frame_size,
+						  data, len);
+}
+
+/*
+ * Hold the client while the thread has something of it: libvncserver
+ * skips held clients, and the reactor stops watching the socket so
+ * pending input does not wake it for nothing.
+ */
+static void rfbNuSenderHold(rfbClientPtr cl)
+{
+	if (cl->onHold)
+		return;
+
+	cl->onHold = TRUE;
+	rfbNuUnwatchClient(cl);
+}
+
+/* queue a message behind what the thread has not written yet */
+static rfbBool rfbNuSenderQueue(rfbClientPtr cl, const char *data, size_t len)
+{
+	struct nu_sender *sender = &rfbNuSession(cl)->sender;
+	rfbBool ok;
+
+	pthread_mutex_lock(&sender->lock);
+	ok = rfbNuBufAppend(&sender->buf, &sender->len, &sender->size, data, len);
+	pthread_cond_signal(&sender->cond);
+	pthread_mutex_unlock(&sender->lock);
+
+	if (ok)
+		rfbNuSenderHold(cl);
+
+	return ok;
+}
+
+/* hand the encoded frame over, swapped in when nothing else is queued */
+static rfbBool rfbNuSenderQueueFrame(rfbClientPtr cl)
+{
+	struct nu_sender *sender = &rfbNuSession(cl)->sender;
+	rfbBool ok = TRUE;
+
+	pthread_mutex_lock(&sender->lock);
+	if (!sender->len)
+	{
+		char *buf = sender->buf;
+		size_t size = sender->size;
+
+		sender->buf = sender->frame;
+		sender->size = sender->frame_size;
+		sender->len = sender->frame_len;
+		sender->frame = buf;
+		sender->frame_size = size;
+	}
+	else
+		ok = rfbNuBufAppend(&sender->buf, &sender->len, &sender->size,
+							sender->frame, sender->frame_len);
+	pthread_cond_signal(&sender->cond);
+	pthread_mutex_unlock(&sender->lock);
+
+	sender->frame_len = 0;
+	if (ok)
+		rfbNuSenderHold(cl);
+
+	return ok;
+}
+
+/* the queue of a sender drained, let libvncserver have its clients back */
+static void rfbNuSenderWake(rfbScreenInfoPtr screen, struct nu_rfb *nurfb)
+{
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+	uint64_t cnt;
+
+	if (read(nurfb->sender_fd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+		rfbErr("sender wakeup read failed (%d)\n", errno);
+
+	it = rfbGetClientIterator(screen);
+	while ((cl = rfbClientIteratorNext(it)))
+	{
+		struct nu_session *ss = rfbNuSession(cl);
+
+		if (!ss || !cl->onHold || !ss->sender.running)
+			continue;
+
+		if (ss->sender.failed)
+		{
+			rfbCloseClient(cl);
+			continue;
+		}
+
+		if (rfbNuSenderBusy(&ss->sender))
+			continue;
+
+		cl->onHold = FALSE;
+		rfbNuWatchClient(cl);
+	}
+	rfbReleaseClientIterator(it);
+}
+
+/* add the rects of the current frame to a client's pending region */
+static void rfbNuMergeFrame(rfbClientPtr cl, sraRegionPtr rgn)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	sraRegionPtr r;
+
+	if (!nurfb->do_cmd && ss->refreshCount > 0)
+	{
+		r = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+		sraRgnOr(rgn, r);
+		sraRgnDestroy(r);
+		return;
+	}
+
+	for (unsigned int i = 0; i < nurfb->rect_cnt; i++)
+	{
+		struct rect *t = &nurfb->rect_table[i];
+
+		r = sraRgnCreateRect(t->x, t->y, t->x + t->w, t->y + t->h);
+		sraRgnOr(rgn, r);
+		sraRgnDestroy(r);
+	}
+}
+
+/*
+ * A client out of sync with the screen is repaired through its pending
+ * region like any other damage. Only when nothing has been captured since
+ * the hardware came up or changed mode does it need the REFRESHCNT full
+ * captures.
+ */
+static void rfbNuDamageAll(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	sraRegionPtr r;
+
+	if (!nurfb->fb_valid)
+	{
+		ss->refreshCount = rfbNuRefreshCnt(nurfb);
+		return;
+	}
+
+	if (!ss->pending_rgn)
+		ss->pending_rgn = sraRgnCreate();
+	r = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+	sraRgnOr(ss->pending_rgn, r);
+	sraRgnDestroy(r);
+}
+
+/*
+ * Add the next band of the rolling refresh to the client's damage. Bands
+ * ride along with updates that go out anyway, a static screen gets one
+ * every ROLL_IDLE_MS so a diff the VCD missed does not stay forever.
+ */
+static void rfbNuRollSlice(rfbClientPtr cl, int ret)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	sraRegionPtr pending = ss->pending_rgn;
+	unsigned long long now;
+	unsigned int div, band, h = cl->screen->height;
+	sraRegionPtr r;
+
+	if (!nurfb->rolling || !nurfb->fb_valid || nurfb->fake_fb ||
+		ss->refreshCount > 0)
+		return;
+
+	now = rfbNuNowNs();
+	if (ret <= 0 && sraRgnEmpty(pending) &&
+		now < ss->roll_last_ns + ROLL_IDLE_MS * 1000000ULL)
+		return;
+
+	div = ss->roll_div;
+	if (div < nurfb->rolling)
+		div = nurfb->rolling;
+
+	/* whole tile rows */
+	band = ((h + div - 1) / div + 15) & ~15;
+	if (ss->roll_y >= h)
+		ss->roll_y = 0;
+
+	r = sraRgnCreateRect(0, ss->roll_y, cl->screen->width,
+						 ss->roll_y + band < h ? ss->roll_y + band : h);
+	sraRgnOr(pending, r);
+	sraRgnDestroy(r);
+
+	ss->roll_y += band;
+	ss->roll_last_ns = now;
+	nurfb->roll_slices++;
+
+	/* grow the band back once the client keeps up again */
+	if (div > nurfb->rolling)
+		div--;
+	ss->roll_div = div;
+}
+
+/* the client is congested, halve its band */
+static void rfbNuRollBackoff(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+
+	if (!nurfb->rolling)
+		return;
+
+	if (ss->roll_div < nurfb->rolling)
+		ss->roll_div = nurfb->rolling;
+	ss->roll_div *= 2;
+	if (ss->roll_div > ROLL_DIV_MAX)
+		ss->roll_div = ROLL_DIV_MAX;
+}
+
+/* the area the client currently asks for, in framebuffer coordinates */
+static sraRegionPtr rfbNuRequestRegion(rfbClientPtr cl)
+{
+	struct nu_cu *cu = &rfbNuSession(cl)->cu;
+	sraRegionPtr req;
+
+	/* requests of scaled clients are in scaled coordinates */
+	if (cl->scaledScreen != cl->screen)
+		return sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+
+	if (cu->enabled)
+		return sraRgnCreateRect(cu->x, cu->y, cu->x + cu->w, cu->y + cu->h);
+
+	LOCK(cl->updateMutex);
+	req = sraRgnCreateRgn(cl->requestedRegion);
+	UNLOCK(cl->updateMutex);
+
+	return req;
+}
+
+static rfbBool rfbNuRequestPending(rfbClientPtr cl)
+{
+	rfbBool pending;
+
+	if (rfbNuSession(cl)->cu.enabled)
+		return TRUE;
+
+	LOCK(cl->updateMutex);
+	pending = !sraRgnEmpty(cl->requestedRegion);
+	UNLOCK(cl->updateMutex);
+
+	return pending;
+}
+
+/*
+ * TRUE when the diff table can be sent as is: nothing is pending, no
+ * non-incremental request is outstanding and the whole screen is asked for.
+ */
+static rfbBool rfbNuWholeRequest(rfbClientPtr cl)
+{
+	sraRegionPtr rest, req;
+	rfbBool whole;
+
+	if (!sraRgnEmpty(rfbNuSession(cl)->pending_rgn))
+		return FALSE;
+
+	LOCK(cl->updateMutex);
+	whole = sraRgnEmpty(cl->modifiedRegion);
+	UNLOCK(cl->updateMutex);
+	if (!whole)
+		return FALSE;
+
+	rest = sraRgnCreateRect(0, 0, cl->screen->width, cl->screen->height);
+	req = rfbNuRequestRegion(cl);
+	sraRgnSubtract(rest, req);
+	whole = sraRgnEmpty(rest);
+	sraRgnDestroy(req);
+	sraRgnDestroy(rest);
+
+	return whole;
+}
+
+/*
+ * Split off the part of the pending region the client asked for, the rest
+ * stays pending until it is requested. Areas of non-incremental requests
+ * are sent in full.
+ */
+static sraRegionPtr rfbNuTakeRequested(rfbClientPtr cl)
+{
+	sraRegionPtr pending = rfbNuSession(cl)->pending_rgn;
+	sraRegionPtr req = rfbNuRequestRegion(cl);
+	sraRegionPtr send;
+
+	LOCK(cl->updateMutex);
+	if (!sraRgnEmpty(cl->modifiedRegion))
+	{
+		sraRgnOr(pending, cl->scaledScreen != cl->screen ? req : cl->modifiedRegion);
+		sraRgnMakeEmpty(cl->modifiedRegion);
+	}
+	UNLOCK(cl->updateMutex);
+
+	send = sraRgnCreateRgn(pending);
+	sraRgnAnd(send, req);
+	sraRgnSubtract(pending, req);
+	sraRgnDestroy(req);
+
+	return send;
+}
+
+/*
+ * Encode everything pending for the client into its frame buffer and
+ * hand it to the sender thread.
+ */
+static rfbBool rfbNuQueueFramebufferUpdate(rfbClientPtr cl)
+{
+	struct nu_session *ss = rfbNuSession(cl);
+	struct nu_sender *sender = &ss->sender;
+	sraRegionPtr send = rfbNuTakeRequested(cl);
+	rfbFramebufferUpdateMsg fu;
+	rfbFramebufferUpdateRectHeader hdr;
+	sraRectangleIterator *iter;
+	sraRect r;
+	unsigned long n;
+
+	n = sraRgnCountRects(send);
+	if (!n)
+		goto failed;
+
+	if (n > MAX_QUEUED_RECTS)
+	{
+		sraRgnDestroy(send);
+		send = rfbNuRequestRegion(cl);
+		n = sraRgnCountRects(send);
+	}
+
+	if (!sender->running && !rfbNuSenderStart(sender, cl))
+		goto failed;
+
+	sender->frame_len = 0;
+	fu.type = rfbFramebufferUpdate;
+	fu.pad = 0;
+	fu.nRects = Swap16IfLE(n);
+	if (!rfbNuSenderAppend(sender, &fu, sz_rfbFramebufferUpdateMsg))
+		goto failed;
+
+	iter = sraRgnGetIterator(send);
+	while (sraRgnIteratorNext(iter, &r))
+	{
+		char *data;
+		uint32_t len;
+		rfbBool mapped;
+
+		if (!rfbNuEncodeHextile16HW(cl, r.x1, r.y1, r.x2 - r.x1, r.y2 - r.y1,
+									&data, &len, &mapped))
+		{
+			sraRgnReleaseIterator(iter);
+			goto failed;
+		}
+
+		hdr.r.x = Swap16IfLE(r.x1);
+		hdr.r.y = Swap16IfLE(r.y1);
+		hdr.r.w = Swap16IfLE(r.x2 - r.x1);
+		hdr.r.h = Swap16IfLE(r.y2 - r.y1);
+		hdr.encoding = Swap32IfLE(rfbEncodingHextile);
+		if (!rfbNuSenderAppend(sender, &hdr, sz_rfbFramebufferUpdateRectHeader) ||
+			!rfbNuSenderAppend(sender, data, len))
+		{
+			sraRgnReleaseIterator(iter);
+			goto failed;
+		}
+		rfbStatRecordEncodingSent(cl, rfbEncodingHextile,
+								  sz_rfbFramebufferUpdateRectHeader + len,
+								  sz_rfbFramebufferUpdateRectHeader +
+									  (r.x2 - r.x1) * (r.y2 - r.y1) * 2);
+		rfbNuShadowSent(rfbNuRfb(cl), r.x1, r.y1, r.x2 - r.x1, r.y2 - r.y1);
+	}
+	sraRgnReleaseIterator(iter);
+
+	if (!rfbNuSenderQueueFrame(cl))
+		goto failed;
+	sraRgnDestroy(send);
+
+	return TRUE;
+
+failed:
+	/* whatever was not queued stays pending */
+	sraRgnOr(ss->pending_rgn, send);
+	sraRgnDestroy(send);
+
+	return FALSE;
+}
+
+/*
+ * Check how much the kernel still holds for the client. Anything beyond
+ * what the connection can deliver within the latency budget only adds
+ * delay, so the update is held back and merged into the next one.
+ */
+static rfbBool rfbNuClientBacklogged(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct tcp_info ti;
+	socklen_t len = sizeof(ti);
+	unsigned long long budget = BACKLOG_MIN_BYTES;
+	int outq = 0;
+	/* the queue that matters is towards the viewer, not the socketpair */
+	int fd = rfbNuSession(cl)->ws ? rfbNuSession(cl)->ws->fd : cl->sock;
+
+	if (!nurfb->latency_budget || cl->sock < 0)
+		return FALSE;
+
+	if (ioctl(fd, SIOCOUTQ, &outq) < 0 || outq <= BACKLOG_MIN_BYTES)
+		return FALSE;
+
+	if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &ti, &len) == 0 && ti.tcpi_rtt)
+	{
+		/* bytes per second the congestion window allows */
+		unsigned long long rate = (unsigned long long)ti.tcpi_snd_cwnd *
+								  ti.tcpi_snd_mss * 1000000ULL / ti.tcpi_rtt;
+
+		if (rate * nurfb->latency_budget / 1000 > budget)
+			budget = rate * nurfb->latency_budget / 1000;
+	}
+
+	return (unsigned long long)outq > budget;
+}
+
+/*
+ * Buckets may go into debt, a frame is sent as long as tokens are left
+ * and the following frames are skipped until the debt is paid off.
+ */
+static rfbBool rfbNuRateLimited(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	struct nu_bucket *b = &ss->client_rate;
+	struct timespec now;
+
+	if (!b->rate && !nurfb->total_rate.rate)
+		return FALSE;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rfbNuBucketRefill(b, &now);
+	rfbNuBucketRefill(&nurfb->total_rate, &now);
+
+	if ((b->rate && b->tokens <= 0) ||
+		(nurfb->total_rate.rate && nurfb->total_rate.tokens <= 0))
+	{
+		if (++ss->rate_skips >= RATE_LOSSY_SKIPS)
+			ss->rate_lossy = 1;
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void rfbNuRateCharge(rfbClientPtr cl, unsigned int bytes)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	struct nu_bucket *b = &ss->client_rate;
+
+	if (b->rate)
+		b->tokens -= bytes;
+	if (nurfb->total_rate.rate)
+		nurfb->total_rate.tokens -= bytes;
+
+	/* back to full quality once the link keeps up again */
+	if (bytes && (!b->rate || b->tokens > b->burst / 2) &&
+		(!nurfb->total_rate.rate || nurfb->total_rate.tokens > nurfb->total_rate.burst / 2))
+	{
+		ss->rate_skips = 0;
+		ss->rate_lossy = 0;
+	}
+}
+
+static rfbBool rfbNuWriteMsg(rfbClientPtr cl, const char *buf, int len)
+{
+	struct nu_session *ss = rfbNuSession(cl);
+
+	/* nothing may overtake a frame the sender thread still has */
+	if (ss && rfbNuSenderBusy(&ss->sender))
+	{
+		if (rfbNuSenderQueue(cl, buf, len))
+			return TRUE;
+		rfbErr("rfbNuWriteMsg: queue\n");
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+
+	/* takes the output mutex itself */
+	if (rfbWriteExact(cl, buf, len) < 0)
+	{
+		rfbErr("rfbNuWriteMsg: write\n");
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static rfbBool rfbNuReadMsg(rfbClientPtr cl, char *buf, int len)
+{
+	int n = rfbReadExact(cl, buf, len);
+
+	if (n <= 0)
+	{
+		if (n < 0)
+			rfbErr("rfbNuReadMsg: read\n");
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static rfbBool rfbNuSendEndOfCU(rfbClientPtr cl)
+{
+	char type = rfbNuContinuousUpdates;
+
+	return rfbNuWriteMsg(cl, &type, 1);
+}
+
+static rfbBool rfbNuSendFence(rfbClientPtr cl, uint32_t flags, const char *payload, uint8_t len)
+{
+	char buf[9 + rfbNuFenceMaxLen];
+
+	memset(buf, 0, 4);
+	buf[0] = (char)rfbNuFence;
+	flags = Swap32IfLE(flags);
+	memcpy(buf + 4, &flags, 4);
+	buf[8] = len;
+	if (len)
+		memcpy(buf + 9, payload, len);
+
+	return rfbNuWriteMsg(cl, buf, 9 + len);
+}
+
+/* the CU and fence state itself is in rfbcu.c */
+static rfbBool rfbNuFenceWait(rfbClientPtr cl)
+{
+	return rfbNuCuFenceWait(&rfbNuSession(cl)->cu);
+}
+
+static void rfbNuFrameSent(rfbClientPtr cl)
+{
+	struct nu_cu *cu = &rfbNuSession(cl)->cu;
+	struct timespec now;
+	uint32_t seq;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (rfbNuCuFenceDue(cu, &now, &seq) &&
+		rfbNuSendFence(cl, rfbNuFenceRequest | rfbNuFenceBlockBefore, (char *)&seq, sizeof(seq)))
+		cu->inflight++;
+}
+
+static rfbBool rfbNuHandleEnableCU(rfbClientPtr cl)
+{
+	unsigned char buf[sz_rfbNuEnableCU];
+
+	if (!rfbNuReadMsg(cl, (char *)buf, sizeof(buf)))
+		return TRUE;
+
+	if (rfbNuCuEnable(&rfbNuSession(cl)->cu, buf))
+		rfbNuSendEndOfCU(cl);
+
+	return TRUE;
+}
+
+static rfbBool rfbNuHandleFence(rfbClientPtr cl)
+{
+	unsigned char buf[sz_rfbNuFence];
+	char payload[rfbNuFenceMaxLen];
+	struct timespec now;
+	uint32_t flags;
+	uint8_t len;
+
+	if (!rfbNuReadMsg(cl, (char *)buf, sizeof(buf)))
+		return TRUE;
+
+	rfbNuCuParseFence(buf, &flags, &len);
+	if (len > rfbNuFenceMaxLen)
+	{
+		rfbErr("fence payload too long (%d)\n", len);
+		rfbCloseClient(cl);
+		return TRUE;
+	}
+
+	if (len && !rfbNuReadMsg(cl, payload, len))
+		return TRUE;
+
+	/* updates are written in order, blocking is always satisfied */
+	if (flags & rfbNuFenceRequest)
+	{
+		rfbNuSendFence(cl, flags & (rfbNuFenceBlockBefore | rfbNuFenceBlockAfter), payload, len);
+		return TRUE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	rfbNuCuFenceAnswered(&rfbNuSession(cl)->cu, payload, len, &now);
+
+	return TRUE;
+}
+
+static rfbBool rfbNuExtNewClient(rfbClientPtr cl, void **data)
+{
+	*data = NULL;
+
+	return TRUE;
+}
+
+static rfbBool rfbNuExtEnablePseudoEncoding(rfbClientPtr cl, void **data, int encoding)
+{
+	struct nu_cu *cu = &rfbNuSession(cl)->cu;
+
+	switch (encoding)
+	{
+	case rfbNuEncodingContinuousUpdates:
+		/* an EndOfContinuousUpdates tells the client it is supported */
+		if (!cu->supported)
+		{
+			cu->supported = 1;
+			rfbNuSendEndOfCU(cl);
+		}
+		return TRUE;
+	case rfbNuEncodingFence:
+		if (!cu->fence)
+		{
+			cu->fence = 1;
+			rfbNuSendFence(cl, rfbNuFenceRequest, NULL, 0);
+		}
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static rfbBool rfbNuExtHandleMessage(rfbClientPtr cl, void *data, const rfbClientToServerMsg *msg)
+{
+	switch (msg->type)
+	{
+	case rfbNuContinuousUpdates:
+		return rfbNuHandleEnableCU(cl);
+	case rfbNuFence:
+		return rfbNuHandleFence(cl);
+	}
+
+	return FALSE;
+}
+
+static int rfbNuExtEncodings[] = {rfbNuEncodingFence, rfbNuEncodingContinuousUpdates, 0};
+
+static rfbProtocolExtension rfbNuExtension = {
+	.newClient = rfbNuExtNewClient,
+	.pseudoEncodings = rfbNuExtEncodings,
+	.enablePseudoEncoding = rfbNuExtEnablePseudoEncoding,
+	.handleMessage = rfbNuExtHandleMessage,
+};
+
+void rfbNuRegisterExtensions(void)
+{
+	rfbRegisterProtocolExtension(&rfbNuExtension);
+}
+
+/*
+ * Turn the requested part of the client's pending region, merged with the
+ * current frame, into the rect list for this update.
+ */
+static int rfbNuTakePending(rfbClientPtr cl, int ret, struct rect **rects)
+{
+	sraRegionPtr pending = rfbNuSession(cl)->pending_rgn;
+	sraRegionPtr send;
+	sraRectangleIterator *iter;
+	sraRect r;
+	int n = 0;
+
+	if (ret > 0)
+		rfbNuMergeFrame(cl, pending);
+
+	send = rfbNuTakeRequested(cl);
+
+	*rects = malloc(sizeof(struct rect) * (sraRgnCountRects(send) + 1));
+	if (!*rects)
+	{
+		sraRgnOr(pending, send);
+		sraRgnDestroy(send);
+		return -1;
+	}
+
+	iter = sraRgnGetIterator(send);
+	while (sraRgnIteratorNext(iter, &r))
+	{
+		(*rects)[n].x = r.x1;
+		(*rects)[n].y = r.y1;
+		(*rects)[n].w = r.x2 - r.x1;
+		(*rects)[n].h = r.y2 - r.y1;
+		n++;
+	}
+	sraRgnReleaseIterator(iter);
+	sraRgnDestroy(send);
+
+	return n;
+}
+
+/*
+ * Update path for clients with their own sender thread. While the
+ * previous frame is still being written, new diffs are merged into the
+ * pending region instead of queueing more frames, so a slow client
+ * never holds up the capture loop or the other viewers.
+ */
+static rfbBool
+rfbNuSendFramebufferUpdateAsync(rfbClientPtr cl, int ret)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	struct nu_sender *sender = &ss->sender;
+	rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+
+	if (sender->failed)
+	{
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+
+	if (ret > 0 && !nurfb->fake_fb)
+		rfbNuMergeFrame(cl, ss->pending_rgn);
+
+	if (rfbNuSenderBusy(sender))
+	{
+		nurfb->frames_merged++;
+		return FALSE;
+	}
+
+	if (cl->useNewFBSize == TRUE
+		&& cl->newFBSizePending == TRUE)
+	{
+		LOCK(cl->updateMutex);
+		cl->newFBSizePending = FALSE;
+		UNLOCK(cl->updateMutex);
+		sraRgnMakeEmpty(ss->pending_rgn);
+		fu->type = rfbFramebufferUpdate;
+		fu->nRects = Swap16IfLE(1);
+		cl->ublen = sz_rfbFramebufferUpdateMsg;
+
+		if (!rfbSendNewFBSize(cl, cl->scaledScreen->width, cl->scaledScreen->height))
+			return FALSE;
+		return rfbSendUpdateBuf(cl);
+	}
+
+	if (nurfb->fake_fb)
+		return rfbNuSendFakeFramebufferUpdate(cl);
+
+	if (cl->enableCursorShapeUpdates && cl->cursorWasChanged &&
+		cl->readyForSetColourMapEntries)
+	{
+		fu->type = rfbFramebufferUpdate;
+		fu->nRects = Swap16IfLE(1);
+		cl->ublen = sz_rfbFramebufferUpdateMsg;
+		cl->cursorWasChanged = FALSE;
+		if (!rfbSendCursorShape(cl) || !rfbSendUpdateBuf(cl))
+			return FALSE;
+	}
+
+	return rfbNuQueueFramebufferUpdate(cl);
+}
+
+static rfbBool
+rfbNuSendFramebufferUpdate(rfbClientPtr cl)
+{
+	rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
+	rfbBool result = TRUE;
+	int ret = 0;
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+	struct nu_session *ss = rfbNuSession(cl);
+	struct rect refine[PROGRESSIVE_REFINE_RECTS];
+	struct rect *rects = NULL;
+	int refine_cnt = 0;
+
+	if (nurfb->default_scale > 1 && !ss->scale_init && cl->useNewFBSize)
+	{
+		rfbNuScaleClient(cl, cl->screen->width / nurfb->default_scale,
+						cl->screen->height / nurfb->default_scale);
+		ss->scale_init = 1;
+	}
+
+	/* a new scaled framebuffer starts out stale, send it whole */
+	if (cl->scaledScreen != ss->last_scaled)
+	{
+		ss->last_scaled = cl->scaledScreen;
+		rfbNuDamageAll(cl);
+	}
+
+	if (ss->key_pending)
+	{
+		ss->key_pending = 0;
+		if (rfbNuSendKeyframe(cl))
+			return TRUE;
+		rfbNuDamageAll(cl);
+		nurfb->key_missed++;
+	}
+
+	ret = rfbNuGetUpdate(cl);
+
+	if (!ss->pending_rgn)
+		ss->pending_rgn = sraRgnCreate();
+
+	if (rfbNuClientBacklogged(cl))
+	{
+		if (ret > 0 && !nurfb->fake_fb)
+			rfbNuMergeFrame(cl, ss->pending_rgn);
+		nurfb->updates_deferred++;
+		rfbNuRollBackoff(cl);
+		return FALSE;
+	}
+
+	if (rfbNuFenceWait(cl))
+	{
+		if (ret > 0 && !nurfb->fake_fb)
+			rfbNuMergeFrame(cl, ss->pending_rgn);
+		nurfb->cu_held++;
+		return FALSE;
+	}
+
+	/* over the rate cap, drop frames first */
+	if (rfbNuRateLimited(cl))
+	{
+		if (ret > 0 && !nurfb->fake_fb)
+			rfbNuMergeFrame(cl, ss->pending_rgn);
+		nurfb->rate_skipped++;
+		rfbNuRollBackoff(cl);
+		return FALSE;
+	}
+
+	rfbNuRollSlice(cl, ret);
+
+	/*
+	 * Direct writes, like the software fallback of a pinned ECE, only once
+	 * the sender has nothing queued
+	 */
+	if ((nurfb->async_send && rfbNuUseHW(cl) && rfbNuCanSendIov(cl) &&
+		 !nurfb->ece_pinned) || rfbNuSenderBusy(&ss->sender))
+		return rfbNuSendFramebufferUpdateAsync(cl, ret);
+
+	if (cl->useNewFBSize == TRUE
+		&& cl->newFBSizePending == TRUE)
+	{
+		LOCK(cl->updateMutex);
+		cl->newFBSizePending = FALSE;
+		UNLOCK(cl->updateMutex);
+		fu->type = rfbFramebufferUpdate;
+		fu->nRects = Swap16IfLE(1);
+		cl->ublen = sz_rfbFramebufferUpdateMsg;
+
+		if (!rfbSendNewFBSize(cl, cl->scaledScreen->width, cl->scaledScreen->height))
+			return FALSE;
+		return rfbSendUpdateBuf(cl);
+	}
+
+
+	if (nurfb->fake_fb) {
+		rfbNuSendFakeFramebufferUpdate(cl);
+		return result;
+	}
+
+	if (ret < 0)
+		return FALSE;
+
+	nurfb->nRects = ret ? nurfb->rect_cnt : 0;
+	if (!nurfb->do_cmd && ss->refreshCount > 0)
+		nurfb->nRects = 1;
+
+	/*
+	 * Updates held back earlier go out together with this frame, clipped
+	 * to what the client asked for.
+	 */
+	if (!rfbNuWholeRequest(cl))
+	{
+		nurfb->nRects = rfbNuTakePending(cl, ret, &rects);
+		if (nurfb->nRects < 0)
+			return FALSE;
+	}
+
+	if ((nurfb->progressive || ss->refine_rgn) && rfbNuUseHW(cl) &&
+		!ss->rate_lossy)
+	{
+		rfbNuRefineAge(cl, rects);
+		refine_cnt = rfbNuGetRefineRects(cl, refine, PROGRESSIVE_REFINE_RECTS);
+	}
+
+	if (nurfb->nRects + refine_cnt == 0)
+	{
+		free(rects);
+		return FALSE;
+	}
+
+	fu->nRects = Swap16IfLE(nurfb->nRects + refine_cnt);
+	fu->type = rfbFramebufferUpdate;
+	if (cl->enableCursorShapeUpdates) {
+		if (cl->cursorWasChanged && cl->readyForSetColourMapEntries) {
+			cl->ublen = sz_rfbFramebufferUpdateMsg;
+			cl->cursorWasChanged = FALSE;
+			if (!rfbSendCursorShape(cl))
+				goto updateFailed;
+		}
+	}
+
+	cl->ublen = sz_rfbFramebufferUpdateMsg;
+
+	if (cl->enableLastRectEncoding)
+		fu->nRects = 0xFFFF;
+
+	for (int i = 0; i < nurfb->nRects; i++)
+	{
+		struct rect rect;
+
+		if (rects)
+			rect = rects[i];
+		else if (rfbNuGetDiffTable(cl, &rect, i) < 0)
+			break;
+
+		if (rfbNuUseHW(cl))
+		{
+			/* ... and then the cheaper colour reduced encoding */
+			if (ss->rate_lossy ||
+				(nurfb->progressive && !ss->refreshCount &&
+				 rfbNuIsLossyRect(nurfb, &rect)))
+			{
+				if (!rfbNuSendRectLossy(cl, rect.x, rect.y, rect.w, rect.h))
+					goto updateFailed;
+				rfbNuRefineTrack(cl, &rect, TRUE);
+				if (ss->rate_lossy)
+					nurfb->rate_lossy_rects++;
+				continue;
+			}
+
+			if (!rfbNuSendRectEncodingHextile(cl, rect.x, rect.y, rect.w, rect.h))
+				goto updateFailed;
+			rfbNuShadowSent(nurfb, rect.x, rect.y, rect.w, rect.h);
+			if (nurfb->progressive)
+				rfbNuRefineTrack(cl, &rect, FALSE);
+		}
+		else if (cl->scaledScreen != cl->screen)
+		{
+			if (!rfbNuSendRectScaled(cl, &rect))
+				goto updateFailed;
+			rfbNuShadowSent(nurfb, rect.x, rect.y, rect.w, rect.h);
+		}
+		else
+		{
+			/* only the rects being sent are converted, not the whole frame */
+			rfbNuCopyRect(nurfb, cl->screen, rect.x, rect.y, rect.w, rect.h);
+			if (!rfbSendRectEncodingHextile(cl, rect.x, rect.y, rect.w, rect.h))
+				goto updateFailed;
+			rfbNuShadowSent(nurfb, rect.x, rect.y, rect.w, rect.h);
+		}
+	}
+
+	for (int i = 0; i < refine_cnt; i++)
+	{
+		if (!rfbNuSendRectEncodingHextile(cl, refine[i].x, refine[i].y, refine[i].w, refine[i].h))
+			goto updateFailed;
+		rfbNuShadowSent(nurfb, refine[i].x, refine[i].y, refine[i].w, refine[i].h);
+		rfbNuRefineTrack(cl, &refine[i], FALSE);
+	}
+
+	if (cl->enableLastRectEncoding)
+		rfbSendLastRectMarker(cl);
+
+	if (!rfbSendUpdateBuf(cl))
+	{
+	updateFailed:
+		result = FALSE;
+	}
+
+	free(rects);
+
+	return result;
+}
+
+/* with -e only clients that went through VeNCrypt get video or input */
+rfbBool rfbNuClientAllowed(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+
+	return !nurfb->tls_required || rfbNuSession(cl)->tls;
+}
+
+/* keyboard and pointer events from viewers are dropped here */
+rfbBool rfbNuInputAllowed(rfbClientPtr cl)
+{
+	struct nu_session *ss = rfbNuSession(cl);
+
+	if (!rfbNuClientAllowed(cl))
+		return FALSE;
+
+	if (ss->tier == NU_TIER_VIEWER || cl->viewOnly)
+	{
+		ss->nurfb->input_rejected++;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static rfbBool
+rfbNuUpdateClient(rfbClientPtr cl)
+{
+	struct timeval tv;
+	rfbBool result = FALSE;
+	rfbScreenInfoPtr screen = cl->screen;
+	rfbStatList *ptr = rfbStatLookupMessage(cl, rfbFramebufferUpdateRequest);
+	struct nu_session *ss = rfbNuSession(cl);
+	unsigned int sent;
+
+	if (cl->sock >= 0 && cl->state == RFB_NORMAL && !rfbNuClientAllowed(cl))
+	{
+		rfbErr("client without TLS refused\n");
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+
+	/* logged in with a view-only password */
+	if (cl->state == RFB_NORMAL && cl->viewOnly && ss->tier != NU_TIER_VIEWER)
+		rfbNuSetTier(ss, NU_TIER_VIEWER);
+
+	if (cl->sock >= 0 && !cl->onHold && (ptr->rcvdCount > 0 || ss->cu.enabled))
+	{
+
+		result = TRUE;
+
+		if (screen->deferUpdateTime == 0)
+		{
+			if (rfbNuRequestPending(cl) && rfbNuFrameDue(cl)) {
+				sent = rfbStatGetSentBytes(cl);
+				if (rfbNuSendFramebufferUpdate(cl) == TRUE)
+				{
+					LOCK(cl->updateMutex);
+					sraRgnMakeEmpty(cl->requestedRegion);
+					UNLOCK(cl->updateMutex);
+					rfbNuFrameSent(cl);
+					ss->frames_sent++;
+				}
+				rfbNuFrameScheduled(cl);
+				rfbNuRateCharge(cl, (unsigned int)rfbStatGetSentBytes(cl) - sent);
+				rfbDumpFPS(cl);
+			}
+		}
+		else if (cl->startDeferring.tv_usec == 0)
+		{
+			gettimeofday(&cl->startDeferring, NULL);
+			if (cl->startDeferring.tv_usec == 0)
+				cl->startDeferring.tv_usec++;
+		}
+		else
+		{
+			gettimeofday(&tv, NULL);
+			if (tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
+				|| ((tv.tv_sec - cl->startDeferring.tv_sec) * 1000 + (tv.tv_usec - cl->startDeferring.tv_usec) / 1000) > screen->deferUpdateTime)
+			{
+				cl->startDeferring.tv_usec = 0;
+				if (rfbNuRequestPending(cl) && rfbNuFrameDue(cl)) {
+					sent = rfbStatGetSentBytes(cl);
+					if (rfbNuSendFramebufferUpdate(cl) == TRUE)
+					{
+						LOCK(cl->updateMutex);
+						sraRgnMakeEmpty(cl->requestedRegion);
+						UNLOCK(cl->updateMutex);
+						rfbNuFrameSent(cl);
+						ss->frames_sent++;
+					}
+					rfbNuFrameScheduled(cl);
+					rfbNuRateCharge(cl, (unsigned int)rfbStatGetSentBytes(cl) - sent);
+					rfbDumpFPS(cl);
+				}
+			}
+		}
+	}
+
+	if (!cl->viewOnly && cl->lastPtrX >= 0)
+	{
+		if (cl->startPtrDeferring.tv_usec == 0)
+		{
+			gettimeofday(&cl->startPtrDeferring, NULL);
+			if (cl->startPtrDeferring.tv_usec == 0)
+				cl->startPtrDeferring.tv_usec++;
+		}
+		else
+		{
+			struct timeval tv;
+
+			gettimeofday(&tv, NULL);
+			if (tv.tv_sec < cl->startPtrDeferring.tv_sec /* at midnight */
+				|| ((tv.tv_sec - cl->startPtrDeferring.tv_sec) * 1000 + (tv.tv_usec - cl->startPtrDeferring.tv_usec) / 1000) > cl->screen->deferPtrUpdateTime)
+			{
+				cl->startPtrDeferring.tv_usec = 0;
+				cl->screen->ptrAddEvent(cl->lastPtrButtons,
+										cl->lastPtrX,
+										cl->lastPtrY, cl);
+				cl->lastPtrX = -1;
+			}
+		}
+	}
+
+	return result;
+}
+
+static int rfbNuListenUnix(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path))
+	{
+		rfbErr("unix socket path too long: %s\n", path);
+		return -1;
+	}
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0)
+	{
+		rfbErr("unix socket failed (%d)\n", errno);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		chmod(path, 0660) < 0 || listen(fd, 5) < 0)
+	{
+		rfbErr("listen on %s failed (%d)\n", path, errno);
+		close(fd);
+		unlink(path);
+		return -1;
+	}
+
+	return fd;
+}
+
+static void rfbNuWatchFd(struct nu_rfb *nurfb, int fd, int cause)
+{
+	struct epoll_event ev;
+
+	if (fd < 0)
+		return;
+
+	ev.events = EPOLLIN;
+	ev.data.u64 = (uint64_t)cause << 32 | (uint32_t)fd;
+	if (epoll_ctl(nurfb->epfd, EPOLL_CTL_ADD, fd, &ev) < 0 && errno != EEXIST)
+		rfbErr("epoll add fd %d failed (%d)\n", fd, errno);
+}
+
+void rfbNuWatchClient(rfbClientPtr cl)
+{
+	rfbNuWatchFd(rfbNuRfb(cl), cl->sock, NU_WAKE_CLIENT);
+}
+
+void rfbNuUnwatchClient(rfbClientPtr cl)
+{
+	struct nu_rfb *nurfb = rfbNuRfb(cl);
+
+	/* a shut down socket stays readable until libvncserver closes it */
+	if (cl->sock >= 0)
+		epoll_ctl(nurfb->epfd, EPOLL_CTL_DEL, cl->sock, NULL);
+}
+
+/*
+ * Listen for local proxies on unix sockets, next to or instead of TCP.
+ * unix_path takes RFB connections directly, on fdpass_path a proxy hands
+ * over already accepted client sockets with SCM_RIGHTS so it does not
+ * have to forward every byte.
+ */
+rfbBool rfbNuListenLocal(rfbScreenInfoPtr screen, struct nu_rfb *nurfb,
+						 const char *unix_path, const char *fdpass_path)
+{
+	if (unix_path)
+	{
+		nurfb->unix_sock = rfbNuListenUnix(unix_path);
+		if (nurfb->unix_sock < 0)
+			return FALSE;
+		strcpy(nurfb->unix_path, unix_path);
+		rfbNuWatchFd(nurfb, nurfb->unix_sock, NU_WAKE_LOCAL);
+		rfbLog("listening for RFB connections on %s\n", unix_path);
+	}
+
+	if (fdpass_path)
+	{
+		nurfb->fdpass_sock = rfbNuListenUnix(fdpass_path);
+		if (nurfb->fdpass_sock < 0)
+			return FALSE;
+		strcpy(nurfb->fdpass_path, fdpass_path);
+		rfbNuWatchFd(nurfb, nurfb->fdpass_sock, NU_WAKE_LOCAL);
+		rfbLog("accepting client fds on %s\n", fdpass_path);
+	}
+
+	return TRUE;
+}
+
+static void rfbNuCloseProxy(struct nu_rfb *nurfb, int i)
+{
+	close(nurfb->fdpass_conn[i]);
+	nurfb->fdpass_conn[i] = -1;
+}
+
+/* every message from a proxy carries one or more client fds */
+static void rfbNuRecvClientFds(rfbScreenInfoPtr screen, struct nu_rfb *nurfb, int i)
+{
+	struct nu_fdpass_msg m;
+	int fds[FDPASS_MAX_FDS];
+	int cnt, truncated;
+	ssize_t n;
+
+	rfbNuFdPassInit(&m);
+	n = recvmsg(nurfb->fdpass_conn[i], &m.msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0)
+	{
+		rfbNuCloseProxy(nurfb, i);
+		return;
+	}
+
+	cnt = rfbNuFdPassParse(&m, fds, FDPASS_MAX_FDS, &truncated);
+	for (int j = 0; j < cnt; j++)
+		if (!rfbNewClient(screen, fds[j]))
+			close(fds[j]);
+
+	if (truncated)
+		rfbErr("client fds dropped, too many in one message\n");
+}
+
+static void rfbNuCheckLocal(rfbScreenInfoPtr screen, struct nu_rfb *nurfb)
+{
+	struct pollfd pfd;
+	int fd;
+
+	if (nurfb->unix_sock >= 0)
+	{
+		while ((fd = accept(nurfb->unix_sock, NULL, NULL)) >= 0)
+			if (!rfbNewClient(screen, fd))
+				close(fd);
+	}
+
+	if (nurfb->fdpass_sock < 0)
+		return;
+
+	while ((fd = accept(nurfb->fdpass_sock, NULL, NULL)) >= 0)
+	{
+		int i;
+
+		for (i = 0; i < LOCAL_MAX_PROXIES; i++)
+			if (nurfb->fdpass_conn[i] < 0)
+				break;
+
+		if (i == LOCAL_MAX_PROXIES)
+		{
+			rfbErr("too many fd passing proxies\n");
+			close(fd);
+			continue;
+		}
+
+		nurfb->fdpass_conn[i] = fd;
+		rfbNuWatchFd(nurfb, fd, NU_WAKE_LOCAL);
+	}
+
+	for (int i = 0; i < LOCAL_MAX_PROXIES; i++)
+	{
+		if (nurfb->fdpass_conn[i] < 0)
+			continue;
+
+		pfd.fd = nurfb->fdpass_conn[i];
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, 0) > 0)
+			rfbNuRecvClientFds(screen, nurfb, i);
+	}
+}
+
+/* hand decoded viewer bytes to libvncserver, as far as its socket takes them */
+static rfbBool rfbNuWsPush(struct nu_ws *ws)
+{
+	ssize_t n;
+
+	while (ws->rx_len)
+	{
+		n = send(ws->pair, ws->rx + ws->rx_off, ws->rx_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+		ws->rx_off += n;
+		ws->rx_len -= n;
+	}
+
+	return TRUE;
+}
+
+static rfbBool rfbNuWsRecv(struct nu_ws *ws)
+{
+	struct iovec iov;
+	ssize_t n;
+
+	n = recv(ws->fd, ws->rx, WS_CHUNK, MSG_DONTWAIT);
+	if (n < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if (n == 0)
+		return FALSE;
+
+	n = rfbNuWsDecode(&ws->dec, ws->rx, n);
+	if (n < 0)
+	{
+		rfbErr("websocket: bad frame from the viewer\n");
+		return FALSE;
+	}
+	ws->rx_off = 0;
+	ws->rx_len = n;
+
+	if (ws->dec.ping)
+	{
+		rfbBool ok;
+
+		iov.iov_base = ws->dec.ping_data;
+		iov.iov_len = ws->dec.ping_len;
+		ws->dec.ping = 0;
+
+		pthread_mutex_lock(&ws->lock);
+		ok = rfbNuWsWriteFrame(ws, NU_WS_OP_PONG, &iov, 1, &ws->tx);
+		pthread_mutex_unlock(&ws->lock);
+		if (!ok)
+			return FALSE;
+	}
+
+	if (ws->dec.closed)
+	{
+		/* echo the status code, then hang up */
+		iov.iov_base = ws->dec.ctl;
+		iov.iov_len = ws->dec.ctl_len < 2 ? ws->dec.ctl_len : 2;
+
+		rfbNuWsPush(ws);
+		pthread_mutex_lock(&ws->lock);
+		rfbNuWsWriteFrame(ws, NU_WS_OP_CLOSE, &iov, 1, &ws->tx);
+		pthread_mutex_unlock(&ws->lock);
+		return FALSE;
+	}
+
+	return rfbNuWsPush(ws);
+}
+
+/*
+ * One per websocket session. It frames what libvncserver writes into the
+ * socketpair and decodes what the viewer sends into it. Rects the ECE
+ * encoded do not pass through here, rfbNuWriteIov() frames those in
+ * place. The viewer is only read once libvncserver took everything
+ * decoded before, so a client on hold pushes back on its TCP connection.
+ */
+static void *rfbNuWsThread(void *arg)
+{
+	struct nu_ws *ws = (struct nu_ws *)arg;
+	struct pollfd pfd[2];
+	rfbBool ok = TRUE;
+
+	while (ok)
+	{
+		pfd[0].fd = ws->fd;
+		pfd[0].events = ws->rx_len ? 0 : POLLIN;
+		pfd[1].fd = ws->pair;
+		pfd[1].events = POLLIN | (ws->rx_len ? POLLOUT : 0);
+
+		if (poll(pfd, 2, -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			rfbErr("websocket: poll failed (%d)\n", errno);
+			break;
+		}
+
+		if (pfd[1].revents & (POLLIN | POLLHUP | POLLERR))
+		{
+			pthread_mutex_lock(&ws->lock);
+			ok = rfbNuWsFlush(ws, &ws->tx);
+			pthread_mutex_unlock(&ws->lock);
+		}
+
+		if (ok && ws->rx_len && (pfd[1].revents & POLLOUT))
+			ok = rfbNuWsPush(ws);
+
+		if (ok && (pfd[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			ok = rfbNuWsRecv(ws);
+	}
+
+	/* libvncserver reads the end of its socket and drops the client */
+	shutdown(ws->pair, SHUT_RDWR);
+	shutdown(ws->fd, SHUT_RDWR);
+
+	return NULL;
+}
+
+/*
+ * Websocket viewers on a TCP port of their own. The upgrade request is
+ * read without blocking the loop. The connection is then served through
+ * a socketpair: libvncserver gets one end as the client socket, and
+ * rfbNuWsThread() moves the data between the other end and the viewer.
+ */
+rfbBool rfbNuListenWs(rfbScreenInfoPtr screen, struct nu_rfb *nurfb, int port)
+{
+	nurfb->ws_sock = rfbListenOnTCPPort(port, screen->listenInterface);
+	if (nurfb->ws_sock < 0)
+	{
+		rfbErr("websocket listen on port %d failed (%d)\n", port, errno);
+		return FALSE;
+	}
+
+	if (fcntl(nurfb->ws_sock, F_SETFL, O_NONBLOCK) < 0 ||
+		fcntl(nurfb->ws_sock, F_SETFD, FD_CLOEXEC) < 0)
+	{
+		rfbErr("websocket listen socket setup failed (%d)\n", errno);
+		return FALSE;
+	}
+
+	rfbNuWatchFd(nurfb, nurfb->ws_sock, NU_WAKE_WS);
+	rfbLog("listening for websocket viewers on port %d\n", port);
+
+	return TRUE;
+}
+
+static void rfbNuWsDrop(struct nu_rfb *nurfb, struct nu_ws_pending *p)
+{
+	epoll_ctl(nurfb->epfd, EPOLL_CTL_DEL, p->fd, NULL);
+	close(p->fd);
+	p->fd = -1;
+}
+
+static void rfbNuWsUpgrade(rfbScreenInfoPtr screen, struct nu_rfb *nurfb,
+						   struct nu_ws_pending *p, int len,
+						   const char *key_accept, int protocol)
+{
+	char resp[256];
+	struct nu_ws *ws;
+	rfbClientPtr cl;
+	int fd = p->fd;
+	int sv[2], n;
+
+	epoll_ctl(nurfb->epfd, EPOLL_CTL_DEL, fd, NULL);
+	p->fd = -1;
+
+	/* the 101 is the first thing on a fresh connection, it fits */
+	n = rfbNuWsResponse(resp, sizeof(resp), key_accept, protocol);
+	if (n < 0 || send(fd, resp, n, MSG_NOSIGNAL) != n)
+	{
+		close(fd);
+		return;
+	}
+
+	ws = calloc(1, sizeof(struct nu_ws));
+	if (!ws || socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+	{
+		rfbErr("websocket session setup failed\n");
+		free(ws);
+		close(fd);
+		return;
+	}
+
+	ws->fd = fd;
+	ws->pair = sv[1];
+	ws->max_wait = screen->maxClientWait;
+	pthread_mutex_init(&ws->lock, NULL);
+
+	/* frames the viewer sent right behind the request */
+	memcpy(ws->rx, p->buf + len, p->len - len);
+	n = rfbNuWsDecode(&ws->dec, ws->rx, p->len - len);
+	if (n < 0)
+	{
+		close(sv[0]);
+		cl = NULL;
+	}
+	else
+	{
+		ws->rx_len = n;
+
+		/* rfbNuSessionCreate() takes ws over from the new client hook */
+		nurfb->ws_new = ws;
+		cl = rfbNewClient(screen, sv[0]);
+		nurfb->ws_new = NULL;
+	}
+
+	if (!cl || !rfbNuSession(cl) || rfbNuSession(cl)->ws != ws)
+	{
+		/* libvncserver closes its end itself */
+		close(ws->pair);
+		close(ws->fd);
+		pthread_mutex_destroy(&ws->lock);
+		free(ws);
+		return;
+	}
+
+	if (pthread_create(&ws->thread, NULL, rfbNuWsThread, ws))
+	{
+		rfbErr("create websocket thread failed\n");
+		rfbCloseClient(cl);
+		return;
+	}
+
+	ws->running = 1;
+	nurfb->ws_upgrades++;
+}
+
+static void rfbNuWsCheck(rfbScreenInfoPtr screen, struct nu_rfb *nurfb, int fd)
+{
+	static const char refuse[] = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\n\r\n";
+	char key_accept[NU_WS_ACCEPT_LEN + 1];
+	struct nu_ws_pending *p = NULL;
+	int protocol, len;
+	ssize_t n;
+
+	if (fd == nurfb->ws_sock)
+	{
+		while ((fd = accept(nurfb->ws_sock, NULL, NULL)) >= 0)
+		{
+			if (fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+			{
+				close(fd);
+				continue;
+			}
+
+			p = &nurfb->ws_pending[0];
+			for (int i = 0; i < WS_MAX_PENDING; i++)
+			{
+				if (nurfb->ws_pending[i].fd < 0)
+				{
+					p = &nurfb->ws_pending[i];
+					break;
+				}
+				if (nurfb->ws_pending[i].since_ns < p->since_ns)
+					p = &nurfb->ws_pending[i];
+			}
+
+			if (p->fd >= 0)
+			{
+				rfbErr("websocket: too many upgrades at once, dropping the oldest\n");
+				rfbNuWsDrop(nurfb, p);
+			}
+
+			p->fd = fd;
+			p->len = 0;
+			p->since_ns = rfbNuNowNs();
+			rfbNuWatchFd(nurfb, fd, NU_WAKE_WS);
+		}
+		return;
+	}
+
+	for (int i = 0; i < WS_MAX_PENDING; i++)
+		if (nurfb->ws_pending[i].fd == fd)
+			p = &nurfb->ws_pending[i];
+	if (!p)
+		return;
+
+	n = recv(fd, p->buf + p->len, NU_WS_REQ_MAX - p->len, MSG_DONTWAIT);
+	if (n < 0 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0)
+	{
+		rfbNuWsDrop(nurfb, p);
+		return;
+	}
+
+	p->len += n;
+	len = rfbNuWsParseRequest(p->buf, p->len, key_accept, &protocol);
+	if (!len)
+		return;
+
+	if (len < 0)
+	{
+		send(fd, refuse, sizeof(refuse) - 1, MSG_NOSIGNAL);
+		rfbNuWsDrop(nurfb, p);
+		nurfb->ws_refused++;
+		return;
+	}
+
+	rfbNuWsUpgrade(screen, nurfb, p, len, key_accept, protocol);
+}
+
+/*
+ * When every client waiting for an update is frame rate capped, sleep
+ * until the first one is due instead of spinning the capture loop at
+ * deferUpdateTime. -1 when no client waits for a frame at all.
+ */
+static long rfbNuPaceWait(rfbScreenInfoPtr screen, long usec)
+{
+	struct nu_rfb *nurfb = rfbNuScreenRfb(screen);
+	rfbClientIteratorPtr i = rfbGetClientIterator(screen);
+	rfbClientPtr cl;
+	unsigned long long now = rfbNuNowNs(), due = ~0ULL;
+
+	while ((cl = rfbClientIteratorNext(i)))
+	{
+		struct nu_session *ss = rfbNuSession(cl);
+
+		if (!ss || cl->sock < 0)
+			continue;
+
+		/* requests wake up select by themselves */
+		if (!rfbNuRequestPending(cl))
+			continue;
+
+		if (!ss->fps_target)
+		{
+			due = 0;
+			break;
+		}
+		if (ss->next_frame_ns < due)
+			due = ss->next_frame_ns;
+	}
+	rfbReleaseClientIterator(i);
+
+	if (due == ~0ULL)
+		return -1;
+
+	/* a static screen is compared less often, no point waking up before */
+	if (nurfb->next_compare_ns > now && nurfb->next_compare_ns > due &&
+		nurfb->next_compare_ns - now > (unsigned long long)usec * 1000)
+		due = nurfb->next_compare_ns;
+
+	if (!due)
+		return usec;
+
+	return due > now ? (long)((due - now) / 1000) : 0;
+}
+
+/*
+ * Clients without a pending request skip the frame, keep its rects so they
+ * go out with the next update the client asks for.
+ */
+static void rfbNuCarryFrame(rfbScreenInfoPtr screen)
+{
+	rfbClientIteratorPtr i = rfbGetClientIterator(screen);
+	rfbClientPtr cl;
+
+	while ((cl = rfbClientIteratorNext(i)))
+	{
+		struct nu_session *ss = rfbNuSession(cl);
+		struct nu_rfb *nurfb = rfbNuRfb(cl);
+
+		if (!ss || cl->sock < 0 || nurfb->fake_fb)
+			continue;
+
+		if (ss->seen_seq == nurfb->frame_seq)
+			continue;
+
+		if (!ss->pending_rgn)
+			ss->pending_rgn = sraRgnCreate();
+		rfbNuMergeFrame(cl, ss->pending_rgn);
+		ss->seen_seq = nurfb->frame_seq;
+	}
+	rfbReleaseClientIterator(i);
+}
+
+#ifdef MSG_ZEROCOPY
+/* zerocopy completions keep the socket in EPOLLERR until they are read */
+static void rfbNuZeroCopyDrain(struct nu_rfb *nurfb, int fd)
+{
+	char control[128];
+	struct msghdr msg;
+
+	for (struct nu_session *ss = nurfb->sessions; ss; ss = ss->next)
+		if (ss->zc_sock == fd)
+			rfbNuZeroCopyReap(ss, 0);
+
+	do
+	{
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+	} while (recvmsg(fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0);
+}
+#endif
+
+/*
+ * Relay mode, the gateway listens like a "vncviewer -listen" and fans our
+ * single stream out. It is a normal client from here on: its input goes
+ * to the HID gadget, updates follow its requests and its tier follows -o
+ * like any other client's, so the load stays that of one viewer however
+ * many watch behind it.
+ *
+ * The name is looked up once at start up, before the event loop runs.
+ * The dial is non-blocking, the socket sits in the epoll set until the
+ * connect completes.
+ */
+static void rfbNuRelayRetry(struct nu_rfb *nurfb, const char *why, int err)
+{
+	if (nurfb->relay_sock >= 0)
+	{
+		epoll_ctl(nurfb->epfd, EPOLL_CTL_DEL, nurfb->relay_sock, NULL);
+		close(nurfb->relay_sock);
+		nurfb->relay_sock = -1;
+	}
+
+	rfbErr("relay to %s:%d %s (%d), retrying in %d ms\n", nurfb->relay_host,
+		   nurfb->relay_port, why, err, RELAY_RETRY_MS);
+	rfbNuArmTimer(nurfb->relay_fd, RELAY_RETRY_MS * 1000000ULL);
 }
 
-static rfbBool
-rfbNuSendFakeFramebufferUpdate(rfbClientPtr cl)
+static void rfbNuRelayUp(rfbScreenInfoPtr screen, struct nu_rfb *nurfb)
 {
-	rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
-	rfbBool result = TRUE;
-
-	fu->nRects = Swap16IfLE(1);
-	fu->type = rfbFramebufferUpdate;
-	cl->ublen = sz_rfbFramebufferUpdateMsg;
-
-	memset(cl->scaledScreen->frameBuffer, 0, FAKE_FB_WIDTH * FAKE_FB_HEIGHT * FAKE_FB_BPP);
+	int sock = nurfb->relay_sock;
+	rfbClientPtr cl;
 
-	if (!rfbSendRectEncodingHextile(cl, 0, 0, FAKE_FB_WIDTH, FAKE_FB_HEIGHT))
-		goto updateFailed;
+	epoll_ctl(nurfb->epfd, EPOLL_CTL_DEL, sock, NULL);
+	nurfb->relay_sock = -1;
+	rfbNuArmTimer(nurfb->relay_fd, 0);
 
-	if (!rfbSendUpdateBuf(cl))
+	cl = rfbNewClient(screen, sock);
+	if (!cl)
 	{
-	updateFailed:
-		result = FALSE;
+		close(sock);
+		rfbNuRelayRetry(nurfb, "refused", 0);
+		return;
 	}
 
-	return result;
+	cl->reverseConnection = TRUE;
+	nurfb->relay_cl = cl;
+	nurfb->relay_connects++;
+	rfbLog("relay to %s:%d up\n", nurfb->relay_host, nurfb->relay_port);
 }
 
-static rfbBool
-rfbNuSendFramebufferUpdate(rfbClientPtr cl)
+static void rfbNuRelayConnect(rfbScreenInfoPtr screen, struct nu_rfb *nurfb)
 {
-	rfbFramebufferUpdateMsg *fu = (rfbFramebufferUpdateMsg *)cl->updateBuf;
-	rfbBool result = TRUE;
-	int ret = 0;
-	struct nu_rfb *nurfb= (struct nu_rfb *)cl->clientData;
+	struct sockaddr *addr = (struct sockaddr *)&nurfb->relay_addr;
+	struct epoll_event ev;
 
-	ret = rfbNuGetUpdate(cl);
+	nurfb->relay_sock = socket(addr->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (nurfb->relay_sock < 0 ||
+		(connect(nurfb->relay_sock, addr, nurfb->relay_addrlen) < 0 && errno != EINPROGRESS))
+	{
+		rfbNuRelayRetry(nurfb, "failed", errno);
+		return;
+	}
 
-	if (cl->useNewFBSize == TRUE
-		&& cl->newFBSizePending == TRUE)
+	ev.events = EPOLLOUT;
+	ev.data.u64 = (uint64_t)NU_WAKE_RELAY << 32 | (uint32_t)nurfb->relay_sock;
+	if (epoll_ctl(nurfb->epfd, EPOLL_CTL_ADD, nurfb->relay_sock, &ev) < 0)
 	{
-		LOCK(cl->updateMutex);
-		cl->newFBSizePending = FALSE;
-		UNLOCK(cl->updateMutex);
-		fu->type = rfbFramebufferUpdate;
-		fu->nRects = Swap16IfLE(1);
-		cl->ublen = sz_rfbFramebufferUpdateMsg;
+		rfbNuRelayRetry(nurfb, "failed", errno);
+		return;
+	}
 
-		if (!rfbSendNewFBSize(cl, cl->scaledScreen->width, cl->scaledScreen->height))
-			return FALSE;
-		return rfbSendUpdateBuf(cl);
+	/* a dial the gateway never answers is abandoned on the timer */
+	rfbNuArmTimer(nurfb->relay_fd, RELAY_CONNECT_MS * 1000000ULL);
+}
+
+/* the dial finished one way or the other */
+static void rfbNuRelayConnected(rfbScreenInfoPtr screen, struct nu_rfb *nurfb)
+{
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (getsockopt(nurfb->relay_sock, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+		err = errno;
+	if (err)
+	{
+		rfbNuRelayRetry(nurfb, "failed", err);
+		return;
 	}
 
+	rfbNuRelayUp(screen, nurfb);
+}
 
-	if (nurfb->fake_fb) {
-		rfbNuSendFakeFramebufferUpdate(cl);
-		return result;
+rfbBool rfbNuRelayStart(rfbScreenInfoPtr screen, struct nu_rfb *nurfb, const char *target)
+{
+	const char *colon = strrchr(target, ':');
+	size_t len = colon ? (size_t)(colon - target) : strlen(target);
+	struct addrinfo hints, *res;
+	char port[8];
+	int err;
+
+	nurfb->relay_port = colon ? (int)strtol(colon + 1, NULL, 0) : RELAY_DEFAULT_PORT;
+	if (!len || nurfb->relay_port <= 0 || nurfb->relay_port > 65535)
+	{
+		rfbErr("relay needs host[:port], got %s\n", target);
+		return FALSE;
 	}
 
-	if (ret <= 0)
+	nurfb->relay_host = strndup(target, len);
+	if (!nurfb->relay_host)
+	{
+		rfbErr("relay setup failed (%d)\n", errno);
 		return FALSE;
+	}
 
-	nurfb->nRects = rfbNuGetDiffCnt(cl);
-	if (nurfb->nRects < 0)
-		goto updateFailed;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_NUMERICSERV;
+	snprintf(port, sizeof(port), "%d", nurfb->relay_port);
 
-	if (nurfb->nRects == 0)
-		nurfb->nRects = 1;
+	/* redials reuse the address, the event loop never waits on DNS */
+	err = getaddrinfo(nurfb->relay_host, port, &hints, &res);
+	if (err)
+	{
+		rfbErr("relay host %s: %s\n", nurfb->relay_host, gai_strerror(err));
+		return FALSE;
+	}
+	memcpy(&nurfb->relay_addr, res->ai_addr, res->ai_addrlen);
+	nurfb->relay_addrlen = res->ai_addrlen;
+	freeaddrinfo(res);
 
-	fu->nRects = Swap16IfLE(nurfb->nRects);
-	fu->type = rfbFramebufferUpdate;
-	if (cl->enableCursorShapeUpdates) {
-		if (cl->cursorWasChanged && cl->readyForSetColourMapEntries) {
-			cl->ublen = sz_rfbFramebufferUpdateMsg;
-			cl->cursorWasChanged = FALSE;
-			if (!rfbSendCursorShape(cl))
-				goto updateFailed;
-		}
+	nurfb->relay_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (nurfb->relay_fd < 0)
+	{
+		rfbErr("relay setup failed (%d)\n", errno);
+		return FALSE;
 	}
+	rfbNuWatchFd(nurfb, nurfb->relay_fd, NU_WAKE_RELAY);
 
-	cl->ublen = sz_rfbFramebufferUpdateMsg;
+	rfbNuRelayConnect(screen, nurfb);
 
-	if (cl->enableLastRectEncoding)
-		fu->nRects = 0xFFFF;
+	return TRUE;
+}
 
-	if (cl->format.bitsPerPixel != 16)
-		for (int i = 0 ; i < nurfb->vcd_info.vdisp; i++) {
-			unsigned int hbytes = nurfb->vcd_info.hdisp * 2;
-			unsigned int dest_of = i * hbytes;
-			unsigned int src_of = i * nurfb->vcd_info.line_pitch;
-			memcpy(
-				cl->scaledScreen->frameBuffer + dest_of,
-				nurfb->raw_fb_addr + src_of,
-				hbytes);
-		}
+/*
+ * Sleep until one of the fds in the epoll set fires: listeners, clients,
+ * local proxies, the keyboard gadget, the capture device and the pacing
+ * and pointer timerfds. Only then let libvncserver dispatch, without a
+ * select timeout of its own, so an idle server does not wake up at all.
+ * Without wait the pipeline loop already slept on the epoll fd, what is
+ * ready gets handled and the timeout this pass wanted is left in poll_ms.
+ */
+static void rfbNuReactorWait(rfbScreenInfoPtr screen, struct nu_rfb *nurfb, long usec,
+							 rfbBool wait)
+{
+	struct epoll_event events[MAXEVENTS];
+	rfbClientIteratorPtr it;
+	rfbClientPtr cl;
+	rfbBool ptr = FALSE, buffered = FALSE, sockets = FALSE, local = FALSE;
+	rfbBool relay = FALSE, dialed = FALSE;
+	long pace;
+	int timeout = -1, n;
+	uint64_t expirations;
 
+	if (screen->httpSock != nurfb->http_sock)
+	{
+		nurfb->http_sock = screen->httpSock;
+		rfbNuWatchFd(nurfb, nurfb->http_sock, NU_WAKE_LISTEN);
+	}
+#ifdef KEYBOARD_EVENT
+	/* the keyboard gadget is reopened on write when it was not there yet */
+	if (hid_keyboard_fd(nurfb->hid) != nurfb->hid_fd)
+	{
+		nurfb->hid_fd = hid_keyboard_fd(nurfb->hid);
+		rfbNuWatchFd(nurfb, nurfb->hid_fd, NU_WAKE_HID);
+	}
+#endif
 
-	for (int i = 0; i < nurfb->nRects; i++)
+	it = rfbGetClientIterator(screen);
+	while ((cl = rfbClientIteratorNext(it)))
 	{
-		struct rect rect;
+		if (cl->sock < 0)
+			continue;
+		if (cl->lastPtrX >= 0)
+			ptr = TRUE;
+		/* the websocket layer may hold decoded data the socket no longer shows */
+		if (cl->wsctx)
+			buffered = TRUE;
+	}
+	rfbReleaseClientIterator(it);
 
-		if (rfbNuGetDiffTable(cl, &rect, i) < 0)
-			break;
+	pace = rfbNuPaceWait(screen, usec);
+	if (pace == 0)
+		timeout = 0;
+	else
+		rfbNuArmTimer(nurfb->pace_fd, pace > 0 ? pace * 1000ULL : 0);
 
-		if (cl->format.bitsPerPixel == 16)
+	if (ptr && !nurfb->ptr_armed)
+	{
+		if (screen->deferPtrUpdateTime > 0)
 		{
-			if (!rfbNuSendRectEncodingHextile(cl, rect.x, rect.y, rect.w, rect.h))
-				goto updateFailed;
+			rfbNuArmTimer(nurfb->ptr_fd, (screen->deferPtrUpdateTime + 1) * 1000000ULL);
+			nurfb->ptr_armed = 1;
 		}
 		else
-		{
-			if (!rfbSendRectEncodingHextile(cl, rect.x, rect.y, rect.w, rect.h))
-				goto updateFailed;
-		}
+			timeout = 0;
 	}
 
-	if (cl->enableLastRectEncoding)
-		rfbSendLastRectMarker(cl);
+	/* a zero defer time must not turn this into a busy loop */
+	if (buffered && timeout < 0)
+		timeout = screen->deferUpdateTime > 0 ? screen->deferUpdateTime : 1;
 
-	if (!rfbSendUpdateBuf(cl))
+	nurfb->poll_ms = timeout;
+	n = epoll_wait(nurfb->epfd, events, MAXEVENTS, wait ? timeout : 0);
+	if (n < 0)
 	{
-	updateFailed:
-		result = FALSE;
+		if (errno != EINTR)
+			rfbErr("epoll_wait failed (%d)\n", errno);
+		return;
 	}
 
-	return result;
-}
-
-static rfbBool
-rfbNuUpdateClient(rfbClientPtr cl)
-{
-	struct timeval tv;
-	rfbBool result = FALSE;
-	rfbScreenInfoPtr screen = cl->screen;
-	rfbStatList *ptr = rfbStatLookupMessage(cl, rfbFramebufferUpdateRequest);
-	struct nu_rfb *nurfb= (struct nu_rfb *)cl->clientData;
-	int index = cl->sock - nurfb->sock_start;
+	if (n == 0 && (wait || !timeout))
+	{
+		nurfb->wakeups[timeout ? NU_WAKE_POLL : NU_WAKE_PACE]++;
+		sockets = TRUE;
+	}
 
-	if (cl->sock >= 0 && !cl->onHold && (ptr->rcvdCount > 0))
+	for (int i = 0; i < n; i++)
 	{
+		int cause = events[i].data.u64 >> 32;
+		int fd = (uint32_t)events[i].data.u64;
 
-		result = TRUE;
+		nurfb->wakeups[cause]++;
 
-		if (screen->deferUpdateTime == 0)
-		{
-			if ((nurfb->rcvdCount[index] != ptr->rcvdCount) || (nurfb->cl_cnt > 1)) {
-				if (rfbNuSendFramebufferUpdate(cl) == TRUE)
-					nurfb->rcvdCount[index]= ptr->rcvdCount;
-				rfbDumpFPS(cl);
-			}
-		}
-		else if (cl->startDeferring.tv_usec == 0)
-		{
-			gettimeofday(&cl->startDeferring, NULL);
-			if (cl->startDeferring.tv_usec == 0)
-				cl->startDeferring.tv_usec++;
-		}
-		else
+		switch (cause)
 		{
-			gettimeofday(&tv, NULL);
-			if (tv.tv_sec < cl->startDeferring.tv_sec /* at midnight */
-				|| ((tv.tv_sec - cl->startDeferring.tv_sec) * 1000 + (tv.tv_usec - cl->startDeferring.tv_usec) / 1000) > screen->deferUpdateTime)
+		case NU_WAKE_RELAY:
+			if (fd == nurfb->relay_sock)
 			{
-				cl->startDeferring.tv_usec = 0;
-				if ((nurfb->rcvdCount[index] != ptr->rcvdCount) || (nurfb->cl_cnt > 1)) {
-					if (rfbNuSendFramebufferUpdate(cl) == TRUE)
-						nurfb->rcvdCount[index] = ptr->rcvdCount;
-					rfbDumpFPS(cl);
-				}
+				dialed = TRUE;
+				break;
 			}
+			/* fall through */
+		case NU_WAKE_PTR:
+			if (cause == NU_WAKE_PTR)
+				nurfb->ptr_armed = 0;
+			/* fall through */
+		case NU_WAKE_PACE:
+			if (cause == NU_WAKE_RELAY)
+				relay = TRUE;
+			if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+				rfbErr("timerfd read failed (%d)\n", errno);
+			break;
+#ifdef KEYBOARD_EVENT
+		case NU_WAKE_HID:
+			hid_keyboard_event(nurfb->hid);
+			break;
+#endif
+		case NU_WAKE_POLL:
+			/* the pool's stand-in for the timeout of the last pass */
+			if (read(fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+				rfbErr("timerfd read failed (%d)\n", errno);
+			sockets = TRUE;
+			break;
+		case NU_WAKE_LOCAL:
+			local = TRUE;
+			break;
+		case NU_WAKE_SENDER:
+			rfbNuSenderWake(screen, nurfb);
+			break;
+		case NU_WAKE_WS:
+			rfbNuWsCheck(screen, nurfb, fd);
+			break;
+		case NU_WAKE_CLIENT:
+#ifdef MSG_ZEROCOPY
+			if (events[i].events & EPOLLERR)
+				rfbNuZeroCopyDrain(nurfb, fd);
+#endif
+			sockets = TRUE;
+			break;
+		case NU_WAKE_LISTEN:
+			sockets = TRUE;
+			break;
 		}
 	}
 
-	if (!cl->viewOnly && cl->lastPtrX >= 0)
-	{
-		if (cl->startPtrDeferring.tv_usec == 0)
-		{
-			gettimeofday(&cl->startPtrDeferring, NULL);
-			if (cl->startPtrDeferring.tv_usec == 0)
-				cl->startPtrDeferring.tv_usec++;
-		}
-		else
-		{
-			struct timeval tv;
+	if (sockets)
+		rfbCheckFds(screen, 0);
+	if (local)
+		rfbNuCheckLocal(screen, nurfb);
+	if (dialed && nurfb->relay_sock >= 0)
+		rfbNuRelayConnected(screen, nurfb);
+	else if (relay && nurfb->relay_sock >= 0)
+		rfbNuRelayRetry(nurfb, "timed out", ETIMEDOUT);
+	else if (relay && !nurfb->relay_cl)
+		rfbNuRelayConnect(screen, nurfb);
+}
 
-			gettimeofday(&tv, NULL);
-			if (tv.tv_sec < cl->startPtrDeferring.tv_sec /* at midnight */
-				|| ((tv.tv_sec - cl->startPtrDeferring.tv_sec) * 1000 + (tv.tv_usec - cl->startPtrDeferring.tv_usec) / 1000) > cl->screen->deferPtrUpdateTime)
-			{
-				cl->startPtrDeferring.tv_usec = 0;
-				cl->screen->ptrAddEvent(cl->lastPtrButtons,
-										cl->lastPtrX,
-										cl->lastPtrY, cl);
-				cl->lastPtrX = -1;
-			}
-		}
-	}
+static void rfbNuReactorStart(rfbScreenInfoPtr screen, struct nu_rfb *nurfb)
+{
+	struct epoll_event ev;
+
+	rfbNuWatchFd(nurfb, screen->listenSock, NU_WAKE_LISTEN);
+	rfbNuWatchFd(nurfb, screen->listen6Sock, NU_WAKE_LISTEN);
+	rfbNuWatchFd(nurfb, screen->httpListenSock, NU_WAKE_LISTEN);
+	rfbNuWatchFd(nurfb, screen->httpListen6Sock, NU_WAKE_LISTEN);
+#ifdef KEYBOARD_EVENT
+	nurfb->hid_fd = hid_keyboard_fd(nurfb->hid);
+	rfbNuWatchFd(nurfb, nurfb->hid_fd, NU_WAKE_HID);
+#endif
 
-	return result;
+	/* edge triggered, the driver may not have anything to read */
+	ev.events = EPOLLIN | EPOLLPRI | EPOLLET;
+	ev.data.u64 = (uint64_t)NU_WAKE_CAPTURE << 32 | (uint32_t)nurfb->raw_fb_fd;
+	if (nurfb->raw_fb_fd >= 0 &&
+		epoll_ctl(nurfb->epfd, EPOLL_CTL_ADD, nurfb->raw_fb_fd, &ev) < 0)
+		rfbLog("capture device can not be polled, compares run on the pacing timer\n");
 }
 
 static rfbBool
-rfbNuProcessEvents(rfbScreenInfoPtr screen, long usec)
+rfbNuProcessEvents(rfbScreenInfoPtr screen, long usec, rfbBool wait)
 {
 	rfbClientIteratorPtr i;
 	rfbClientPtr cl, clPrev;
 	rfbBool result = FALSE;
-	struct nu_rfb *nurfb;
+	struct nu_rfb *nurfb = rfbNuScreenRfb(screen);
 
 	extern rfbClientIteratorPtr
 	rfbGetClientIteratorWithClosed(rfbScreenInfoPtr rfbScreen);
@@ -818,42 +4619,197 @@ rfbNuProcessEvents(rfbScreenInfoPtr screen, long usec)
 	if (usec < 0)
 		usec = screen->deferUpdateTime * 1000;
 
-	rfbCheckFds(screen, usec);
+	rfbNuReactorWait(screen, nurfb, usec, wait);
 	rfbHttpCheckFds(screen);
 
-	i = rfbGetClientIteratorWithClosed(screen);
-	cl = rfbClientIteratorNext(i);
+	nurfb->do_cmd = TRUE;
+	nurfb->captured = FALSE;
 
-	if (cl) {
-		nurfb = (struct nu_rfb *)cl->clientData;
-		nurfb->do_cmd = TRUE;
-	} else
-		goto release;
-
-	while (cl)
+	/*
+	 * The first client with a pending request drives the capture. Operators
+	 * are served first, viewers get the rest of the pass.
+	 */
+	for (int tier = NU_TIER_OPERATOR; tier <= NU_TIER_VIEWER; tier++)
 	{
-		result = rfbNuUpdateClient(cl);
-		nurfb->do_cmd = FALSE;
-
-		clPrev = cl;
+		i = rfbGetClientIteratorWithClosed(screen);
 		cl = rfbClientIteratorNext(i);
-		if (clPrev->sock == -1)
+
+		while (cl)
 		{
-			rfbClientConnectionGone(clPrev);
-			result = TRUE;
+			struct nu_session *ss = rfbNuSession(cl);
+
+			if (ss && ss->tier == tier)
+			{
+				result = rfbNuUpdateClient(cl);
+				if (nurfb->captured)
+					nurfb->do_cmd = FALSE;
+			}
+
+			clPrev = cl;
+			cl = rfbClientIteratorNext(i);
+			if (clPrev->sock == -1 && tier == NU_TIER_VIEWER)
+			{
+				rfbClientConnectionGone(clPrev);
+				result = TRUE;
+			}
 		}
+
+		rfbReleaseClientIterator(i);
 	}
 
-release:
-	rfbReleaseClientIterator(i);
+	if (nurfb->captured)
+		rfbNuCarryFrame(screen);
 
 	return result;
 }
 
 void rfbNuRunEventLoop(rfbScreenInfoPtr screen, long usec, rfbBool runInBackground)
 {
+	rfbNuReactorStart(screen, rfbNuScreenRfb(screen));
+
 	while (rfbIsActive(screen))
-		rfbNuProcessEvents(screen, usec);
+		rfbNuProcessEvents(screen, usec, TRUE);
+}
+
+static void rfbNuPoolStop(struct nu_pool *pool)
+{
+	uint64_t one = 1;
+
+	if (write(pool->stop_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		rfbErr("pipeline stop failed (%d)\n", errno);
+}
+
+static void *rfbNuPoolWorker(void *arg)
+{
+	struct nu_pool *pool = (struct nu_pool *)arg;
+	struct epoll_event ev;
+	int n;
+
+	for (;;)
+	{
+		n = epoll_wait(pool->epfd, &ev, 1, -1);
+		if (n < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			rfbErr("epoll_wait failed (%d)\n", errno);
+			rfbNuPoolStop(pool);
+			break;
+		}
+
+		/* level triggered, every worker sees it */
+		if (!n || ev.data.u32 == MAX_PIPELINES)
+		{
+			if (n)
+				break;
+			continue;
+		}
+
+		rfbScreenInfoPtr screen = pool->screens[ev.data.u32];
+		struct nu_rfb *nurfb = rfbNuScreenRfb(screen);
+
+		rfbNuProcessEvents(screen, pool->usec, FALSE);
+
+		if (!rfbIsActive(screen))
+		{
+			pthread_mutex_lock(&pool->lock);
+			if (!--pool->active)
+				rfbNuPoolStop(pool);
+			pthread_mutex_unlock(&pool->lock);
+			continue;
+		}
+
+		/* a pass that wants to run again soon leaves a timer behind */
+		rfbNuArmTimer(nurfb->poll_fd, nurfb->poll_ms < 0 ? 0 :
+					  nurfb->poll_ms * 1000000ULL + 1);
+
+		/* whatever came in during the pass fires right away */
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		epoll_ctl(pool->epfd, EPOLL_CTL_MOD, nurfb->epfd, &ev);
+	}
+
+	return NULL;
+}
+
+/*
+ * Several pipelines on a pool of worker threads, one per CPU but not more
+ * than there are pipelines. Their epoll fds nest in an outer one shared by
+ * the workers. Each is registered one-shot, so a ready pipeline goes to
+ * exactly one worker and is only armed again once its pass is done. An
+ * idle head costs nothing, and a slow one holds up a single worker
+ * instead of the others. The timeout a pass asks for is kept in a timer
+ * of its own in the pipeline's epoll set.
+ */
+void rfbNuRunPipelines(rfbScreenInfoPtr *screens, int cnt, long usec)
+{
+	struct nu_pool pool;
+	pthread_t threads[MAX_PIPELINES];
+	struct epoll_event ev;
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int workers = cnt, started = 0;
+
+	if (cpus > 0 && cpus < workers)
+		workers = cpus;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.screens = screens;
+	pool.usec = usec;
+	pool.active = cnt;
+	pthread_mutex_init(&pool.lock, NULL);
+	pool.epfd = epoll_create1(EPOLL_CLOEXEC);
+	pool.stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (pool.epfd < 0 || pool.stop_fd < 0)
+	{
+		rfbErr("pipeline epoll setup failed (%d)\n", errno);
+		goto out;
+	}
+
+	ev.events = EPOLLIN;
+	ev.data.u32 = MAX_PIPELINES;
+	epoll_ctl(pool.epfd, EPOLL_CTL_ADD, pool.stop_fd, &ev);
+
+	for (int i = 0; i < cnt; i++)
+	{
+		struct nu_rfb *nurfb = rfbNuScreenRfb(screens[i]);
+
+		rfbNuReactorStart(screens[i], nurfb);
+		nurfb->poll_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+		if (nurfb->poll_fd < 0)
+		{
+			rfbErr("pipeline timer setup failed (%d)\n", errno);
+			goto out;
+		}
+		rfbNuWatchFd(nurfb, nurfb->poll_fd, NU_WAKE_POLL);
+		/* first pass right away, it arms the timers */
+		rfbNuArmTimer(nurfb->poll_fd, 1);
+
+		ev.events = EPOLLIN | EPOLLONESHOT;
+		ev.data.u32 = i;
+		epoll_ctl(pool.epfd, EPOLL_CTL_ADD, nurfb->epfd, &ev);
+	}
+
+	/* the calling thread is one of the workers */
+	for (; started < workers - 1; started++)
+	{
+		if (pthread_create(&threads[started], NULL, rfbNuPoolWorker, &pool))
+		{
+			rfbErr("create pipeline worker failed\n");
+			break;
+		}
+	}
+
+	rfbLog("%d pipelines on %d worker threads\n", cnt, started + 1);
+	rfbNuPoolWorker(&pool);
+
+	for (int i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+
+out:
+	if (pool.epfd >= 0)
+		close(pool.epfd);
+	if (pool.stop_fd >= 0)
+		close(pool.stop_fd);
+	pthread_mutex_destroy(&pool.lock);
 }
 
 void rfbClearNuRfb(struct nu_rfb *nurfb)
@@ -888,12 +4844,80 @@ void rfbClearNuRfb(struct nu_rfb *nurfb)
 		nurfb->hextile_fd = -1;
 	}
 
+	rfbNuTileCacheDestroy(nurfb->tile_cache);
+	nurfb->tile_cache = NULL;
+
+	free(nurfb->shadow_fb);
+	if (nurfb->shadow_rgn)
+		sraRgnDestroy(nurfb->shadow_rgn);
+	free(nurfb->rect_table);
+	free(nurfb->lossy_fb);
+	free(nurfb->key_buf);
+	if (nurfb->key_damage)
+		sraRgnDestroy(nurfb->key_damage);
+	rfbNuMemoReset(&nurfb->memo, 0);
+	free(nurfb->memo.entries);
+	free(nurfb->lut8);
+
+	for (int i = 0; i < MAX_SCALED; i++)
+		if (nurfb->scaled[i].done)
+			sraRgnDestroy(nurfb->scaled[i].done);
+
+	for (int i = 0; i < LOCAL_MAX_PROXIES; i++)
+		if (nurfb->fdpass_conn[i] >= 0)
+			close(nurfb->fdpass_conn[i]);
+
+	for (int i = 0; i < WS_MAX_PENDING; i++)
+		if (nurfb->ws_pending[i].fd >= 0)
+			close(nurfb->ws_pending[i].fd);
+	if (nurfb->ws_sock >= 0)
+		close(nurfb->ws_sock);
+
+	if (nurfb->epfd >= 0)
+		close(nurfb->epfd);
+	if (nurfb->pace_fd >= 0)
+		close(nurfb->pace_fd);
+	if (nurfb->ptr_fd >= 0)
+		close(nurfb->ptr_fd);
+	if (nurfb->sender_fd >= 0)
+		close(nurfb->sender_fd);
+	if (nurfb->poll_fd >= 0)
+		close(nurfb->poll_fd);
+	if (nurfb->relay_fd >= 0)
+		close(nurfb->relay_fd);
+	if (nurfb->relay_sock >= 0)
+		close(nurfb->relay_sock);
+	free(nurfb->relay_host);
+
+	if (nurfb->unix_sock >= 0)
+	{
+		close(nurfb->unix_sock);
+		unlink(nurfb->unix_path);
+	}
+
+	if (nurfb->fdpass_sock >= 0)
+	{
+		close(nurfb->fdpass_sock);
+		unlink(nurfb->fdpass_path);
+	}
+
 	free(nurfb);
-	nurfb = NULL;
-	nurfb_g = NULL;
 }
 
-struct nu_rfb *rfbInitNuRfb(int hsync_mode)
+rfbBool rfbNuSetBpp8(struct nu_rfb *nurfb, int enable)
+{
+	nurfb->bpp8 = enable;
+
+	if (enable && rfbNuInitLut8(nurfb) < 0)
+	{
+		nurfb->bpp8 = 0;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+struct nu_rfb *rfbInitNuRfb(int hsync_mode, rfbBool pattern, struct nu_hid *hid)
 {
 	struct nu_rfb *nurfb = NULL;
 
@@ -904,13 +4928,48 @@ struct nu_rfb *rfbInitNuRfb(int hsync_mode)
 	memset(nurfb, 0, sizeof(struct nu_rfb));
 
 	nurfb->hsync_mode = hsync_mode;
+	nurfb->pattern = pattern;
+	nurfb->hid = hid;
+	nurfb->verify_tolerance = -1;
+	nurfb->unix_sock = -1;
+	nurfb->fdpass_sock = -1;
+	for (int i = 0; i < LOCAL_MAX_PROXIES; i++)
+		nurfb->fdpass_conn[i] = -1;
+	nurfb->ws_sock = -1;
+	for (int i = 0; i < WS_MAX_PENDING; i++)
+		nurfb->ws_pending[i].fd = -1;
+	nurfb->http_sock = -1;
+	nurfb->hid_fd = -1;
+	nurfb->relay_fd = -1;
+	nurfb->relay_sock = -1;
+	nurfb->poll_fd = -1;
+	nurfb->raw_fb_fd = -1;
+	nurfb->hextile_fd = -1;
+
+	nurfb->epfd = epoll_create1(EPOLL_CLOEXEC);
+	nurfb->pace_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	nurfb->ptr_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	nurfb->sender_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (nurfb->epfd < 0 || nurfb->pace_fd < 0 || nurfb->ptr_fd < 0 ||
+		nurfb->sender_fd < 0)
+	{
+		rfbErr("event loop setup failed (%d)\n", errno);
+		goto error;
+	}
+	rfbNuWatchFd(nurfb, nurfb->pace_fd, NU_WAKE_PACE);
+	rfbNuWatchFd(nurfb, nurfb->ptr_fd, NU_WAKE_PTR);
+	rfbNuWatchFd(nurfb, nurfb->sender_fd, NU_WAKE_SENDER);
 
-    sendWakeupPacket();
+	sendWakeupPacket(hid);
 
+	/* releases nurfb itself when it fails */
 	if (rfbNuInitVCD(nurfb, 1) < 0)
 		return NULL;
-
-	nurfb_g = nurfb;
+	nurfb->hw_active = 1;
 
 	return nurfb;
+
+error:
+	rfbClearNuRfb(nurfb);
+	return NULL;
 }
@@ -31,13 +31,27 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <time.h>
+#include <poll.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/errqueue.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
 #include <rfb/rfbconfig.h>
 #include "config.h"
+#include "rfbtilecache.h"
+#include "rfbbucket.h"
+#include "rfbcu.h"
+#include "rfbfdpass.h"
+#include "rfbws.h"
 
-#ifdef KEYBOARD_EVENT
-#include <sys/epoll.h>
 #include <pthread.h>
-#endif
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
 
 #define RAWFB_MMAP 1
 #define RAWFB_FILE 2
@@ -46,11 +60,78 @@
 #define FAKE_FB_HEIGHT 240
 #define FAKE_FB_BPP 2
 
+/* software test pattern in place of the VCD/ECE, RGB565 */
+#define PATTERN_WIDTH 640
+#define PATTERN_HEIGHT 480
+#define PATTERN_BAR_W 16
+
+/* pipelines one process can run, the first one owns the video hardware */
+#define MAX_PIPELINES 4
+
 #define REFRESHCNT 10
 
-#ifdef KEYBOARD_EVENT
+/* progressive mode: rects covering at least 1/PROGRESSIVE_AREA_DIV of the
+ * screen are first sent colour reduced to PROGRESSIVE_BITS per channel,
+ * the lossless pass sends up to 1/PROGRESSIVE_REFINE_DIV per update */
+#define PROGRESSIVE_BITS 3
+#define PROGRESSIVE_AREA_DIV 8
+#define PROGRESSIVE_REFINE_DIV 4
+#define PROGRESSIVE_REFINE_RECTS 16
+
 #define MAXEVENTS 64
-#endif
+
+/* compares on a static screen back off after this many empty diffs,
+ * doubling the interval up to idle_max_ms */
+#define IDLE_BACKOFF_AFTER 8
+#define IDLE_BACKOFF_DEFAULT_MS 250
+
+/* default limit of connected clients */
+#define MAX_CL 5
+
+/* session tiers: the operator drives the console at full rate, viewers
+ * only watch at VIEWER_FPS_DEFAULT, behind the operator in the send order
+ * and at a lower socket priority; both share the hardware encode */
+#define NU_TIER_OPERATOR 0
+#define NU_TIER_VIEWER 1
+#define VIEWER_FPS_DEFAULT 10
+#define VIEWER_SO_PRIORITY 0
+#define OPERATOR_SO_PRIORITY 6
+
+/* encode results kept for the other clients of the same frame */
+#define FRAME_MEMO_MAX_BYTES 0x400000
+
+/* rolling refresh: a band of 1/rolling of the screen rides along with each
+ * update, the band shrinks down to 1/ROLL_DIV_MAX while the client is
+ * congested. A static screen still gets a band every ROLL_IDLE_MS. Mode
+ * changes then need a single full capture instead of REFRESHCNT. */
+#define ROLL_DIV_MAX 256
+#define ROLL_IDLE_MS 1000
+#define ROLLING_REFRESHCNT 2
+
+/* a keyframe with more damage rects than this is dropped */
+#define KEYFRAME_MAX_DAMAGE 256
+
+/* what woke up the event loop, counted for the -f dump */
+#define NU_WAKE_LISTEN 0
+#define NU_WAKE_CLIENT 1
+#define NU_WAKE_LOCAL 2
+#define NU_WAKE_HID 3
+#define NU_WAKE_CAPTURE 4
+#define NU_WAKE_PACE 5
+#define NU_WAKE_PTR 6
+#define NU_WAKE_POLL 7
+#define NU_WAKE_RELAY 8
+#define NU_WAKE_SENDER 9
+#define NU_WAKE_WS 10
+#define NU_WAKE_MAX 11
+
+/* relay mode: a single outbound connection to a gateway that fans the
+ * stream out to the viewers, redialled every RELAY_RETRY_MS while down or
+ * when a dial has not completed within RELAY_CONNECT_MS.
+ * RELAY_DEFAULT_PORT is where listening viewers wait. */
+#define RELAY_RETRY_MS 5000
+#define RELAY_CONNECT_MS 10000
+#define RELAY_DEFAULT_PORT 5500
 
 struct ece_ioctl_cmd
 {
@@ -111,10 +192,191 @@ struct rect
     uint32_t h;
 };
 
+#define MAX_SCALED 4
+
+/* payloads from this size on are sent with MSG_ZEROCOPY when enabled */
+#define ZEROCOPY_MIN_LEN 0x4000
+/* how long a wrap of the ECE buffer waits for outstanding completions */
+#define ZEROCOPY_REAP_MS 1000
+
+/* a pending region with more rects than this is sent as one full frame */
+#define MAX_QUEUED_RECTS 1024
+
+/* socket backlog that is always allowed, regardless of the latency budget */
+#define BACKLOG_MIN_BYTES 0x8000
+
+/* a rate limited client goes colour reduced after this many skipped frames */
+#define RATE_LOSSY_SKIPS 4
+
+/* local proxies that may hand over client fds at the same time */
+#define LOCAL_MAX_PROXIES 4
+
+/* websocket upgrades read at the same time, the oldest is dropped when a
+ * new connection finds all slots taken; WS_CHUNK bytes are moved per read
+ * between the viewer and libvncserver */
+#define WS_MAX_PENDING 8
+#define WS_CHUNK 0x10000
+/* iovecs one websocket frame is built around */
+#define WS_MAX_IOV 4
+
+/* scaled framebuffer shared by the clients using the same scale */
+struct nu_scaled
+{
+    rfbScreenInfoPtr screen;
+    unsigned int seq;
+    sraRegionPtr done;
+};
+
+/* socket write counters for the -f dump */
+struct nu_tx_stats
+{
+    unsigned long long calls;
+    unsigned long long bytes;
+    unsigned long long zc_bytes;
+    unsigned long long tls_bytes;
+};
+
+/* worker threads sharing the pipelines, see rfbNuRunPipelines() */
+struct nu_pool
+{
+    rfbScreenInfoPtr *screens;
+    long usec;
+    int epfd;
+    /* readable once the last pipeline has shut down */
+    int stop_fd;
+    int active;
+    pthread_mutex_t lock;
+};
+
+/* per client sender thread, at most one frame queued or in flight */
+struct nu_sender
+{
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    rfbClientPtr cl;
+    /* bytes queued for the thread, in wire order */
+    char *buf;
+    size_t len;
+    size_t size;
+    /* the frame being encoded, main thread only */
+    char *frame;
+    size_t frame_len;
+    size_t frame_size;
+    /* what the thread is writing */
+    char *out;
+    size_t out_size;
+    /* eventfd of the pipeline, signalled when the queue has drained */
+    int wake_fd;
+    int running;
+    int writing;
+    int quit;
+    int failed;
+    /* written by the thread under lock, folded into nu_rfb on stop */
+    struct nu_tx_stats tx;
+};
+
+/* websocket upgrade still being read */
+struct nu_ws_pending
+{
+    int fd;
+    unsigned long long since_ns;
+    size_t len;
+    char buf[NU_WS_REQ_MAX];
+};
+
+/*
+ * transport of a websocket session: libvncserver has the other end of a
+ * socketpair as its client socket, a thread frames what it writes and
+ * decodes what the viewer sends, see rfbNuWsThread()
+ */
+struct nu_ws
+{
+    pthread_t thread;
+    int running;
+    /* held while a frame goes out on fd */
+    pthread_mutex_t lock;
+    /* the viewer's TCP connection */
+    int fd;
+    /* our end of the socketpair */
+    int pair;
+    int max_wait;
+    struct nu_ws_dec dec;
+    /* decoded client bytes libvncserver has not taken yet */
+    size_t rx_off;
+    size_t rx_len;
+    unsigned char rx[WS_CHUNK];
+    /* library output on its way into a frame, under lock */
+    unsigned char out[WS_CHUNK];
+    /* writes of the thread, folded into nu_rfb on stop */
+    struct nu_tx_stats tx;
+};
+
+/* per frame encode results, shared by the clients of that frame */
+struct nu_memo_entry
+{
+    struct rect r;
+    rfbPixelFormat format;
+    uint32_t len;
+    char *data;
+};
+
+struct nu_frame_memo
+{
+    unsigned int seq;
+    unsigned int cnt;
+    unsigned int size;
+    size_t bytes;
+    struct nu_memo_entry *entries;
+    unsigned long long hits;
+};
+
+struct nu_rfb;
+struct nu_hid;
+
+/* per client state, hung off cl->clientData */
+struct nu_session
+{
+    struct nu_session *next;
+    struct nu_rfb *nurfb;
+    rfbClientPtr cl;
+    unsigned int id;
+    unsigned int refreshCount;
+    sraRegionPtr refine_rgn;
+    unsigned int refine_age;
+    unsigned int refine_seq;
+    unsigned char scale_init;
+    rfbScreenInfoPtr last_scaled;
+    int zc_sock;
+    unsigned int zc_pending;
+    /* completions overdue, sends copy until they are all in */
+    unsigned char zc_stalled;
+    struct nu_sender sender;
+    /* set for clients of the websocket listener */
+    struct nu_ws *ws;
+    /* damage not yet sent to this client */
+    sraRegionPtr pending_rgn;
+    struct nu_bucket client_rate;
+    unsigned int rate_skips;
+    unsigned char rate_lossy;
+    struct nu_cu cu;
+    unsigned int seen_seq;
+    unsigned int fps_target;
+    unsigned long long next_frame_ns;
+    unsigned int frames_sent;
+    unsigned char tls;
+    unsigned char key_pending;
+    unsigned int roll_div;
+    unsigned int roll_y;
+    unsigned long long roll_last_ns;
+    unsigned char tier;
+};
+
 struct nu_rfb
 {
     struct vcd_info vcd_info;
     struct rect *rect_table;
+    struct nu_tile_cache *tile_cache;
     uint8_t fake_fb;
     char *raw_fb_addr;
     char *raw_hextile_addr;
@@ -125,6 +387,7 @@ struct nu_rfb
     unsigned int vcd_fb;
     unsigned int line_pitch;
     unsigned int rect_cnt;
+    unsigned int rect_table_size;
     int res_changed;
     int last_mode;
     int cl_cnt;
@@ -133,13 +396,109 @@ struct nu_rfb
     int frame_size;
     int dumpfps;
     int fps_cnt;
+    struct timespec fps_start;
     int hsync_mode;
     unsigned char do_cmd;
+    unsigned char captured;
+    unsigned char fb_valid;
     unsigned int width;
     unsigned int height;
-    char sock_start;
-    unsigned int rcvdCount[10];
-    unsigned int refreshCount[10];
+    int verify_tolerance;
+    uint16_t *shadow_fb;
+    unsigned int shadow_w;
+    unsigned int shadow_h;
+    /* verified diffs not sent yet, the shadow still holds what went out */
+    sraRegionPtr shadow_rgn;
+    unsigned long long suppressed_rects;
+    unsigned long long suppressed_bytes;
+    int progressive;
+    char *lossy_fb;
+    size_t lossy_fb_size;
+    int bpp8;
+    uint8_t *lut8;
+    int default_scale;
+    unsigned int frame_seq;
+    struct nu_scaled scaled[MAX_SCALED];
+    int zerocopy;
+    /* the kernel still holds pages of the ECE buffer, encode in software */
+    unsigned char ece_pinned;
+    unsigned long long zc_stalls;
+    struct nu_tx_stats tx;
+    int tls_required;
+    unsigned long long tx_last_bytes;
+    struct timespec tx_last_cpu;
+    int async_send;
+    unsigned long long frames_merged;
+    int latency_budget;
+    unsigned long long updates_deferred;
+    unsigned int client_kbps;
+    struct nu_bucket total_rate;
+    unsigned long long rate_skipped;
+    unsigned long long rate_lossy_rects;
+    unsigned long long cu_held;
+    unsigned int max_fps;
+    int unix_sock;
+    int fdpass_sock;
+    int fdpass_conn[LOCAL_MAX_PROXIES];
+    char unix_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char fdpass_path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int ws_sock;
+    struct nu_ws_pending ws_pending[WS_MAX_PENDING];
+    /* handed to the session libvncserver creates for an upgraded viewer */
+    struct nu_ws *ws_new;
+    unsigned long long ws_upgrades;
+    unsigned long long ws_refused;
+    int epfd;
+    int pace_fd;
+    int ptr_fd;
+    int ptr_armed;
+    int http_sock;
+    int sender_fd;
+    /* timeout of the last pass when run from the worker pool */
+    int poll_fd;
+    int hid_fd;
+    unsigned long long wakeups[NU_WAKE_MAX];
+    unsigned int idle_max_ms;
+    unsigned int idle_interval_ms;
+    unsigned int idle_empty;
+    unsigned long long next_compare_ns;
+    unsigned long long compares;
+    unsigned long long compares_skipped;
+    int hw_active;
+    int hw_release;
+    unsigned long long hw_warmups;
+    unsigned int hw_warmup_us;
+    unsigned int hw_warmup_max_us;
+    char *key_buf;
+    uint32_t key_len;
+    uint32_t key_size;
+    unsigned int key_w;
+    unsigned int key_h;
+    sraRegionPtr key_damage;
+    unsigned long long key_sent;
+    unsigned long long key_missed;
+    unsigned int rolling;
+    unsigned long long roll_slices;
+    unsigned int max_clients;
+    unsigned int next_session_id;
+    struct nu_session *sessions;
+    struct nu_frame_memo memo;
+    unsigned int viewer_fps;
+    unsigned char single_operator;
+    unsigned long long input_rejected;
+    unsigned int index;
+    struct nu_hid *hid;
+    unsigned char pattern;
+    unsigned int pattern_phase;
+    int poll_ms;
+    char *relay_host;
+    int relay_port;
+    struct sockaddr_storage relay_addr;
+    socklen_t relay_addrlen;
+    int relay_fd;
+    int relay_sock;
+    rfbClientPtr relay_cl;
+    unsigned long long relay_connects;
 };
 
 #define VCD_IOC_MAGIC 'v'
@@ -162,13 +521,50 @@ struct nu_rfb
 #define SamplesPerPixel 1
 #define BytesPerPixel 2
 
-struct nu_rfb *rfbInitNuRfb(int hsync_mode);
+/* server side 8bpp BGR233 mode */
+#define BitsPerSample8 2
+#define SamplesPerPixel8 3
+#define BytesPerPixel8 1
+
+static inline struct nu_rfb *rfbNuScreenRfb(rfbScreenInfoPtr screen)
+{
+    return (struct nu_rfb *)screen->screenData;
+}
+
+static inline struct nu_session *rfbNuSession(rfbClientPtr cl)
+{
+    return (struct nu_session *)cl->clientData;
+}
+
+static inline struct nu_rfb *rfbNuRfb(rfbClientPtr cl)
+{
+    struct nu_session *ss = rfbNuSession(cl);
+
+    return ss ? ss->nurfb : NULL;
+}
+
+struct nu_rfb *rfbInitNuRfb(int hsync_mode, rfbBool pattern, struct nu_hid *hid);
 void rfbClearNuRfb(struct nu_rfb *nurfb);
 void rfbNuInitRfbFormat(rfbScreenInfoPtr screen);
 void rfbNuRunEventLoop(rfbScreenInfoPtr screen, long usec, rfbBool runInBackground);
+void rfbNuRunPipelines(rfbScreenInfoPtr *screens, int cnt, long usec);
+rfbBool rfbNuRelayStart(rfbScreenInfoPtr screen, struct nu_rfb *nurfb, const char *target);
 rfbBool rfbNuResetVCD(struct nu_rfb *nurfb);
 rfbBool rfbNuResetECE(struct nu_rfb *nurfb);
-#ifdef KEYBOARD_EVENT
-void *rfbNuKeyEventThread(void *ptr);
-#endif
+void rfbNuHwSleep(struct nu_rfb *nurfb);
+rfbBool rfbNuHwWake(struct nu_rfb *nurfb, rfbScreenInfoPtr screen);
+rfbBool rfbNuSetBpp8(struct nu_rfb *nurfb, int enable);
+struct nu_session *rfbNuSessionCreate(struct nu_rfb *nurfb, rfbClientPtr cl);
+void rfbNuSessionDestroy(struct nu_session *ss);
+void rfbNuRegisterExtensions(void);
+void rfbNuSetClientFps(struct nu_session *ss, unsigned int fps);
+rfbBool rfbNuClientAllowed(rfbClientPtr cl);
+rfbBool rfbNuInputAllowed(rfbClientPtr cl);
+void rfbNuSetTier(struct nu_session *ss, unsigned char tier);
+rfbBool rfbNuListenLocal(rfbScreenInfoPtr screen, struct nu_rfb *nurfb,
+                         const char *unix_path, const char *fdpass_path);
+rfbBool rfbNuListenWs(rfbScreenInfoPtr screen, struct nu_rfb *nurfb, int port);
+void rfbNuIdleReset(struct nu_rfb *nurfb);
+void rfbNuWatchClient(rfbClientPtr cl);
+void rfbNuUnwatchClient(rfbClientPtr cl);
 #endif
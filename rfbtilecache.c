@@ -0,0 +1,296 @@
+/*
+ * rfbtilecache.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * LRU cache of hardware encoded hextile rects, keyed by a hash of the
+ * captured source pixels. Blinking cursors and spinners keep toggling the
+ * same few tiles, a hit lets the update path skip the ECE entirely.
+ * Entries keep a copy of their source pixels, a hash match only counts
+ * as a hit once those compare equal, so a collision costs an encode
+ * instead of showing the wrong tile.
+ */
+
+#include "rfbtilecache.h"
+
+#define HASH_PRIME 0x100000001b3ULL
+#define HASH_SEED 0xcbf29ce484222325ULL
+
+static inline uint64_t mix64(uint64_t h, uint64_t v)
+{
+	h ^= v;
+	h *= HASH_PRIME;
+	h ^= h >> 29;
+
+	return h;
+}
+
+static unsigned int bucket_of(struct nu_tile_cache *tc, uint64_t key)
+{
+	return (unsigned int)(key ^ (key >> 32)) & (tc->nbuckets - 1);
+}
+
+static void lru_unlink(struct nu_tile_cache *tc, struct nu_tile_entry *e)
+{
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		tc->head = e->next;
+
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		tc->tail = e->prev;
+
+	e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct nu_tile_cache *tc, struct nu_tile_entry *e)
+{
+	e->prev = NULL;
+	e->next = tc->head;
+	if (tc->head)
+		tc->head->prev = e;
+	tc->head = e;
+	if (!tc->tail)
+		tc->tail = e;
+}
+
+static void entry_remove(struct nu_tile_cache *tc, struct nu_tile_entry *e)
+{
+	struct nu_tile_entry **pp = &tc->buckets[bucket_of(tc, e->key)];
+
+	while (*pp && *pp != e)
+		pp = &(*pp)->hnext;
+	if (*pp)
+		*pp = e->hnext;
+
+	lru_unlink(tc, e);
+	tc->used_bytes -= sizeof(*e) + e->len + e->w * e->h * 2;
+	tc->entries--;
+	free(e);
+}
+
+struct nu_tile_cache *rfbNuTileCacheCreate(size_t max_bytes)
+{
+	struct nu_tile_cache *tc;
+	unsigned int nbuckets = 64;
+
+	if (!max_bytes)
+		return NULL;
+
+	tc = malloc(sizeof(struct nu_tile_cache));
+	if (!tc)
+		return NULL;
+
+	memset(tc, 0, sizeof(struct nu_tile_cache));
+
+	/* roughly one bucket per 1KB of budget */
+	while (nbuckets < (max_bytes >> 10) && nbuckets < 65536)
+		nbuckets <<= 1;
+
+	tc->buckets = calloc(nbuckets, sizeof(struct nu_tile_entry *));
+	if (!tc->buckets)
+	{
+		free(tc);
+		return NULL;
+	}
+
+	tc->nbuckets = nbuckets;
+	tc->max_bytes = max_bytes;
+
+	return tc;
+}
+
+void rfbNuTileCacheFlush(struct nu_tile_cache *tc)
+{
+	if (!tc)
+		return;
+
+	while (tc->tail)
+		entry_remove(tc, tc->tail);
+}
+
+void rfbNuTileCacheDestroy(struct nu_tile_cache *tc)
+{
+	if (!tc)
+		return;
+
+	rfbNuTileCacheFlush(tc);
+	free(tc->buckets);
+	free(tc);
+}
+
+uint64_t rfbNuTileCacheHash(const char *fb, unsigned int line_pitch,
+							int x, int y, int w, int h,
+							const rfbPixelFormat *format)
+{
+	uint64_t hash = HASH_SEED;
+	unsigned int row_len = w * 2;
+
+	/* encoded output depends on the rect size and the target format */
+	hash = mix64(hash, ((uint64_t)w << 16) | h);
+	hash = mix64(hash, ((uint64_t)format->bitsPerPixel << 56) |
+				 ((uint64_t)format->bigEndian << 48) |
+				 ((uint64_t)format->redMax << 32) |
+				 ((uint64_t)format->greenMax << 16) | format->blueMax);
+	hash = mix64(hash, ((uint64_t)format->redShift << 16) |
+				 (format->greenShift << 8) | format->blueShift);
+
+	for (int j = 0; j < h; j++)
+	{
+		const char *row = fb + (y + j) * line_pitch + x * 2;
+		unsigned int i = 0;
+		uint64_t v;
+
+		for (; i + 8 <= row_len; i += 8)
+		{
+			memcpy(&v, row + i, 8);
+			hash = mix64(hash, v);
+		}
+
+		if (i < row_len)
+		{
+			v = 0;
+			memcpy(&v, row + i, row_len - i);
+			hash = mix64(hash, v);
+		}
+	}
+
+	return hash;
+}
+
+/* field by field, the pad bytes of a client's SetPixelFormat are junk */
+rfbBool rfbNuSameFormat(const rfbPixelFormat *a, const rfbPixelFormat *b)
+{
+	return a->bitsPerPixel == b->bitsPerPixel && a->depth == b->depth &&
+		   a->bigEndian == b->bigEndian && a->trueColour == b->trueColour &&
+		   a->redMax == b->redMax && a->greenMax == b->greenMax &&
+		   a->blueMax == b->blueMax && a->redShift == b->redShift &&
+		   a->greenShift == b->greenShift && a->blueShift == b->blueShift;
+}
+
+static rfbBool entry_matches(struct nu_tile_entry *e,
+							 const char *fb, unsigned int line_pitch,
+							 int x, int y, const rfbPixelFormat *format)
+{
+	const char *pix = e->data + e->len;
+	unsigned int row_len = e->w * 2;
+
+	if (!rfbNuSameFormat(&e->format, format))
+		return FALSE;
+
+	for (int j = 0; j < e->h; j++)
+	{
+		if (memcmp(pix + j * row_len, fb + (y + j) * line_pitch + x * 2, row_len))
+			return FALSE;
+	}
+
+	return TRUE;
+}
+
+struct nu_tile_entry *rfbNuTileCacheLookup(struct nu_tile_cache *tc, uint64_t key,
+										   const char *fb, unsigned int line_pitch,
+										   int x, int y, int w, int h,
+										   const rfbPixelFormat *format)
+{
+	struct nu_tile_entry *e;
+
+	for (e = tc->buckets[bucket_of(tc, key)]; e; e = e->hnext)
+	{
+		if (e->key == key && e->w == w && e->h == h)
+		{
+			if (!entry_matches(e, fb, line_pitch, x, y, format))
+			{
+				/* the fresh encode replaces it on insert */
+				entry_remove(tc, e);
+				tc->collisions++;
+				break;
+			}
+
+			lru_unlink(tc, e);
+			lru_push_front(tc, e);
+			tc->hits++;
+			tc->bytes_saved += e->len;
+			return e;
+		}
+	}
+
+	tc->misses++;
+
+	return NULL;
+}
+
+rfbBool rfbNuTileCacheInsert(struct nu_tile_cache *tc, uint64_t key,
+							 const char *fb, unsigned int line_pitch,
+							 int x, int y, int w, int h,
+							 const rfbPixelFormat *format,
+							 const char *data, uint32_t len)
+{
+	struct nu_tile_entry *e;
+	unsigned int row_len = w * 2;
+	size_t need = sizeof(struct nu_tile_entry) + len + row_len * h;
+	unsigned int b;
+
+	if (need > tc->max_bytes / 4)
+		return FALSE;
+
+	while (tc->tail && (tc->used_bytes + need) > tc->max_bytes)
+	{
+		entry_remove(tc, tc->tail);
+		tc->evictions++;
+	}
+
+	e = malloc(need);
+	if (!e)
+		return FALSE;
+
+	e->key = key;
+	e->w = w;
+	e->h = h;
+	e->len = len;
+	e->format = *format;
+	memcpy(e->data, data, len);
+	for (int j = 0; j < h; j++)
+		memcpy(e->data + len + j * row_len, fb + (y + j) * line_pitch + x * 2, row_len);
+
+	b = bucket_of(tc, key);
+	e->hnext = tc->buckets[b];
+	tc->buckets[b] = e;
+	lru_push_front(tc, e);
+
+	tc->used_bytes += need;
+	tc->entries++;
+
+	return TRUE;
+}
+
+void rfbNuTileCacheDumpStats(struct nu_tile_cache *tc)
+{
+	unsigned long long lookups;
+
+	if (!tc)
+		return;
+
+	lookups = tc->hits + tc->misses;
+
+	rfbLog("tile cache: %u entries %zu/%zu KB hits %llu misses %llu (%llu%%) evictions %llu collisions %llu saved %llu KB\n",
+		   tc->entries, tc->used_bytes >> 10, tc->max_bytes >> 10,
+		   tc->hits, tc->misses, lookups ? tc->hits * 100 / lookups : 0,
+		   tc->evictions, tc->collisions, tc->bytes_saved >> 10);
+}
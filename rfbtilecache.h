@@ -0,0 +1,78 @@
+#ifndef RFBTILECACHE_H
+#define RFBTILECACHE_H
+
+/*
+ * rfbtilecache.h
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <rfb/rfb.h>
+
+/* default cache size in KB, 0 disables the cache */
+#define TILE_CACHE_DEFAULT_KB 512
+/* only rects up to this many pixels are hashed and cached */
+#define TILE_CACHE_MAX_AREA (64 * 64)
+
+struct nu_tile_entry
+{
+	struct nu_tile_entry *hnext;
+	struct nu_tile_entry *prev;
+	struct nu_tile_entry *next;
+	uint64_t key;
+	uint16_t w;
+	uint16_t h;
+	uint32_t len;
+	rfbPixelFormat format;
+	/* len bytes of encoded rect, followed by the w * h source pixels */
+	char data[];
+};
+
+struct nu_tile_cache
+{
+	struct nu_tile_entry **buckets;
+	struct nu_tile_entry *head; /* most recently used */
+	struct nu_tile_entry *tail; /* least recently used */
+	unsigned int nbuckets;
+	unsigned int entries;
+	size_t max_bytes;
+	size_t used_bytes;
+	unsigned long long hits;
+	unsigned long long misses;
+	unsigned long long evictions;
+	unsigned long long collisions;
+	unsigned long long bytes_saved;
+};
+
+struct nu_tile_cache *rfbNuTileCacheCreate(size_t max_bytes);
+void rfbNuTileCacheDestroy(struct nu_tile_cache *tc);
+void rfbNuTileCacheFlush(struct nu_tile_cache *tc);
+uint64_t rfbNuTileCacheHash(const char *fb, unsigned int line_pitch,
+							int x, int y, int w, int h,
+							const rfbPixelFormat *format);
+struct nu_tile_entry *rfbNuTileCacheLookup(struct nu_tile_cache *tc, uint64_t key,
+										   const char *fb, unsigned int line_pitch,
+										   int x, int y, int w, int h,
+										   const rfbPixelFormat *format);
+rfbBool rfbNuTileCacheInsert(struct nu_tile_cache *tc, uint64_t key,
+							 const char *fb, unsigned int line_pitch,
+							 int x, int y, int w, int h,
+							 const rfbPixelFormat *format,
+							 const char *data, uint32_t len);
+void rfbNuTileCacheDumpStats(struct nu_tile_cache *tc);
+rfbBool rfbNuSameFormat(const rfbPixelFormat *a, const rfbPixelFormat *b);
+#endif
@@ -0,0 +1,260 @@
+/*
+ * rfbtls.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * VeNCrypt X509None and X509Vnc security types on kernel TLS. With
+ * -passwd only X509Vnc is offered and the usual VNC challenge runs inside
+ * the tunnel, so the password and view-only checks of libvncserver apply
+ * to TLS clients as well. OpenSSL only runs the
+ * handshake, the record layer is installed into the socket with TCP_ULP
+ * "tls". After that the socket is used as a plain one, by libvncserver for
+ * reads and by the sendmsg path for the mapped hextile output, so the
+ * encoded data is never copied into a user space encryption buffer.
+ */
+
+#include "rfbnpcm750.h"
+#include "rfbtls.h"
+
+#ifdef VENCRYPT_TLS
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#if !defined(SSL_OP_ENABLE_KTLS) || defined(OPENSSL_NO_KTLS)
+#error "OpenSSL without kernel TLS support"
+#endif
+
+static SSL_CTX *tls_ctx;
+
+static void rfbNuTlsFail(rfbClientPtr cl, const char *what)
+{
+	unsigned long e = ERR_get_error();
+
+	rfbErr("VeNCrypt: %s failed: %s\n", what, e ? ERR_error_string(e, NULL) : "-");
+	rfbCloseClient(cl);
+}
+
+static rfbBool rfbNuTlsWait(rfbClientPtr cl, int err)
+{
+	struct pollfd pfd;
+
+	pfd.fd = cl->sock;
+	pfd.events = err == SSL_ERROR_WANT_READ ? POLLIN : POLLOUT;
+
+	return poll(&pfd, 1, cl->screen->maxClientWait) > 0;
+}
+
+/*
+ * TLS 1.2 AES-GCM only, the combination kernel TLS handles in both
+ * directions. The SSL object does not own the fd, freeing it after the
+ * handshake leaves the kernel state in place.
+ */
+static rfbBool rfbNuTlsHandshake(rfbClientPtr cl)
+{
+	SSL *ssl = SSL_new(tls_ctx);
+	rfbBool ok = FALSE;
+	int ret;
+
+	if (!ssl || !SSL_set_fd(ssl, cl->sock))
+	{
+		rfbNuTlsFail(cl, "setup");
+		goto out;
+	}
+
+	while ((ret = SSL_accept(ssl)) <= 0)
+	{
+		int err = SSL_get_error(ssl, ret);
+
+		if ((err != SSL_ERROR_WANT_READ && err != SSL_ERROR_WANT_WRITE) ||
+			!rfbNuTlsWait(cl, err))
+		{
+			rfbNuTlsFail(cl, "handshake");
+			goto out;
+		}
+	}
+
+	if (!BIO_get_ktls_send(SSL_get_wbio(ssl)) || !BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+	{
+		rfbErr("VeNCrypt: no kernel TLS for %s\n", SSL_get_cipher_name(ssl));
+		rfbCloseClient(cl);
+		goto out;
+	}
+
+	/* anything OpenSSL already read would be lost */
+	if (SSL_has_pending(ssl))
+	{
+		rfbErr("VeNCrypt: data received during handshake\n");
+		rfbCloseClient(cl);
+		goto out;
+	}
+
+	rfbLog("VeNCrypt: %s %s on kernel TLS\n", SSL_get_version(ssl), SSL_get_cipher_name(ssl));
+	ok = TRUE;
+
+out:
+	SSL_free(ssl);
+
+	return ok;
+}
+
+static rfbBool rfbNuVeNCryptRead(rfbClientPtr cl, char *buf, int len)
+{
+	int n = rfbReadExact(cl, buf, len);
+
+	if (n <= 0)
+	{
+		if (n < 0)
+			rfbErr("VeNCrypt: read\n");
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static rfbBool rfbNuVeNCryptWrite(rfbClientPtr cl, const char *buf, int len)
+{
+	if (rfbWriteExact(cl, buf, len) < 0)
+	{
+		rfbErr("VeNCrypt: write\n");
+		rfbCloseClient(cl);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static void rfbNuVeNCryptHandler(rfbClientPtr cl)
+{
+	char version[2] = {0, 2};
+	char buf[6];
+	uint32_t subtype, offered;
+
+	if (!rfbNuVeNCryptWrite(cl, version, 2) || !rfbNuVeNCryptRead(cl, buf, 2))
+		return;
+
+	if (buf[0] != 0 || buf[1] != 2)
+	{
+		rfbErr("VeNCrypt: unsupported version %d.%d\n", buf[0], buf[1]);
+		buf[0] = 1;
+		rfbNuVeNCryptWrite(cl, buf, 1);
+		rfbCloseClient(cl);
+		return;
+	}
+
+	/* a password is never skipped by picking the subtype without one */
+	offered = cl->screen->authPasswdData ? rfbNuVeNCryptX509Vnc : rfbNuVeNCryptX509None;
+
+	buf[0] = 0;
+	buf[1] = 1;
+	subtype = Swap32IfLE(offered);
+	memcpy(buf + 2, &subtype, 4);
+	if (!rfbNuVeNCryptWrite(cl, buf, 6) || !rfbNuVeNCryptRead(cl, (char *)&subtype, 4))
+		return;
+
+	if (Swap32IfLE(subtype) != offered)
+	{
+		rfbErr("VeNCrypt: unsupported subtype %u\n", Swap32IfLE(subtype));
+		buf[0] = 0;
+		rfbNuVeNCryptWrite(cl, buf, 1);
+		rfbCloseClient(cl);
+		return;
+	}
+
+	buf[0] = 1;
+	if (!rfbNuVeNCryptWrite(cl, buf, 1) || !rfbNuTlsHandshake(cl))
+		return;
+
+	rfbNuSession(cl)->tls = 1;
+
+	/* X509Vnc, libvncserver checks the response and sends the result */
+	if (offered == rfbNuVeNCryptX509Vnc)
+	{
+		rfbRandomBytes(cl->authChallenge);
+		if (!rfbNuVeNCryptWrite(cl, (char *)cl->authChallenge, CHALLENGESIZE))
+			return;
+
+		cl->state = RFB_AUTHENTICATION;
+		return;
+	}
+
+	/* X509None, no further authentication inside the tunnel */
+	if (cl->protocolMinorVersion >= 8)
+	{
+		uint32_t result = Swap32IfLE(rfbVncAuthOK);
+
+		if (!rfbNuVeNCryptWrite(cl, (char *)&result, 4))
+			return;
+	}
+
+	cl->state = RFB_INITIALISATION;
+}
+
+static rfbSecurityHandler rfbNuVeNCrypt = {
+	rfbNuSecTypeVeNCrypt, rfbNuVeNCryptHandler, NULL
+};
+
+rfbBool rfbNuTlsInit(rfbScreenInfoPtr screen)
+{
+	const char *cert = screen->sslcertfile;
+	const char *key = screen->sslkeyfile ? screen->sslkeyfile : cert;
+
+	if (!cert)
+	{
+		rfbErr("VeNCrypt needs -sslcertfile\n");
+		return FALSE;
+	}
+
+	/* all pipelines share the context and the security handler */
+	if (tls_ctx)
+		return TRUE;
+
+	tls_ctx = SSL_CTX_new(TLS_server_method());
+	if (!tls_ctx)
+		return FALSE;
+
+	SSL_CTX_set_min_proto_version(tls_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_max_proto_version(tls_ctx, TLS1_2_VERSION);
+	SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS);
+
+	if (!SSL_CTX_set_cipher_list(tls_ctx, "ECDHE+AESGCM") ||
+		SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1 ||
+		SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1 ||
+		!SSL_CTX_check_private_key(tls_ctx))
+	{
+		unsigned long e = ERR_get_error();
+
+		rfbErr("VeNCrypt: certificate setup failed: %s\n",
+			   e ? ERR_error_string(e, NULL) : "-");
+		SSL_CTX_free(tls_ctx);
+		tls_ctx = NULL;
+		return FALSE;
+	}
+
+	rfbRegisterSecurityHandler(&rfbNuVeNCrypt);
+
+	return TRUE;
+}
+#else
+rfbBool rfbNuTlsInit(rfbScreenInfoPtr screen)
+{
+	rfbErr("VeNCrypt: built without TLS support\n");
+
+	return FALSE;
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef RFBTLS_H
+#define RFBTLS_H
+
+/*
+ * rfbtls.h
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <rfb/rfb.h>
+#include "config.h"
+
+#define rfbNuSecTypeVeNCrypt 19
+#define rfbNuVeNCryptX509None 260
+#define rfbNuVeNCryptX509Vnc 261
+
+rfbBool rfbNuTlsInit(rfbScreenInfoPtr screen);
+#endif
@@ -60,9 +60,6 @@
 #define UDC_NAME		"f0830000.udc"
 #define UDC_NAME_FROM_KERNEL_6	"ci_hdrc.0"
 
-static int mouse_fd = -1;
-static int keyboard_fd = -1;
-
 static const unsigned char hid_report_mouse[] =
     {
         0x05, 0x01,       // USAGE_PAGE (Generic Desktop)
@@ -303,24 +300,21 @@ static struct hid_init_desc _hid_init_desc[] = {
     DESC(CONFIGURATION, "Conf 1", 6),
 };
 
-static unsigned char keyboard_data[8] = {0, 0, 0, 0, 0, 0, 0, 0};
-static int last_write = 2;
-static unsigned char mod = 0;
 static uint8_t KEY_REPORT_LENGTH = 8;
 
-void sendWakeupPacket(void)
+void sendWakeupPacket(struct nu_hid *hid)
 {
     uint8_t wakeupReport[KEY_REPORT_LENGTH];
 
     memset(wakeupReport, 0, sizeof(wakeupReport));
 
-    if (keyboard_fd >= 0)
+    if (hid && hid->keyboard_fd >= 0)
     {
         memset(&wakeupReport[0], 0, KEY_REPORT_LENGTH);
 
         wakeupReport[0] = 0x02; //XK_Shift_L
 
-        if (write(keyboard_fd, wakeupReport, KEY_REPORT_LENGTH) !=
+        if (write(hid->keyboard_fd, wakeupReport, KEY_REPORT_LENGTH) !=
             KEY_REPORT_LENGTH)
         {
             printf("Failed to write keyboard report");
@@ -329,7 +323,7 @@ void sendWakeupPacket(void)
 
         wakeupReport[0] = 0;
 
-        if (write(keyboard_fd, wakeupReport, KEY_REPORT_LENGTH) !=
+        if (write(hid->keyboard_fd, wakeupReport, KEY_REPORT_LENGTH) !=
             KEY_REPORT_LENGTH)
         {
             printf("Failed to write keyboard report");
@@ -337,8 +331,9 @@ void sendWakeupPacket(void)
     }
 }
 
-static int keyboard_iow(int down, unsigned long keysym)
+static int keyboard_iow(struct nu_hid *hid, int down, unsigned long keysym)
 {
+    unsigned char *keyboard_data = hid->keyboard_data;
     int i = 0;
     unsigned char code = 0;
     int retryCount = 5;
@@ -360,34 +355,34 @@ static int keyboard_iow(int down, unsigned long keysym)
     switch (keysym)
     {
     case XK_Control_L:
-        mod = down ? mod | 0x01 : mod & ~0x01;
+        hid->mod = down ? hid->mod | 0x01 : hid->mod & ~0x01;
         break;
     case XK_Shift_L:
-        mod = down ? mod | 0x02 : mod & ~0x02;
+        hid->mod = down ? hid->mod | 0x02 : hid->mod & ~0x02;
         break;
     case XK_Alt_L:
-        mod = down ? mod | 0x04 : mod & ~0x04;
+        hid->mod = down ? hid->mod | 0x04 : hid->mod & ~0x04;
         break;
     case XK_Control_R:
-        mod = down ? mod | 0x10 : mod & ~0x10;
+        hid->mod = down ? hid->mod | 0x10 : hid->mod & ~0x10;
         break;
     case XK_Shift_R:
-        mod = down ? mod | 0x20 : mod & ~0x20;
+        hid->mod = down ? hid->mod | 0x20 : hid->mod & ~0x20;
         break;
     case XK_Alt_R:
-        mod = down ? mod | 0x40 : mod & ~0x40;
+        hid->mod = down ? hid->mod | 0x40 : hid->mod & ~0x40;
         break;
     case XK_Super_L:
-        mod = down ? mod | 0x08 : mod & ~0x08;
+        hid->mod = down ? hid->mod | 0x08 : hid->mod & ~0x08;
         break;
     case XK_Super_R:
-        mod = down ? mod | 0x80 : mod & ~0x80;
+        hid->mod = down ? hid->mod | 0x80 : hid->mod & ~0x80;
         break;
     default:
         break;
     }
 
-    keyboard_data[0] = mod;
+    keyboard_data[0] = hid->mod;
 
     if (keysym < XK_Shift_L ||
         keysym > XK_Hyper_R ||
@@ -399,7 +394,7 @@ static int keyboard_iow(int down, unsigned long keysym)
                 if (keyboard_data[i] == 0)
                 {
                     keyboard_data[i] = code;
-                    last_write = i;
+                    hid->last_write = i;
                     break;
                 }
         }
@@ -414,14 +409,14 @@ static int keyboard_iow(int down, unsigned long keysym)
         }
     }
 
-    if (keyboard_fd < 0) {
-        keyboard_fd = open(KB_DEV, O_RDWR);
+    if (hid->keyboard_fd < 0) {
+        hid->keyboard_fd = open(KB_DEV, O_RDWR);
     }
 
-    if (keyboard_fd > -1) {
+    if (hid->keyboard_fd > -1) {
         while (retryCount > 0)
         {
-            if (write(keyboard_fd, &keyboard_data, 8) == 8)
+            if (write(hid->keyboard_fd, keyboard_data, 8) == 8)
             {
                 break;
             }
@@ -441,7 +436,7 @@ static int keyboard_iow(int down, unsigned long keysym)
     return 0;
 }
 
-static int mouse_iow(int mask, int x, int y, int w, int h)
+static int mouse_iow(struct nu_hid *hid, int mask, int x, int y, int w, int h)
 {
     uint8_t report[6] = {0, 0, 0, 0, 0, 0};
     int retryCount = 5;
@@ -471,15 +466,15 @@ static int mouse_iow(int mask, int x, int y, int w, int h)
 
     memcpy(&report[5], &wheel, 1);
 
-    if (mouse_fd < 0) {
-        mouse_fd = open(MS_DEV, O_WRONLY | O_NONBLOCK);
+    if (hid->mouse_fd < 0) {
+        hid->mouse_fd = open(MS_DEV, O_WRONLY | O_NONBLOCK);
     }
 
-    if (mouse_fd > -1)
+    if (hid->mouse_fd > -1)
     {
         while (retryCount > 0)
         {
-            if (write(mouse_fd, &report, 6) == 6)
+            if (write(hid->mouse_fd, &report, 6) == 6)
             {
                 break;
             }
@@ -514,8 +509,13 @@ static int hid_f_write(char *path, const void *ptr, size_t size)
     return 0;
 }
 
-int hid_init(void)
+/*
+ * Sets up the USB gadget and opens its keyboard and mouse functions. There
+ * is a single gadget per BMC, pipelines without one get no HID.
+ */
+struct nu_hid *hid_init(void)
 {
+    struct nu_hid *hid;
     int i = 0;
     int nr_set = ARRAY_SIZE(_hid_init_desc);
     struct hid_init_desc *desc = _hid_init_desc;
@@ -555,32 +555,51 @@ int hid_init(void)
     else
         hid_f_write(UDC, UDC_NAME, strlen(UDC_NAME));
 
-    keyboard_fd = open(KB_DEV, O_RDWR);
-    if (keyboard_fd < 0) {
+    hid = calloc(1, sizeof(struct nu_hid));
+    if (!hid)
+        return NULL;
+
+    hid->last_write = 2;
+
+    hid->keyboard_fd = open(KB_DEV, O_RDWR);
+    if (hid->keyboard_fd < 0) {
         printf("can not open %s error: %s\n", KB_DEV, strerror(errno));
     }
 
-    mouse_fd = open(MS_DEV, O_WRONLY | O_NONBLOCK);
-    if (mouse_fd < 0) {
+    hid->mouse_fd = open(MS_DEV, O_WRONLY | O_NONBLOCK);
+    if (hid->mouse_fd < 0) {
         printf("can not open %s error: %s\n", MS_DEV, strerror(errno));
     }
 
-    return 0;
+    return hid;
 }
 
-void hid_close(void)
+void hid_close(struct nu_hid *hid)
 {
-    close(mouse_fd);
-    mouse_fd = -1;
+    if (!hid)
+        return;
+
+    close(hid->mouse_fd);
+    hid->mouse_fd = -1;
+
+    close(hid->keyboard_fd);
+    hid->keyboard_fd = -1;
 
-    close(keyboard_fd);
-    keyboard_fd = -1;
+    free(hid);
 }
 
 void keyboard(rfbBool down, rfbKeySym keysym, rfbClientPtr client)
 {
-    static rfbKeySym last_keysym = 0L;
-    static int release_key = 0;
+    struct nu_rfb *nurfb = rfbNuRfb(client);
+    struct nu_hid *hid = nurfb->hid;
+
+    if (!rfbNuInputAllowed(client))
+        return;
+
+    rfbNuIdleReset(nurfb);
+
+    if (!hid)
+        return;
 
     if (keysym <= 0)
     {
@@ -589,86 +608,54 @@ void keyboard(rfbBool down, rfbKeySym keysym, rfbClientPtr client)
     }
 
     if (!down)
-        release_key = 1;
+        hid->release_key = 1;
 
     if (down)
     {
         int skip = 0;
-        if ((release_key && last_keysym == keysym) ||
-            last_keysym != keysym)
+        if ((hid->release_key && hid->last_keysym == keysym) ||
+            hid->last_keysym != keysym)
             skip = 0;
         else
             skip = 1;
 
-        release_key = 0;
+        hid->release_key = 0;
 
         if (skip)
         {
-            last_keysym = keysym;
+            hid->last_keysym = keysym;
             return;
         }
     }
-    keyboard_iow(down, keysym);
-    last_keysym = keysym;
+    keyboard_iow(hid, down, keysym);
+    hid->last_keysym = keysym;
 }
 
 void pointer_event(int mask, int x, int y, rfbClientPtr client)
 {
-    struct nu_rfb *nurfb = (struct nu_rfb *)client->clientData;
+    struct nu_rfb *nurfb = rfbNuRfb(client);
 
-    mouse_iow(mask, x, y, nurfb->vcd_info.hdisp, nurfb->vcd_info.vdisp);
+    if (!rfbNuInputAllowed(client))
+        return;
+
+    rfbNuIdleReset(nurfb);
+    if (nurfb->hid)
+        mouse_iow(nurfb->hid, mask, x, y, nurfb->vcd_info.hdisp, nurfb->vcd_info.vdisp);
     rfbDefaultPtrAddEvent(mask, x, y, client);
 }
 #ifdef KEYBOARD_EVENT
-void *rfbNuKeyEventThread(void *ptr)
+int hid_keyboard_fd(struct nu_hid *hid)
 {
-    struct nu_rfb *nurfb = (struct nu_rfb *)ptr;
-    int ret, efd;
-    struct epoll_event event;
-    struct epoll_event *events;
-
-    efd = epoll_create1(0);
-    if (efd == -1)
-    {
-        rfbErr("epoll_create fail \n");
-        return NULL;
-    }
-
-    event.data.fd = keyboard_fd;
-    event.events = EPOLLIN | EPOLLET | EPOLLPRI;
-    ret = epoll_ctl(efd, EPOLL_CTL_ADD, keyboard_fd, &event);
-    if (ret == -1)
-    {
-        rfbErr("epoll_ctl fail\n");
-        return NULL;
-    }
-
-    /* Buffer where events are returned */
-    events = calloc(MAXEVENTS, sizeof(event));
-
-    while (1)
-    {
-        int n, i;
-
-        n = epoll_wait(efd, events, MAXEVENTS, -1);
-        for (i = 0; i < n; i++)
-        {
-            if (keyboard_fd == events[i].data.fd)
-            {
-                char buffer[1];
-                int nbytes;
-
-                if (events[i].events & EPOLLIN)
-                {
-                    nbytes = read(keyboard_fd, buffer, sizeof(buffer));
-                    rfbErr("nbytes %d byte0 %d\n", nbytes, buffer[0]);
-                }
-            }
-        }
-    }
+    return hid ? hid->keyboard_fd : -1;
+}
 
-    free(events);
+/* LED report from the host, the main event loop calls this when it is readable */
+void hid_keyboard_event(struct nu_hid *hid)
+{
+    char buffer[1];
+    int nbytes;
 
-    return NULL;
+    nbytes = read(hid->keyboard_fd, buffer, sizeof(buffer));
+    rfbErr("nbytes %d byte0 %d\n", nbytes, buffer[0]);
 }
 #endif
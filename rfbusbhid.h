@@ -338,8 +338,22 @@ typedef enum
     LAST_ITEM = 0xFF
 } HID_report_items_t;
 
-int hid_init(void);
-void hid_close(void);
+/* keyboard and mouse gadget of one pipeline */
+struct nu_hid
+{
+    int keyboard_fd;
+    int mouse_fd;
+    unsigned char keyboard_data[8];
+    int last_write;
+    unsigned char mod;
+    rfbKeySym last_keysym;
+    int release_key;
+};
+
+struct nu_hid *hid_init(void);
+void hid_close(struct nu_hid *hid);
 void keyboard(rfbBool down, rfbKeySym keysym, rfbClientPtr client);
 void pointer_event(int mask, int x, int y, rfbClientPtr client);
-void sendWakeupPacket(void);
+void sendWakeupPacket(struct nu_hid *hid);
+int hid_keyboard_fd(struct nu_hid *hid);
+void hid_keyboard_event(struct nu_hid *hid);
@@ -0,0 +1,456 @@
+/*
+ * rfbws.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+
+/*
+ * RFC 6455 for binary RFB sessions: the HTTP upgrade handshake, server
+ * frame headers and the client frame decoder. Nothing in here does I/O,
+ * the transport around it is in rfbnpcm750.c.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "rfbws.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define WS_KEY_MAX 64
+
+static inline uint32_t rol32(uint32_t v, int n)
+{
+	return v << n | v >> (32 - n);
+}
+
+static void sha1_block(uint32_t h[5], const unsigned char *p)
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+
+	for (int i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (int i = 16; i < 80; i++)
+		w[i] = rol32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = h[0];
+	b = h[1];
+	c = h[2];
+	d = h[3];
+	e = h[4];
+
+	for (int i = 0; i < 80; i++)
+	{
+		if (i < 20)
+		{
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		}
+		else if (i < 40)
+		{
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		}
+		else if (i < 60)
+		{
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		}
+		else
+		{
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+
+		t = rol32(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rol32(b, 30);
+		b = a;
+		a = t;
+	}
+
+	h[0] += a;
+	h[1] += b;
+	h[2] += c;
+	h[3] += d;
+	h[4] += e;
+}
+
+/* only ever hashes a handshake key, speed does not matter */
+void rfbNuWsSha1(const void *data, size_t len, unsigned char out[20])
+{
+	uint32_t h[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0};
+	const unsigned char *p = (const unsigned char *)data;
+	unsigned char block[64];
+	uint64_t bits = (uint64_t)len * 8;
+	size_t left = len;
+
+	for (; left >= 64; left -= 64, p += 64)
+		sha1_block(h, p);
+
+	memset(block, 0, sizeof(block));
+	memcpy(block, p, left);
+	block[left] = 0x80;
+	if (left >= 56)
+	{
+		sha1_block(h, block);
+		memset(block, 0, sizeof(block));
+	}
+	for (int i = 0; i < 8; i++)
+		block[63 - i] = bits >> (8 * i);
+	sha1_block(h, block);
+
+	for (int i = 0; i < 20; i++)
+		out[i] = h[i / 4] >> (24 - 8 * (i % 4));
+}
+
+/* out needs 4 * ((len + 2) / 3) + 1 bytes, returns the length without the zero */
+size_t rfbNuWsBase64(const unsigned char *in, size_t len, char *out)
+{
+	static const char tab[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	size_t n = 0;
+
+	for (size_t i = 0; i < len; i += 3)
+	{
+		uint32_t v = (uint32_t)in[i] << 16;
+
+		if (i + 1 < len)
+			v |= in[i + 1] << 8;
+		if (i + 2 < len)
+			v |= in[i + 2];
+
+		out[n++] = tab[v >> 18 & 0x3f];
+		out[n++] = tab[v >> 12 & 0x3f];
+		out[n++] = i + 1 < len ? tab[v >> 6 & 0x3f] : '=';
+		out[n++] = i + 2 < len ? tab[v & 0x3f] : '=';
+	}
+	out[n] = 0;
+
+	return n;
+}
+
+void rfbNuWsAccept(const char *key, size_t key_len, char out[NU_WS_ACCEPT_LEN + 1])
+{
+	char buf[WS_KEY_MAX + sizeof(WS_GUID)];
+	unsigned char digest[20];
+
+	if (key_len > WS_KEY_MAX)
+		key_len = WS_KEY_MAX;
+
+	memcpy(buf, key, key_len);
+	memcpy(buf + key_len, WS_GUID, sizeof(WS_GUID) - 1);
+	rfbNuWsSha1(buf, key_len + sizeof(WS_GUID) - 1, digest);
+	rfbNuWsBase64(digest, sizeof(digest), out);
+}
+
+static void trim(const char **s, size_t *n)
+{
+	while (*n && (**s == ' ' || **s == '\t'))
+	{
+		(*s)++;
+		(*n)--;
+	}
+	while (*n && ((*s)[*n - 1] == ' ' || (*s)[*n - 1] == '\t'))
+		(*n)--;
+}
+
+/* value of the header line if it is called name */
+static int header_value(const char *line, size_t n, const char *name,
+						const char **val, size_t *vlen)
+{
+	size_t nlen = strlen(name);
+
+	if (n <= nlen || line[nlen] != ':' || strncasecmp(line, name, nlen))
+		return 0;
+
+	*val = line + nlen + 1;
+	*vlen = n - nlen - 1;
+	trim(val, vlen);
+
+	return 1;
+}
+
+/* whether the comma separated list v holds tok, ignoring case */
+static int has_token(const char *v, size_t n, const char *tok)
+{
+	size_t tlen = strlen(tok);
+
+	while (n)
+	{
+		const char *comma = memchr(v, ',', n);
+		size_t len = comma ? (size_t)(comma - v) : n;
+		const char *t = v;
+		size_t tn = len;
+
+		trim(&t, &tn);
+		if (tn == tlen && !strncasecmp(t, tok, tlen))
+			return 1;
+
+		if (!comma)
+			break;
+		n -= len + 1;
+		v = comma + 1;
+	}
+
+	return 0;
+}
+
+/*
+ * Parse the HTTP upgrade request at the start of buf. Returns its length
+ * once the blank line is in, 0 while more is needed and -1 for anything
+ * that is not a version 13 websocket upgrade. Only binary framing is
+ * served: a client that lists subprotocols has to offer "binary", and
+ * *protocol tells whether the reply must name it.
+ */
+int rfbNuWsParseRequest(const char *buf, size_t len,
+						char accept[NU_WS_ACCEPT_LEN + 1], int *protocol)
+{
+	const char *end = NULL, *line, *key = NULL;
+	size_t key_len = 0;
+	int upgrade = 0, connection = 0, version = 0;
+
+	*protocol = 0;
+
+	for (size_t i = 0; i + 3 < len; i++)
+	{
+		if (!memcmp(buf + i, "\r\n\r\n", 4))
+		{
+			end = buf + i + 2;
+			break;
+		}
+	}
+
+	if (!end)
+		return len >= NU_WS_REQ_MAX ? -1 : 0;
+	if (end + 2 - buf > NU_WS_REQ_MAX)
+		return -1;
+
+	line = memchr(buf, '\r', end - buf);
+	if (len < 4 || memcmp(buf, "GET ", 4) || line - buf < 13 ||
+		memcmp(line - 9, " HTTP/1.1", 9))
+		return -1;
+
+	for (line += 2; line < end;)
+	{
+		const char *eol = memchr(line, '\r', end - line);
+		size_t n = eol - line;
+		const char *v;
+		size_t vlen;
+
+		if (header_value(line, n, "Upgrade", &v, &vlen))
+			upgrade = has_token(v, vlen, "websocket");
+		else if (header_value(line, n, "Connection", &v, &vlen))
+			connection = has_token(v, vlen, "upgrade");
+		else if (header_value(line, n, "Sec-WebSocket-Version", &v, &vlen))
+			version = vlen == 2 && !memcmp(v, "13", 2);
+		else if (header_value(line, n, "Sec-WebSocket-Key", &v, &vlen))
+		{
+			key = v;
+			key_len = vlen;
+		}
+		else if (header_value(line, n, "Sec-WebSocket-Protocol", &v, &vlen))
+		{
+			if (!has_token(v, vlen, "binary"))
+				return -1;
+			*protocol = 1;
+		}
+
+		line = eol + 2;
+	}
+
+	if (!upgrade || !connection || !version || !key_len || key_len > WS_KEY_MAX)
+		return -1;
+
+	rfbNuWsAccept(key, key_len, accept);
+
+	return end + 2 - buf;
+}
+
+int rfbNuWsResponse(char *buf, size_t size, const char *accept, int protocol)
+{
+	int n = snprintf(buf, size,
+					 "HTTP/1.1 101 Switching Protocols\r\n"
+					 "Upgrade: websocket\r\n"
+					 "Connection: Upgrade\r\n"
+					 "Sec-WebSocket-Accept: %s\r\n"
+					 "%s\r\n",
+					 accept, protocol ? "Sec-WebSocket-Protocol: binary\r\n" : "");
+
+	return n < 0 || (size_t)n >= size ? -1 : n;
+}
+
+/* header of one unmasked, final server frame, returns its length */
+int rfbNuWsHeader(unsigned char *hdr, int opcode, uint64_t len)
+{
+	hdr[0] = 0x80 | opcode;
+
+	if (len < 126)
+	{
+		hdr[1] = len;
+		return 2;
+	}
+
+	if (len <= 0xffff)
+	{
+		hdr[1] = 126;
+		hdr[2] = len >> 8;
+		hdr[3] = len;
+		return 4;
+	}
+
+	hdr[1] = 127;
+	for (int i = 0; i < 8; i++)
+		hdr[2 + i] = len >> (56 - 8 * i);
+
+	return 10;
+}
+
+/* length of the frame header at buf, 0 while incomplete, -1 when invalid */
+int rfbNuWsParseHeader(const unsigned char *buf, size_t len, struct nu_ws_frame *f)
+{
+	size_t hlen = 2;
+
+	if (len < 2)
+		return 0;
+
+	/* no extensions are negotiated, so no reserved bits either */
+	if (buf[0] & 0x70)
+		return -1;
+
+	f->fin = !!(buf[0] & 0x80);
+	f->opcode = buf[0] & 0x0f;
+	f->masked = !!(buf[1] & 0x80);
+	f->len = buf[1] & 0x7f;
+
+	if (f->len == 126)
+		hlen += 2;
+	else if (f->len == 127)
+		hlen += 8;
+	if (f->masked)
+		hlen += 4;
+	if (len < hlen)
+		return 0;
+
+	if (f->len == 126)
+		f->len = buf[2] << 8 | buf[3];
+	else if (f->len == 127)
+	{
+		f->len = 0;
+		for (int i = 0; i < 8; i++)
+			f->len = f->len << 8 | buf[2 + i];
+		if (f->len >> 63)
+			return -1;
+	}
+
+	if (f->masked)
+		memcpy(f->mask, buf + hlen - 4, 4);
+
+	if ((f->opcode & 0x8) && (!f->fin || f->len > NU_WS_CTL_MAX))
+		return -1;
+
+	return hlen;
+}
+
+static void ws_frame_done(struct nu_ws_dec *d)
+{
+	d->in_frame = 0;
+
+	switch (d->f.opcode)
+	{
+	case NU_WS_OP_PING:
+		memcpy(d->ping_data, d->ctl, d->ctl_len);
+		d->ping_len = d->ctl_len;
+		d->ping = 1;
+		break;
+	case NU_WS_OP_CLOSE:
+		d->closed = 1;
+		break;
+	}
+}
+
+/*
+ * Decode len bytes from the client in place. The unmasked payload of
+ * binary frames and their continuations ends up at the front of buf and
+ * its length is returned. Pings and the close frame are left in the
+ * decoder for the caller to answer. -1 on a protocol error: unmasked or
+ * text frames, unknown opcodes, malformed headers.
+ */
+ssize_t rfbNuWsDecode(struct nu_ws_dec *d, unsigned char *buf, size_t len)
+{
+	size_t in = 0, out = 0;
+
+	while (in < len && !d->closed)
+	{
+		if (!d->in_frame)
+		{
+			int n;
+
+			d->hdr[d->hlen++] = buf[in++];
+			n = rfbNuWsParseHeader(d->hdr, d->hlen, &d->f);
+			if (n < 0)
+				return -1;
+			if (!n)
+				continue;
+
+			d->hlen = 0;
+			if (!d->f.masked)
+				return -1;
+			switch (d->f.opcode)
+			{
+			case NU_WS_OP_CONT:
+			case NU_WS_OP_BINARY:
+			case NU_WS_OP_CLOSE:
+			case NU_WS_OP_PING:
+			case NU_WS_OP_PONG:
+				break;
+			default:
+				return -1;
+			}
+
+			d->in_frame = 1;
+			d->pos = 0;
+			d->ctl_len = 0;
+		}
+		else
+		{
+			size_t n = len - in;
+			int ctl = d->f.opcode & 0x8;
+
+			if (n > d->f.len - d->pos)
+				n = d->f.len - d->pos;
+
+			for (size_t i = 0; i < n; i++)
+			{
+				unsigned char c = buf[in + i] ^ d->f.mask[(d->pos + i) & 3];
+
+				if (ctl)
+					d->ctl[d->ctl_len++] = c;
+				else
+					buf[out++] = c;
+			}
+
+			in += n;
+			d->pos += n;
+		}
+
+		if (d->in_frame && d->pos == d->f.len)
+			ws_frame_done(d);
+	}
+
+	return out;
+}
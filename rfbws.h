@@ -0,0 +1,78 @@
+#ifndef RFBWS_H
+#define RFBWS_H
+
+/*
+ * rfbws.h
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* an upgrade request longer than this is refused */
+#define NU_WS_REQ_MAX 4096
+/* base64 of a SHA-1, without the terminating zero */
+#define NU_WS_ACCEPT_LEN 28
+/* frame header: 2 bytes, 8 bytes of extended length, 4 bytes of mask */
+#define NU_WS_HDR_MAX 14
+/* control frame payloads are limited by RFC 6455 */
+#define NU_WS_CTL_MAX 125
+
+#define NU_WS_OP_CONT 0x0
+#define NU_WS_OP_TEXT 0x1
+#define NU_WS_OP_BINARY 0x2
+#define NU_WS_OP_CLOSE 0x8
+#define NU_WS_OP_PING 0x9
+#define NU_WS_OP_PONG 0xa
+
+struct nu_ws_frame
+{
+	int fin;
+	int opcode;
+	int masked;
+	unsigned char mask[4];
+	uint64_t len;
+};
+
+/* client to server decoder state, starts zeroed */
+struct nu_ws_dec
+{
+	unsigned char hdr[NU_WS_HDR_MAX];
+	size_t hlen;
+	struct nu_ws_frame f;
+	int in_frame;
+	uint64_t pos;
+	unsigned char ctl[NU_WS_CTL_MAX];
+	size_t ctl_len;
+	/* a ping to answer, with the payload of the last one */
+	int ping;
+	unsigned char ping_data[NU_WS_CTL_MAX];
+	size_t ping_len;
+	/* the client sent a close frame, nothing after it is decoded */
+	int closed;
+};
+
+void rfbNuWsSha1(const void *data, size_t len, unsigned char out[20]);
+size_t rfbNuWsBase64(const unsigned char *in, size_t len, char *out);
+void rfbNuWsAccept(const char *key, size_t key_len, char out[NU_WS_ACCEPT_LEN + 1]);
+int rfbNuWsParseRequest(const char *buf, size_t len,
+						char accept[NU_WS_ACCEPT_LEN + 1], int *protocol);
+int rfbNuWsResponse(char *buf, size_t size, const char *accept, int protocol);
+int rfbNuWsHeader(unsigned char *hdr, int opcode, uint64_t len);
+int rfbNuWsParseHeader(const unsigned char *buf, size_t len, struct nu_ws_frame *f);
+ssize_t rfbNuWsDecode(struct nu_ws_dec *d, unsigned char *buf, size_t len);
+#endif
@@ -0,0 +1,116 @@
+/*
+ * bucket_test.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+
+#include "rfbbucket.h"
+
+static int failures;
+
+#define CHECK(cond)                                                       \
+	do                                                                    \
+	{                                                                     \
+		if (!(cond))                                                      \
+		{                                                                 \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+			failures++;                                                   \
+		}                                                                 \
+	} while (0)
+
+/* now = the bucket's last refill plus ms */
+static struct timespec after(const struct nu_bucket *b, unsigned int ms)
+{
+	struct timespec t = b->last;
+
+	t.tv_sec += ms / 1000;
+	t.tv_nsec += (ms % 1000) * 1000000L;
+	if (t.tv_nsec >= 1000000000L)
+	{
+		t.tv_sec++;
+		t.tv_nsec -= 1000000000L;
+	}
+
+	return t;
+}
+
+static void test_init(void)
+{
+	struct nu_bucket b;
+
+	rfbNuBucketInit(&b, 4096);
+	CHECK(b.rate == 4096ULL << 10);
+	CHECK(b.burst == (long long)(b.rate / 4));
+	CHECK(b.tokens == b.burst);
+
+	/* slow links still get one large rect of burst */
+	rfbNuBucketInit(&b, 16);
+	CHECK(b.burst == 0x10000);
+}
+
+static void test_refill(void)
+{
+	struct nu_bucket b;
+	struct timespec t;
+
+	rfbNuBucketInit(&b, 1000);
+
+	/* in debt after a large frame, paid off at the configured rate */
+	b.tokens = -(long long)b.rate;
+	t = after(&b, 500);
+	rfbNuBucketRefill(&b, &t);
+	CHECK(b.tokens == -(long long)b.rate / 2);
+
+	t = after(&b, 500);
+	rfbNuBucketRefill(&b, &t);
+	CHECK(b.tokens == 0);
+
+	/* idle time never saves up more than the burst */
+	t = after(&b, 10000);
+	rfbNuBucketRefill(&b, &t);
+	CHECK(b.tokens == b.burst);
+
+	/* across a second boundary */
+	b.tokens = 0;
+	b.last.tv_nsec = 900000000L;
+	t = b.last;
+	t.tv_sec++;
+	t.tv_nsec = 100000000L;
+	rfbNuBucketRefill(&b, &t);
+	CHECK(b.tokens == (long long)(b.rate / 5));
+}
+
+static void test_unlimited(void)
+{
+	struct nu_bucket b;
+	struct timespec t;
+
+	rfbNuBucketInit(&b, 0);
+	b.tokens = -1;
+	t = after(&b, 1000);
+	rfbNuBucketRefill(&b, &t);
+	CHECK(b.tokens == -1);
+}
+
+int main(void)
+{
+	test_init();
+	test_refill();
+	test_unlimited();
+
+	return failures ? 1 : 0;
+}
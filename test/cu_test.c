@@ -0,0 +1,137 @@
+/*
+ * cu_test.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "rfbcu.h"
+
+static int failures;
+
+#define CHECK(cond)                                                       \
+	do                                                                    \
+	{                                                                     \
+		if (!(cond))                                                      \
+		{                                                                 \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+			failures++;                                                   \
+		}                                                                 \
+	} while (0)
+
+static void test_enable(void)
+{
+	static const unsigned char on[sz_rfbNuEnableCU] = { 1, 0, 8, 0, 16, 0x04, 0x00, 0x03, 0x00 };
+	unsigned char off[sz_rfbNuEnableCU];
+	struct nu_cu cu;
+
+	memset(&cu, 0, sizeof(cu));
+
+	/* turning it off before it was on owes the client nothing */
+	memcpy(off, on, sizeof(off));
+	off[0] = 0;
+	CHECK(!rfbNuCuEnable(&cu, off));
+	CHECK(!cu.enabled);
+
+	cu.inflight = 3;
+	CHECK(!rfbNuCuEnable(&cu, on));
+	CHECK(cu.enabled && !cu.inflight);
+	CHECK(cu.x == 8 && cu.y == 16 && cu.w == 1024 && cu.h == 768);
+
+	CHECK(rfbNuCuEnable(&cu, off));
+	CHECK(!cu.enabled);
+	CHECK(!rfbNuCuEnable(&cu, off));
+}
+
+static void test_fences(void)
+{
+	static const unsigned char on[sz_rfbNuEnableCU] = { 1, 0, 0, 0, 0, 0, 16, 0, 16 };
+	struct timespec now = { 100, 0 };
+	struct nu_cu cu;
+	uint32_t seq;
+	int i;
+
+	memset(&cu, 0, sizeof(cu));
+	rfbNuCuEnable(&cu, on);
+
+	/* no fences before the client announced them */
+	CHECK(!rfbNuCuFenceDue(&cu, &now, &seq));
+	CHECK(!rfbNuCuFenceWait(&cu));
+
+	cu.fence = 1;
+	for (i = 0; i < CU_MAX_INFLIGHT; i++)
+	{
+		CHECK(!rfbNuCuFenceWait(&cu));
+		CHECK(rfbNuCuFenceDue(&cu, &now, &seq));
+		CHECK(seq == (uint32_t)i);
+		cu.inflight++;
+		now.tv_nsec += 1000000L;
+	}
+	CHECK(rfbNuCuFenceWait(&cu));
+
+	/* the first fence went out at 100s, answered 5ms later */
+	seq = 0;
+	now.tv_sec = 100;
+	now.tv_nsec = 5000000L;
+	rfbNuCuFenceAnswered(&cu, (const char *)&seq, sizeof(seq), &now);
+	CHECK(cu.rtt_us == 5000);
+	CHECK(cu.inflight == CU_MAX_INFLIGHT - 1);
+	CHECK(!rfbNuCuFenceWait(&cu));
+
+	/* the second one after 9ms, smoothed by 1/8 */
+	seq = 1;
+	now.tv_nsec = 10000000L;
+	rfbNuCuFenceAnswered(&cu, (const char *)&seq, sizeof(seq), &now);
+	CHECK(cu.rtt_us == 5500);
+	CHECK(cu.inflight == CU_MAX_INFLIGHT - 2);
+
+	/* answers to the client's own fences are not ours */
+	rfbNuCuFenceAnswered(&cu, "abc", 3, &now);
+	CHECK(cu.inflight == CU_MAX_INFLIGHT - 2);
+
+	/* a slot is reused once its sequence number comes around */
+	now.tv_sec = 200;
+	now.tv_nsec = 0;
+	CHECK(rfbNuCuFenceDue(&cu, &now, &seq));
+	CHECK(seq == CU_MAX_INFLIGHT);
+	CHECK(cu.fence_ts[0].tv_sec == 200);
+
+	/* no answers are pending after disabling, nothing is counted */
+	cu.inflight = 0;
+	rfbNuCuFenceAnswered(&cu, (const char *)&seq, sizeof(seq), &now);
+	CHECK(cu.inflight == 0);
+}
+
+static void test_parse_fence(void)
+{
+	static const unsigned char msg[sz_rfbNuFence] = { 0xaa, 0xbb, 0xcc, 0x80, 0x00, 0x00, 0x03, 4 };
+	uint32_t flags;
+	uint8_t len;
+
+	rfbNuCuParseFence(msg, &flags, &len);
+	CHECK(flags == (rfbNuFenceRequest | rfbNuFenceBlockBefore | rfbNuFenceBlockAfter));
+	CHECK(len == 4);
+}
+
+int main(void)
+{
+	test_enable();
+	test_fences();
+	test_parse_fence();
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,191 @@
+/*
+ * fdpass_test.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "rfbfdpass.h"
+
+static int failures;
+
+#define CHECK(cond)                                                       \
+	do                                                                    \
+	{                                                                     \
+		if (!(cond))                                                      \
+		{                                                                 \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+			failures++;                                                   \
+		}                                                                 \
+	} while (0)
+
+/* what a proxy does: one byte, n fds in one SCM_RIGHTS message */
+static int send_fds(int sock, const int *fds, int n)
+{
+	char cbuf[CMSG_SPACE(sizeof(int) * 8)];
+	struct msghdr msg;
+	struct cmsghdr *cmsg;
+	struct iovec iov;
+	char byte = 0;
+
+	iov.iov_base = &byte;
+	iov.iov_len = 1;
+	memset(&msg, 0, sizeof(msg));
+	memset(cbuf, 0, sizeof(cbuf));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int) * n);
+	memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * n);
+
+	return sendmsg(sock, &msg, 0) == 1;
+}
+
+static int recv_fds(int sock, int *fds, int max, int *truncated)
+{
+	struct nu_fdpass_msg m;
+
+	rfbNuFdPassInit(&m);
+	if (recvmsg(sock, &m.msg, 0) != 1)
+		return -1;
+
+	return rfbNuFdPassParse(&m, fds, max, truncated);
+}
+
+static int open_fds(void)
+{
+	int n = 0;
+
+	for (int fd = 0; fd < 1024; fd++)
+		if (fcntl(fd, F_GETFD) >= 0)
+			n++;
+
+	return n;
+}
+
+static void test_pass(void)
+{
+	int sv[2], pipes[2][2], out[2], got[FDPASS_MAX_FDS];
+	int truncated;
+
+	CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	CHECK(!pipe(pipes[0]) && !pipe(pipes[1]));
+	out[0] = pipes[0][1];
+	out[1] = pipes[1][1];
+
+	CHECK(send_fds(sv[0], out, 2));
+	CHECK(recv_fds(sv[1], got, FDPASS_MAX_FDS, &truncated) == 2);
+	CHECK(!truncated);
+
+	/* the received fds are new descriptors for the same pipes */
+	CHECK(write(got[0], "x", 1) == 1);
+	CHECK(write(got[1], "y", 1) == 1);
+	{
+		char c = 0;
+
+		CHECK(read(pipes[0][0], &c, 1) == 1 && c == 'x');
+		CHECK(read(pipes[1][0], &c, 1) == 1 && c == 'y');
+	}
+
+	for (int i = 0; i < 2; i++)
+	{
+		close(got[i]);
+		close(pipes[i][0]);
+		close(pipes[i][1]);
+	}
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/* more fds than the caller takes are closed, not leaked */
+static void test_limit(void)
+{
+	int sv[2], p[2], out[3], got[FDPASS_MAX_FDS];
+	int truncated, before;
+
+	CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	CHECK(!pipe(p));
+	out[0] = out[1] = out[2] = p[0];
+
+	CHECK(send_fds(sv[0], out, 3));
+	before = open_fds();
+	CHECK(recv_fds(sv[1], got, 1, &truncated) == 1);
+	CHECK(truncated);
+	CHECK(open_fds() == before + 1);
+
+	close(got[0]);
+	close(p[0]);
+	close(p[1]);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/* more fds than the control buffer holds, the kernel drops the rest */
+static void test_ctrunc(void)
+{
+	int sv[2], p[2], out[FDPASS_MAX_FDS + 2], got[FDPASS_MAX_FDS];
+	int truncated, n;
+
+	CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	CHECK(!pipe(p));
+	for (int i = 0; i < FDPASS_MAX_FDS + 2; i++)
+		out[i] = p[0];
+
+	CHECK(send_fds(sv[0], out, FDPASS_MAX_FDS + 2));
+	n = recv_fds(sv[1], got, FDPASS_MAX_FDS, &truncated);
+	CHECK(n == FDPASS_MAX_FDS);
+	CHECK(truncated);
+
+	for (int i = 0; i < n; i++)
+		close(got[i]);
+	close(p[0]);
+	close(p[1]);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+/* a plain byte without fds is nothing */
+static void test_no_fds(void)
+{
+	int sv[2], got[FDPASS_MAX_FDS];
+	int truncated;
+
+	CHECK(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+	CHECK(write(sv[0], "", 1) == 1);
+	CHECK(recv_fds(sv[1], got, FDPASS_MAX_FDS, &truncated) == 0);
+	CHECK(!truncated);
+
+	close(sv[0]);
+	close(sv[1]);
+}
+
+int main(void)
+{
+	test_pass();
+	test_limit();
+	test_ctrunc();
+	test_no_fds();
+
+	return failures ? 1 : 0;
+}
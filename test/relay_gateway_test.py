@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+#
+# relay_gateway_test.py
+#
+# Copyright (C) 2018 NUVOTON
+#
+#  This is free software; you can redistribute it and/or modify
+#  it under the terms of the GNU General Public License as published by
+#  the Free Software Foundation; either version 2 of the License, or
+#  (at your option) any later version.
+#
+#  This software is distributed in the hope that it will be useful,
+#  but WITHOUT ANY WARRANTY; without even the implied warranty of
+#  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+#  GNU General Public License for more details.
+#
+#  You should have received a copy of the GNU General Public License
+#  along with this software; If not, see <http://www.gnu.org/licenses/>
+#
+# Message framing of relay-gateway.py. A message cut short anywhere has
+# to ask for more instead of being forwarded in pieces.
+
+import importlib.util
+import os
+import struct
+import unittest
+
+spec = importlib.util.spec_from_file_location(
+    "relay_gateway",
+    os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "relay-gateway.py"))
+gw = importlib.util.module_from_spec(spec)
+spec.loader.exec_module(gw)
+
+BPP = 2
+
+
+def rect(x, y, w, h, enc):
+    return struct.pack(">HHHHi", x, y, w, h, enc)
+
+
+def update(*rects):
+    return struct.pack(">BBH", 0, 0, len(rects)) + b"".join(rects)
+
+
+class ServerMessages(unittest.TestCase):
+    def check_whole(self, msg):
+        self.assertEqual(gw.server_msg_len(msg + b"\x02", BPP), len(msg))
+        for n in range(len(msg)):
+            with self.assertRaises(gw.NeedMore):
+                gw.server_msg_len(msg[:n], BPP)
+
+    def test_raw(self):
+        self.check_whole(update(rect(0, 0, 3, 2, gw.ENC_RAW) + bytes(3 * 2 * BPP)))
+
+    def test_hextile(self):
+        # 20x16: a raw tile of 16x16, then a 4x16 tile with background,
+        # foreground and two subrects
+        raw = b"\x01" + bytes(16 * 16 * BPP)
+        sub = b"\x0e" + bytes(BPP) + bytes(BPP) + b"\x02" + bytes(2 * 2)
+        self.check_whole(update(rect(0, 0, 20, 16, gw.ENC_HEXTILE) + raw + sub))
+
+    def test_hextile_coloured_subrects(self):
+        tile = b"\x18\x03" + bytes(3 * (BPP + 2))
+        self.check_whole(update(rect(0, 0, 8, 8, gw.ENC_HEXTILE) + tile))
+
+    def test_last_rect(self):
+        # the count is a placeholder, LastRect ends the update early
+        msg = struct.pack(">BBH", 0, 0, 0xffff)
+        msg += rect(0, 0, 1, 1, gw.ENC_RAW) + bytes(BPP)
+        msg += rect(0, 0, 0, 0, gw.ENC_LAST_RECT)
+        self.check_whole(msg)
+
+    def test_other_messages(self):
+        self.check_whole(struct.pack(">BBHH", 1, 0, 0, 2) + bytes(12))
+        self.check_whole(b"\x02")
+        self.check_whole(struct.pack(">BxxxI", 3, 5) + b"hello")
+
+    def test_unexpected(self):
+        with self.assertRaises(ValueError):
+            gw.server_msg_len(update(rect(0, 0, 1, 1, 16)), BPP)
+        with self.assertRaises(ValueError):
+            gw.server_msg_len(b"\x7f", BPP)
+
+
+class ViewerMessages(unittest.TestCase):
+    def check(self, msg, forward):
+        self.assertEqual(gw.client_msg_len(msg + b"\x00"), (len(msg), forward))
+        for n in range(len(msg)):
+            with self.assertRaises(gw.NeedMore):
+                gw.client_msg_len(msg[:n])
+
+    def test_kept_from_the_bmc(self):
+        self.check(b"\x00" + bytes(19), False)
+        self.check(struct.pack(">BxHii", 2, 2, 5, 0), False)
+
+    def test_forwarded(self):
+        self.check(struct.pack(">BBHHHH", 3, 1, 0, 0, 640, 480), True)
+        self.check(struct.pack(">BBxxI", 4, 1, 0x61), True)
+        self.check(struct.pack(">BBHH", 5, 0, 10, 10), True)
+        self.check(struct.pack(">BxxxI", 6, 3) + b"abc", True)
+
+    def test_unexpected(self):
+        with self.assertRaises(ValueError):
+            gw.client_msg_len(b"\xfa")
+
+
+if __name__ == "__main__":
+    unittest.main()
@@ -0,0 +1,161 @@
+/*
+ * tilecache_test.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "rfbtilecache.h"
+
+#define FB_W 64
+#define FB_H 64
+#define PITCH (FB_W * 2)
+
+static int failures;
+
+#define CHECK(cond)                                                       \
+	do                                                                    \
+	{                                                                     \
+		if (!(cond))                                                      \
+		{                                                                 \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+			failures++;                                                   \
+		}                                                                 \
+	} while (0)
+
+static char fb[FB_H * PITCH];
+
+static const rfbPixelFormat rgb565 = {
+	16, 16, 0, 1, 31, 63, 31, 11, 5, 0, 0, 0,
+};
+
+static void fill(unsigned int seed)
+{
+	for (unsigned int i = 0; i < sizeof(fb); i++)
+		fb[i] = (char)(i * 7 + seed);
+}
+
+static void test_hit_and_miss(void)
+{
+	struct nu_tile_cache *tc = rfbNuTileCacheCreate(64 << 10);
+	struct nu_tile_entry *e;
+	uint64_t key;
+
+	fill(1);
+	key = rfbNuTileCacheHash(fb, PITCH, 16, 16, 16, 16, &rgb565);
+
+	CHECK(!rfbNuTileCacheLookup(tc, key, fb, PITCH, 16, 16, 16, 16, &rgb565));
+	CHECK(rfbNuTileCacheInsert(tc, key, fb, PITCH, 16, 16, 16, 16, &rgb565, "encoded", 7));
+
+	e = rfbNuTileCacheLookup(tc, key, fb, PITCH, 16, 16, 16, 16, &rgb565);
+	CHECK(e && e->len == 7 && !memcmp(e->data, "encoded", 7));
+	CHECK(tc->hits == 1 && tc->misses == 1);
+
+	/* other pixels hash differently */
+	fb[16 * PITCH + 32] ^= 1;
+	CHECK(rfbNuTileCacheHash(fb, PITCH, 16, 16, 16, 16, &rgb565) != key);
+
+	rfbNuTileCacheDestroy(tc);
+}
+
+/* a hash match alone is no hit, the source pixels have to agree */
+static void test_collision(void)
+{
+	struct nu_tile_cache *tc = rfbNuTileCacheCreate(64 << 10);
+	uint64_t key;
+
+	fill(2);
+	key = rfbNuTileCacheHash(fb, PITCH, 0, 0, 8, 8, &rgb565);
+	CHECK(rfbNuTileCacheInsert(tc, key, fb, PITCH, 0, 0, 8, 8, &rgb565, "a", 1));
+
+	fb[3 * PITCH + 4] ^= 0x40;
+	CHECK(!rfbNuTileCacheLookup(tc, key, fb, PITCH, 0, 0, 8, 8, &rgb565));
+	CHECK(tc->collisions == 1);
+	CHECK(tc->entries == 0);
+
+	rfbNuTileCacheDestroy(tc);
+}
+
+static void test_format(void)
+{
+	struct nu_tile_cache *tc = rfbNuTileCacheCreate(64 << 10);
+	rfbPixelFormat padded = rgb565, other = rgb565;
+	uint64_t key;
+
+	fill(3);
+	key = rfbNuTileCacheHash(fb, PITCH, 8, 8, 8, 8, &rgb565);
+	CHECK(rfbNuTileCacheInsert(tc, key, fb, PITCH, 8, 8, 8, 8, &rgb565, "b", 1));
+
+	/* clients send junk in the pad bytes of SetPixelFormat */
+	padded.pad1 = 0x5a;
+	padded.pad2 = 0xa5a5;
+	CHECK(rfbNuSameFormat(&rgb565, &padded));
+	CHECK(rfbNuTileCacheLookup(tc, key, fb, PITCH, 8, 8, 8, 8, &padded));
+
+	other.redShift = 0;
+	other.blueShift = 11;
+	CHECK(!rfbNuSameFormat(&rgb565, &other));
+	CHECK(rfbNuTileCacheHash(fb, PITCH, 8, 8, 8, 8, &other) != key);
+	CHECK(!rfbNuTileCacheLookup(tc, key, fb, PITCH, 8, 8, 8, 8, &other));
+
+	rfbNuTileCacheDestroy(tc);
+}
+
+static void test_eviction(void)
+{
+	struct nu_tile_cache *tc = rfbNuTileCacheCreate(16 << 10);
+	char data[1024];
+	uint64_t first = 0;
+
+	memset(data, 0x11, sizeof(data));
+	for (int i = 0; i < 32; i++)
+	{
+		uint64_t key;
+
+		fill(i);
+		key = rfbNuTileCacheHash(fb, PITCH, 0, 0, 16, 16, &rgb565);
+		if (!i)
+			first = key;
+		CHECK(rfbNuTileCacheInsert(tc, key, fb, PITCH, 0, 0, 16, 16, &rgb565,
+								   data, sizeof(data)));
+		CHECK(tc->used_bytes <= tc->max_bytes);
+	}
+
+	CHECK(tc->evictions > 0);
+	fill(0);
+	CHECK(!rfbNuTileCacheLookup(tc, first, fb, PITCH, 0, 0, 16, 16, &rgb565));
+
+	/* a rect bigger than a quarter of the cache is not kept */
+	CHECK(!rfbNuTileCacheInsert(tc, 1, fb, PITCH, 0, 0, 64, 64, &rgb565, data, sizeof(data)));
+
+	rfbNuTileCacheFlush(tc);
+	CHECK(tc->entries == 0 && tc->used_bytes == 0 && !tc->head && !tc->tail);
+
+	rfbNuTileCacheDestroy(tc);
+}
+
+int main(void)
+{
+	CHECK(!rfbNuTileCacheCreate(0));
+
+	test_hit_and_miss();
+	test_collision();
+	test_format();
+	test_eviction();
+
+	return failures ? 1 : 0;
+}
@@ -0,0 +1,252 @@
+/*
+ * ws_test.c
+ *
+ * Copyright (C) 2018 NUVOTON
+ *
+ *  This is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This software is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this software; If not, see <http://www.gnu.org/licenses/>
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "rfbws.h"
+
+static int failures;
+
+#define CHECK(cond)                                                       \
+	do                                                                    \
+	{                                                                     \
+		if (!(cond))                                                      \
+		{                                                                 \
+			fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond);    \
+			failures++;                                                   \
+		}                                                                 \
+	} while (0)
+
+/* the handshake of RFC 6455 section 1.3 */
+static const char request[] =
+	"GET /chat HTTP/1.1\r\n"
+	"Host: server.example.com\r\n"
+	"Upgrade: websocket\r\n"
+	"Connection: keep-alive, Upgrade\r\n"
+	"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+	"Sec-WebSocket-Version: 13\r\n"
+	"\r\n";
+
+static const char rfc_accept[] = "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=";
+
+static void test_sha1(void)
+{
+	static const unsigned char abc[20] = {
+		0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+		0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d,
+	};
+	unsigned char out[20];
+	char b64[9];
+
+	rfbNuWsSha1("abc", 3, out);
+	CHECK(!memcmp(out, abc, sizeof(out)));
+
+	CHECK(rfbNuWsBase64((const unsigned char *)"ab", 2, b64) == 4 && !strcmp(b64, "YWI="));
+	CHECK(rfbNuWsBase64((const unsigned char *)"abcd", 4, b64) == 8 && !strcmp(b64, "YWJjZA=="));
+}
+
+static void test_request(void)
+{
+	char accept[NU_WS_ACCEPT_LEN + 1], buf[NU_WS_REQ_MAX + 16];
+	int protocol;
+
+	CHECK(rfbNuWsParseRequest(request, strlen(request), accept, &protocol) == (int)strlen(request));
+	CHECK(!strcmp(accept, rfc_accept));
+	CHECK(!protocol);
+
+	/* anything short of the blank line needs more */
+	for (size_t n = 0; n < strlen(request); n++)
+		CHECK(rfbNuWsParseRequest(request, n, accept, &protocol) == 0);
+
+	/* viewer bytes following the request are not part of it */
+	snprintf(buf, sizeof(buf), "%sRFB", request);
+	CHECK(rfbNuWsParseRequest(buf, strlen(buf), accept, &protocol) == (int)strlen(request));
+
+	/* noVNC offers binary among others, the reply has to name it */
+	snprintf(buf, sizeof(buf), "%.*sSec-WebSocket-Protocol: base64, binary\r\n\r\n",
+			 (int)strlen(request) - 2, request);
+	CHECK(rfbNuWsParseRequest(buf, strlen(buf), accept, &protocol) > 0);
+	CHECK(protocol);
+
+	/* base64 framing alone is not served */
+	snprintf(buf, sizeof(buf), "%.*sSec-WebSocket-Protocol: base64\r\n\r\n",
+			 (int)strlen(request) - 2, request);
+	CHECK(rfbNuWsParseRequest(buf, strlen(buf), accept, &protocol) == -1);
+
+	CHECK(rfbNuWsParseRequest("POST / HTTP/1.1\r\n\r\n", 19, accept, &protocol) == -1);
+
+	/* plain HTTP without the upgrade headers */
+	CHECK(rfbNuWsParseRequest("GET / HTTP/1.1\r\nHost: a\r\n\r\n", 27, accept, &protocol) == -1);
+
+	/* no blank line within the limit */
+	memset(buf, 'a', NU_WS_REQ_MAX);
+	CHECK(rfbNuWsParseRequest(buf, NU_WS_REQ_MAX, accept, &protocol) == -1);
+}
+
+static void test_response(void)
+{
+	char buf[256];
+	int n;
+
+	n = rfbNuWsResponse(buf, sizeof(buf), rfc_accept, 1);
+	CHECK(n > 0 && (size_t)n == strlen(buf));
+	CHECK(!strncmp(buf, "HTTP/1.1 101 ", 13));
+	CHECK(strstr(buf, "Sec-WebSocket-Accept: s3pPLMBiTxaQ9kYGzzhZRbK+xOo=\r\n"));
+	CHECK(strstr(buf, "Sec-WebSocket-Protocol: binary\r\n"));
+	CHECK(!strcmp(buf + n - 4, "\r\n\r\n"));
+
+	n = rfbNuWsResponse(buf, sizeof(buf), rfc_accept, 0);
+	CHECK(n > 0 && !strstr(buf, "Sec-WebSocket-Protocol"));
+
+	CHECK(rfbNuWsResponse(buf, 16, rfc_accept, 0) == -1);
+}
+
+static void test_header(void)
+{
+	unsigned char hdr[NU_WS_HDR_MAX];
+	struct nu_ws_frame f;
+
+	CHECK(rfbNuWsHeader(hdr, NU_WS_OP_BINARY, 125) == 2);
+	CHECK(hdr[0] == 0x82 && hdr[1] == 125);
+
+	CHECK(rfbNuWsHeader(hdr, NU_WS_OP_BINARY, 126) == 4);
+	CHECK(hdr[1] == 126 && hdr[2] == 0 && hdr[3] == 126);
+
+	CHECK(rfbNuWsHeader(hdr, NU_WS_OP_BINARY, 0xffff) == 4);
+	CHECK(hdr[2] == 0xff && hdr[3] == 0xff);
+
+	CHECK(rfbNuWsHeader(hdr, NU_WS_OP_BINARY, 0x10000) == 10);
+	CHECK(hdr[1] == 127);
+	CHECK(!memcmp(hdr + 2, "\0\0\0\0\0\1\0\0", 8));
+
+	/* the parser reads back what was built */
+	CHECK(rfbNuWsParseHeader(hdr, 9, &f) == 0);
+	CHECK(rfbNuWsParseHeader(hdr, 10, &f) == 10);
+	CHECK(f.fin && f.opcode == NU_WS_OP_BINARY && !f.masked && f.len == 0x10000);
+
+	/* reserved bits, fragmented or oversized control frames */
+	hdr[0] = 0xc2;
+	CHECK(rfbNuWsParseHeader(hdr, 10, &f) == -1);
+	hdr[0] = NU_WS_OP_PING;
+	hdr[1] = 0;
+	CHECK(rfbNuWsParseHeader(hdr, 2, &f) == -1);
+	CHECK(rfbNuWsHeader(hdr, NU_WS_OP_PING, 126) == 4);
+	CHECK(rfbNuWsParseHeader(hdr, 4, &f) == -1);
+}
+
+/* a masked client frame of opcode with payload, returns its length */
+static size_t client_frame(unsigned char *out, int fin, int opcode,
+						   const void *payload, size_t len)
+{
+	static const unsigned char mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+	size_t n = rfbNuWsHeader(out, opcode, len);
+
+	if (!fin)
+		out[0] &= 0x7f;
+	out[1] |= 0x80;
+	memcpy(out + n, mask, 4);
+	n += 4;
+	for (size_t i = 0; i < len; i++)
+		out[n + i] = ((const unsigned char *)payload)[i] ^ mask[i % 4];
+
+	return n + len;
+}
+
+static void test_decode(void)
+{
+	unsigned char wire[1024], buf[1024], data[300];
+	struct nu_ws_dec d;
+	size_t len = 0;
+
+	for (size_t i = 0; i < sizeof(data); i++)
+		data[i] = i * 13;
+
+	/* a fragmented message, a ping in between, then a long frame */
+	len += client_frame(wire + len, 0, NU_WS_OP_BINARY, data, 10);
+	len += client_frame(wire + len, 1, NU_WS_OP_PING, "hi", 2);
+	len += client_frame(wire + len, 1, NU_WS_OP_CONT, data + 10, 90);
+	len += client_frame(wire + len, 1, NU_WS_OP_BINARY, data + 100, 200);
+
+	/* however TCP splits it, the same bytes come out */
+	for (size_t split = 1; split <= len; split++)
+	{
+		size_t got = 0;
+
+		memset(&d, 0, sizeof(d));
+		for (size_t off = 0; off < len; off += split)
+		{
+			size_t n = len - off < split ? len - off : split;
+			ssize_t r;
+
+			memcpy(buf, wire + off, n);
+			r = rfbNuWsDecode(&d, buf, n);
+			CHECK(r >= 0);
+			if (r < 0)
+				break;
+			CHECK(got + r <= sizeof(data) && !memcmp(buf, data + got, r));
+			got += r;
+		}
+		CHECK(got == sizeof(data));
+		CHECK(d.ping && d.ping_len == 2 && !memcmp(d.ping_data, "hi", 2));
+		CHECK(!d.closed);
+	}
+
+	/* nothing after the close frame is decoded */
+	memset(&d, 0, sizeof(d));
+	len = client_frame(wire, 1, NU_WS_OP_CLOSE, "\x03\xe8", 2);
+	len += client_frame(wire + len, 1, NU_WS_OP_BINARY, data, 10);
+	memcpy(buf, wire, len);
+	CHECK(rfbNuWsDecode(&d, buf, len) == 0);
+	CHECK(d.closed);
+}
+
+static void test_decode_errors(void)
+{
+	unsigned char buf[64];
+	struct nu_ws_dec d;
+	size_t len;
+
+	/* clients have to mask */
+	memset(&d, 0, sizeof(d));
+	len = rfbNuWsHeader(buf, NU_WS_OP_BINARY, 3);
+	memcpy(buf + len, "abc", 3);
+	CHECK(rfbNuWsDecode(&d, buf, len + 3) == -1);
+
+	/* RFB is binary, text frames are refused */
+	memset(&d, 0, sizeof(d));
+	len = client_frame(buf, 1, NU_WS_OP_TEXT, "abc", 3);
+	CHECK(rfbNuWsDecode(&d, buf, len) == -1);
+
+	/* unknown opcodes */
+	memset(&d, 0, sizeof(d));
+	len = client_frame(buf, 1, 0x3, "abc", 3);
+	CHECK(rfbNuWsDecode(&d, buf, len) == -1);
+}
+
+int main(void)
+{
+	test_sha1();
+	test_request();
+	test_response();
+	test_header();
+	test_decode();
+	test_decode_errors();
+
+	return failures ? 1 : 0;
+}